@@ -0,0 +1,302 @@
+#include "Benchmark.h"
+#include "Checkpoint.h"
+#include "Options.h"
+#include "PerfCounters.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+// Two-sided 95% quantiles of Student's t distribution, for 1 to 30 degrees of freedom.
+static const double tQuantiles[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static uint64_t MonotonicRawNanoseconds() {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+static bool IsTSCInvariant() {
+#if defined(__x86_64__)
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.compare(0, 5, "flags") == 0)
+            return line.find(" constant_tsc") != std::string::npos && line.find(" nonstop_tsc") != std::string::npos;
+    }
+#endif
+    return false;
+}
+
+// Nanoseconds per TSC tick, measured once over ~20ms.
+static double CalibrateTSC() {
+#if defined(__x86_64__)
+    static double nanosecondsPerTick = 0;
+    if (nanosecondsPerTick == 0)
+    {
+        uint64_t startTime = MonotonicRawNanoseconds();
+        uint64_t startTicks = __builtin_ia32_rdtsc();
+        while (MonotonicRawNanoseconds() - startTime < 20000000)
+            ;
+        uint64_t endTicks = __builtin_ia32_rdtsc();
+        uint64_t endTime = MonotonicRawNanoseconds();
+        nanosecondsPerTick = (double)(endTime - startTime) / (double)(endTicks - startTicks);
+    }
+    return nanosecondsPerTick;
+#else
+    return 1;
+#endif
+}
+
+static std::string FormatTime(double nanoseconds) {
+    static const char* units[] = { "ns", "us", "ms", "s" };
+    size_t unit = 0;
+    while (nanoseconds >= 1000 && unit < 3)
+    {
+        nanoseconds /= 1000;
+        unit++;
+    }
+
+    // Three significant digits.
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(nanoseconds < 10 ? 2 : nanoseconds < 100 ? 1 : 0)
+        << nanoseconds << " " << units[unit];
+    return out.str();
+}
+
+static std::string FormatCount(double count) {
+    static const char* suffixes[] = { "", "K", "M", "G" };
+    size_t suffix = 0;
+    while (count >= 1000 && suffix < 3)
+    {
+        count /= 1000;
+        suffix++;
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(count < 10 ? 2 : count < 100 ? 1 : 0) << count << suffixes[suffix];
+    return out.str();
+}
+
+// Linear interpolation between the closest ranks.
+static double Percentile(const std::vector<double>& sorted, double percentile) {
+    double rank = percentile / 100 * (sorted.size() - 1);
+    size_t lower = (size_t)rank;
+    size_t upper = std::min(lower + 1, sorted.size() - 1);
+    return sorted[lower] + (sorted[upper] - sorted[lower]) * (rank - lower);
+}
+
+BenchmarkSession::BenchmarkSession(size_t iterations, double targetCI) : iterations(iterations), targetCI(targetCI) {
+    std::string clock = OptionsStore::GetOption("benchmark_clock");
+    if (clock == "tsc")
+        useTSC = true;
+    else if (clock == "")
+        useTSC = IsTSCInvariant();
+
+    if (useTSC)
+        nanosecondsPerTick = CalibrateTSC();
+
+    std::string warmup = OptionsStore::GetOption("benchmark_warmup");
+    long warmupOption = warmup != "" ? std::atol(warmup.c_str()) : -1;
+    if (warmup != "" && warmupOption < 0)
+        std::cout << "benchmark_warmup must be at least 0, using the default\n";
+
+    if (warmupOption >= 0)
+        warmupIterations = warmupOption;
+    else if (targetCI > 0)
+        warmupIterations = 10;
+    else
+        warmupIterations = iterations > 1 ? std::min<size_t>(iterations / 10 + 1, 100) : 0;
+
+    uint64_t overhead = UINT64_MAX;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        uint64_t start = Now();
+        overhead = std::min(overhead, Now() - start);
+    }
+    timerOverhead = overhead * nanosecondsPerTick;
+
+    samples.reserve(targetCI > 0 ? 1024 : iterations);
+
+    if (PerfCounters::AnySelected())
+        counters.reset(new PerfCounters());
+}
+
+BenchmarkSession::~BenchmarkSession() {
+}
+
+void BenchmarkSession::StartCounters() {
+    if (counters)
+        counters->Start();
+}
+
+void BenchmarkSession::StopCounters() {
+    if (counters)
+        counters->Stop();
+}
+
+void BenchmarkSession::EnterCheckpointChild() {
+    if (!Checkpoint::IsForked())
+        return;
+
+    // The counters of the parent count the parent.
+    if (counters)
+        counters.reset(new PerfCounters(false));
+    Profiler::EnterCheckpointChild();
+}
+
+void BenchmarkSession::SendSampleToParent() {
+    if (samples.empty())
+        return;
+
+    std::string result((const char*)&samples.back(), sizeof(uint64_t));
+    if (counters)
+    {
+        std::vector<double> counterSample = counters->GetLastSample();
+        result.append((const char*)counterSample.data(), counterSample.size() * sizeof(double));
+    }
+    Checkpoint::SetResult(result);
+}
+
+bool BenchmarkSession::ReceiveSampleFromChild() {
+    std::string result;
+    if (!Checkpoint::GetResult(result) || result.size() < sizeof(uint64_t))
+        return false;
+
+    uint64_t ticks;
+    memcpy(&ticks, result.data(), sizeof(ticks));
+    AddSample(ticks);
+
+    if (counters)
+    {
+        std::vector<double> counterSample((result.size() - sizeof(uint64_t)) / sizeof(double));
+        memcpy(counterSample.data(), result.data() + sizeof(uint64_t), counterSample.size() * sizeof(double));
+        counters->AddSample(counterSample);
+    }
+    return true;
+}
+
+bool BenchmarkSession::NeedsMoreSamples() {
+    if (samples.size() >= iterations)
+        return false;
+    if (targetCI <= 0 || samples.size() < nextCheck)
+        return true;
+
+    // Sorting every sample is too expensive to do after each iteration.
+    nextCheck = samples.size() + std::max<size_t>(10, samples.size() / 10);
+    return ComputeStatistics().relativeCI > targetCI;
+}
+
+BenchmarkStatistics BenchmarkSession::ComputeStatistics() const {
+    std::vector<double> nanoseconds;
+    nanoseconds.reserve(samples.size());
+    for (uint64_t sample : samples)
+        nanoseconds.push_back(std::max(0.0, sample * nanosecondsPerTick - timerOverhead));
+    return ComputeStatistics(std::move(nanoseconds));
+}
+
+BenchmarkStatistics BenchmarkSession::ComputeStatistics(std::vector<double> sorted) {
+    BenchmarkStatistics statistics;
+    if (sorted.empty())
+        return statistics;
+
+    std::sort(sorted.begin(), sorted.end());
+
+    // Quartiles aren't meaningful with only a few samples, and counters of rare events
+    // (e.g. page faults) have an empty interquartile range: everything else would be rejected.
+    double q1 = Percentile(sorted, 25);
+    double q3 = Percentile(sorted, 75);
+    if (sorted.size() >= 8 && q3 > q1)
+    {
+        double low = q1 - 1.5 * (q3 - q1);
+        double high = q3 + 1.5 * (q3 - q1);
+        auto first = std::lower_bound(sorted.begin(), sorted.end(), low);
+        auto last = std::upper_bound(sorted.begin(), sorted.end(), high);
+        statistics.rejected = sorted.size() - (last - first);
+        sorted = std::vector<double>(first, last);
+    }
+
+    size_t n = sorted.size();
+    statistics.samples = n;
+    statistics.min = sorted.front();
+    statistics.median = Percentile(sorted, 50);
+    statistics.p90 = Percentile(sorted, 90);
+    statistics.p99 = Percentile(sorted, 99);
+
+    double sum = 0;
+    for (double sample : sorted)
+        sum += sample;
+    statistics.mean = sum / n;
+
+    if (n > 1)
+    {
+        double squares = 0;
+        for (double sample : sorted)
+            squares += (sample - statistics.mean) * (sample - statistics.mean);
+        statistics.stddev = std::sqrt(squares / (n - 1));
+
+        double t = n - 1 <= 30 ? tQuantiles[n - 2] : 1.96;
+        if (statistics.mean > 0)
+            statistics.relativeCI = 100 * t * statistics.stddev / std::sqrt((double)n) / statistics.mean;
+    }
+
+    return statistics;
+}
+
+void BenchmarkSession::Report(std::ostream& out) const {
+    BenchmarkStatistics statistics = ComputeStatistics();
+    if (samples.size() == 1)
+    {
+        out << "1 iteration: " << FormatTime(statistics.min) << "\n";
+        return;
+    }
+
+    out << samples.size() << " iterations";
+    if (statistics.rejected > 0)
+        out << " (" << statistics.rejected << " outliers rejected)";
+    out << ", " << warmupIterations << " warm-up (in place), clock: ";
+    if (useTSC)
+        out << "tsc (" << std::fixed << std::setprecision(2) << 1 / nanosecondsPerTick << " GHz)";
+    else
+        out << "monotonic_raw";
+    out << ", timer overhead: " << FormatTime(timerOverhead) << " (subtracted)\n";
+
+    out << "  min " << FormatTime(statistics.min)
+        << "  median " << FormatTime(statistics.median)
+        << "  mean " << FormatTime(statistics.mean)
+        << "  p90 " << FormatTime(statistics.p90)
+        << "  p99 " << FormatTime(statistics.p99)
+        << "  stddev " << FormatTime(statistics.stddev) << "\n";
+    out << "  mean 95% CI: +/-" << std::fixed << std::setprecision(2) << statistics.relativeCI << "%";
+    if (targetCI > 0 && statistics.relativeCI > targetCI)
+        out << " (target of " << targetCI << "% not reached)";
+    out << "\n";
+
+    if (!counters)
+        return;
+
+    for (auto& counter : counters->GetSamples())
+    {
+        BenchmarkStatistics counterStatistics = ComputeStatistics(counter.second);
+        out << "  " << counter.first << ":"
+            << "  min " << FormatCount(counterStatistics.min)
+            << "  median " << FormatCount(counterStatistics.median)
+            << "  mean " << FormatCount(counterStatistics.mean)
+            << "  p90 " << FormatCount(counterStatistics.p90)
+            << "  p99 " << FormatCount(counterStatistics.p99)
+            << "  stddev " << FormatCount(counterStatistics.stddev)
+            << "  +/-" << std::fixed << std::setprecision(2) << counterStatistics.relativeCI << "%";
+        if (counterStatistics.rejected > 0)
+            out << "  (" << counterStatistics.rejected << " outliers rejected)";
+        out << "\n";
+    }
+}
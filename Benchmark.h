@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <time.h>
+
+// Timing of the "run" command of the interactive cycle.
+//
+// Iterations are timed one by one after a few warm-up iterations, with the TSC when it is
+// invariant (calibrated against CLOCK_MONOTONIC_RAW) or with CLOCK_MONOTONIC_RAW otherwise.
+// The "benchmark_clock" option ("tsc" or "monotonic_raw") and the "benchmark_warmup" option
+// override the defaults. The overhead of reading the clock, the smallest time measured around
+// no code at all, is subtracted from every sample. Outliers are rejected with Tukey's fences
+// before computing statistics.
+// Warm-up iterations run in place, before the checkpoint of the first timed iteration: with
+// checkpoints, every timed iteration starts from the state the warm-up left behind.
+//
+// Selected performance counters (see PerfCounters.h) are read around every timed iteration,
+// and summarized with the same statistics.
+//
+// The session is used by helpers.cpp, which runs in the JIT: Now() is inline so that reading
+// the clock doesn't go through the host.
+
+struct BenchmarkStatistics {
+    size_t samples = 0;
+    size_t rejected = 0;
+    // In nanoseconds.
+    double min = 0;
+    double median = 0;
+    double mean = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double stddev = 0;
+    // Half-width of the 95% confidence interval of the mean, in % of the mean.
+    double relativeCI = 0;
+};
+
+class PerfCounters;
+
+class BenchmarkSession {
+public:
+    // Times `iterations` iterations. If targetCI is not zero, stops as soon as the confidence
+    // interval of the mean is within targetCI% of it, after at most `iterations` iterations.
+    BenchmarkSession(size_t iterations, double targetCI = 0);
+    ~BenchmarkSession();
+
+    size_t GetWarmupIterations() const { return warmupIterations; }
+    bool NeedsMoreSamples();
+    void AddSample(uint64_t ticks) { samples.push_back(ticks); }
+    // Around the timed region, so that reading the counters is not timed.
+    void StartCounters();
+    void StopCounters();
+
+    // With built-in checkpoints (see Checkpoint.h), iterations run from the checkpoint and
+    // their sample is passed across the restore. A forked child opens its own counters.
+    void EnterCheckpointChild();
+    void SendSampleToParent();
+    // False if the child didn't send a sample back.
+    bool ReceiveSampleFromChild();
+    // Statistics of the timed iterations.
+    BenchmarkStatistics ComputeStatistics() const;
+    static BenchmarkStatistics ComputeStatistics(std::vector<double> values);
+    void Report(std::ostream& out) const;
+
+    uint64_t Now() const {
+#if defined(__x86_64__)
+        if (useTSC)
+        {
+            // Fenced, so that the timed code can't be reordered around the read.
+            unsigned int aux;
+            __builtin_ia32_lfence();
+            uint64_t ticks = __builtin_ia32_rdtscp(&aux);
+            __builtin_ia32_lfence();
+            return ticks;
+        }
+#endif
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+        return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+    }
+
+private:
+    size_t iterations;
+    double targetCI;
+    size_t warmupIterations;
+    size_t nextCheck = 10;
+    bool useTSC = false;
+    double nanosecondsPerTick = 1;
+    // Smallest time measured around no code at all, in nanoseconds.
+    double timerOverhead = 0;
+    std::vector<uint64_t> samples;
+    std::unique_ptr<PerfCounters> counters;
+};
@@ -1,12 +1,13 @@
 #include "CallGraph.h"
 #include <iostream>
+#include <algorithm>
 
 void JITCallGraph::AddModule(llvm::Module & module) {
     for (Function& function : module)
     {
         if (!function.isDeclaration())
         {
-            CallGraphNode* parent = GetOrCreateNode(function.getName());
+            NodeId parent = GetOrCreateNode(function.getName());
             for (BasicBlock& block : function)
             {
                 for (Instruction& inst : block)
@@ -23,35 +24,254 @@ void JITCallGraph::AddModule(llvm::Module & module) {
 
                     if (target && target->hasName())
                     {
-                        AddChild(parent, target->getName());
+                        pendingEdges.push_back(std::make_pair(parent, GetOrCreateNode(target->getName())));
                     }
                 }
             }
         }
     }
+
+    // The index is rebuilt on the next query, so that adding many modules in a row
+    // doesn't recompute it every time.
+    dirty = true;
 }
 
 std::set<std::string> JITCallGraph::GetNodeAndAllChildren(const std::string & name) {
     std::set<std::string> nodes;
 
-    auto parent = GetNode(name);
-
-    if (parent)
+    NodeId parent;
+    if (GetNode(name, parent))
     {
-        GetAllChildrenForNodeRec(parent, nodes);
+        UpdateIndex();
+
+        auto& reachable = GetReachableComponents(componentOf[parent]);
+        for (ComponentId component = 0; component < componentMembers.size(); ++component)
+        {
+            if (TestBit(reachable, component))
+            {
+                for (NodeId member : componentMembers[component])
+                    nodes.insert(names[member]);
+            }
+        }
     }
     return nodes;
 }
 
-inline void JITCallGraph::GetAllChildrenForNodeRec(CallGraphNode * node, std::set<std::string>& nodes) {
-    if (nodes.find(node->name) != nodes.end())
+std::vector<std::string> JITCallGraph::GetChildren(const std::string & name) {
+    std::vector<std::string> children;
+
+    NodeId parent;
+    if (GetNode(name, parent))
+    {
+        UpdateIndex();
+
+        for (uint32_t i = childOffsets[parent]; i < childOffsets[parent + 1]; ++i)
+        {
+            children.push_back(names[childIndices[i]]);
+        }
+    }
+    return children;
+}
+
+bool JITCallGraph::IsReachable(const std::string & from, const std::string & to) {
+    NodeId fromNode, toNode;
+    if (!GetNode(from, fromNode) || !GetNode(to, toNode))
+        return false;
+
+    UpdateIndex();
+
+    return TestBit(GetReachableComponents(componentOf[fromNode]), componentOf[toNode]);
+}
+
+void JITCallGraph::AddEdge(const std::string & from, const std::string & to, uint64_t weight) {
+    NodeId fromNode = GetOrCreateNode(from);
+    NodeId toNode = GetOrCreateNode(to);
+
+    pendingEdges.push_back(std::make_pair(fromNode, toNode));
+    edgeWeights[GetEdgeKey(fromNode, toNode)] += weight;
+    dirty = true;
+}
+
+uint64_t JITCallGraph::GetEdgeWeight(const std::string & from, const std::string & to) {
+    NodeId fromNode, toNode;
+    if (!GetNode(from, fromNode) || !GetNode(to, toNode))
+        return 0;
+
+    auto it = edgeWeights.find(GetEdgeKey(fromNode, toNode));
+    return it != edgeWeights.end() ? it->second : 0;
+}
+
+JITCallGraph::NodeId JITCallGraph::GetOrCreateNode(const std::string & name) {
+    auto it = nodeIds.find(name);
+    if (it != nodeIds.end())
+        return it->second;
+
+    NodeId id = (NodeId)names.size();
+    nodeIds[name] = id;
+    names.push_back(name);
+    return id;
+}
+
+bool JITCallGraph::GetNode(const std::string & name, NodeId & id) const {
+    auto it = nodeIds.find(name);
+    if (it == nodeIds.end())
+        return false;
+
+    id = it->second;
+    return true;
+}
+
+void JITCallGraph::UpdateIndex() {
+    if (!dirty)
         return;
 
-    nodes.insert(node->name);
+    // Rebuild the adjacency list from the old edges and the new ones, without duplicates.
+    std::vector<std::pair<NodeId, NodeId>> edges = std::move(pendingEdges);
+    pendingEdges.clear();
+    for (NodeId node = 0; node + 1 < childOffsets.size(); ++node)
+    {
+        for (uint32_t i = childOffsets[node]; i < childOffsets[node + 1]; ++i)
+            edges.push_back(std::make_pair(node, childIndices[i]));
+    }
+
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    childOffsets.assign(names.size() + 1, 0);
+    childIndices.resize(edges.size());
+    for (size_t i = 0; i < edges.size(); ++i)
+    {
+        childOffsets[edges[i].first + 1]++;
+        childIndices[i] = edges[i].second;
+    }
+    for (size_t node = 0; node < names.size(); ++node)
+        childOffsets[node + 1] += childOffsets[node];
+
+    ComputeComponents();
+
+    dirty = false;
+}
+
+void JITCallGraph::ComputeComponents() {
+    // Iterative version of Tarjan's algorithm.
+    const uint32_t unvisited = UINT32_MAX;
+    size_t numNodes = names.size();
+
+    std::vector<uint32_t> index(numNodes, unvisited);
+    std::vector<uint32_t> lowLink(numNodes, 0);
+    std::vector<bool> onStack(numNodes, false);
+    std::vector<NodeId> stack;
+    // Each frame holds a node and the position of the next child to visit.
+    std::vector<std::pair<NodeId, uint32_t>> frames;
+    uint32_t nextIndex = 0;
+
+    componentOf.assign(numNodes, 0);
+    componentMembers.clear();
+
+    auto visit = [&](NodeId node)
+    {
+        index[node] = lowLink[node] = nextIndex++;
+        stack.push_back(node);
+        onStack[node] = true;
+        frames.push_back(std::make_pair(node, childOffsets[node]));
+    };
+
+    for (NodeId root = 0; root < numNodes; ++root)
+    {
+        if (index[root] != unvisited)
+            continue;
+
+        visit(root);
+        while (!frames.empty())
+        {
+            NodeId node = frames.back().first;
+            uint32_t next = frames.back().second;
+
+            if (next < childOffsets[node + 1])
+            {
+                frames.back().second++;
+
+                NodeId child = childIndices[next];
+                if (index[child] == unvisited)
+                    visit(child);
+                else if (onStack[child])
+                    lowLink[node] = std::min(lowLink[node], index[child]);
+                continue;
+            }
+
+            frames.pop_back();
+            if (!frames.empty())
+            {
+                NodeId parent = frames.back().first;
+                lowLink[parent] = std::min(lowLink[parent], lowLink[node]);
+            }
+
+            if (lowLink[node] == index[node])
+            {
+                ComponentId component = (ComponentId)componentMembers.size();
+                componentMembers.emplace_back();
+
+                NodeId member;
+                do
+                {
+                    member = stack.back();
+                    stack.pop_back();
+                    onStack[member] = false;
+                    componentOf[member] = component;
+                    componentMembers.back().push_back(member);
+                } while (member != node);
+            }
+        }
+    }
+
+    size_t numComponents = componentMembers.size();
+    componentChildren.assign(numComponents, std::vector<ComponentId>());
+    for (NodeId node = 0; node < numNodes; ++node)
+    {
+        for (uint32_t i = childOffsets[node]; i < childOffsets[node + 1]; ++i)
+        {
+            ComponentId from = componentOf[node];
+            ComponentId to = componentOf[childIndices[i]];
+            if (from != to)
+                componentChildren[from].push_back(to);
+        }
+    }
+    for (auto& children : componentChildren)
+    {
+        std::sort(children.begin(), children.end());
+        children.erase(std::unique(children.begin(), children.end()), children.end());
+    }
+
+    reachableComponents.assign(numComponents, std::vector<uint64_t>());
+    reachableComputed.assign(numComponents, false);
+}
+
+const std::vector<uint64_t>& JITCallGraph::GetReachableComponents(ComponentId component) {
+    auto& bits = reachableComponents[component];
+    if (reachableComputed[component])
+        return bits;
 
-    auto& children = node->children;
-    for (auto child : children)
+    // Only the result for the queried component is kept: memoizing every component
+    // along the way would take quadratic memory on long call chains.
+    bits.assign((componentMembers.size() + 63) / 64, 0);
+    bits[component / 64] |= (uint64_t)1 << (component % 64);
+
+    std::vector<ComponentId> worklist{ component };
+    while (!worklist.empty())
     {
-        GetAllChildrenForNodeRec(child, nodes);
+        ComponentId current = worklist.back();
+        worklist.pop_back();
+
+        for (ComponentId child : componentChildren[current])
+        {
+            if (!TestBit(bits, child))
+            {
+                bits[child / 64] |= (uint64_t)1 << (child % 64);
+                worklist.push_back(child);
+            }
+        }
     }
+
+    reachableComputed[component] = true;
+    return bits;
 }
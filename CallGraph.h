@@ -3,65 +3,76 @@
 #include "llvm/IR/Instructions.h"
 #include <unordered_map>
 #include <set>
+#include <vector>
+#include <cstdint>
 
 using namespace llvm;
 
 
-struct CallGraphNode {
-    CallGraphNode(const std::string& name) : name(name) {}
-
-    void AddChild(CallGraphNode* child) { children.insert(child); }
-
-    std::string name;
-    std::set<CallGraphNode*> children;
-};
-
+// Call graph of all the code added to the JIT.
+//
+// Function names are interned to integer IDs and edges are kept in a compressed
+// (CSR) adjacency list. Queries run on the condensation of the graph into strongly
+// connected components: the set of components reachable from a queried component
+// is computed once, as a bitset, and reused until new modules are added.
+// Nothing in here recurses, so deep call chains can't overflow the stack.
 class JITCallGraph {
 public:
     JITCallGraph() {}
 
-    ~JITCallGraph() {
-        for (auto& node : nodes)
-        {
-            delete node.second;
-        }
-        nodes.clear();
-    }
-
     void AddModule(llvm::Module& module);
 
 
 
     std::set<std::string> GetNodeAndAllChildren(const std::string& name);
+    std::vector<std::string> GetChildren(const std::string& name);
+
+    // Returns true if 'to' can be reached from 'from'. Every node reaches itself.
+    bool IsReachable(const std::string& from, const std::string& to);
+
+    // Adds an edge that isn't visible in the IR, such as an indirect call observed at
+    // runtime. The weight (number of calls observed) accumulates over multiple additions.
+    void AddEdge(const std::string& from, const std::string& to, uint64_t weight);
+    uint64_t GetEdgeWeight(const std::string& from, const std::string& to);
 
 
 private:
-    void GetAllChildrenForNodeRec(CallGraphNode* node, std::set<std::string>& nodes);
-    
-    void AddChild(const std::string& parent, const std::string& child) {
-        auto parentNode = GetOrCreateNode(parent);
-        auto childNode = GetOrCreateNode(child);
-        parentNode->AddChild(childNode);
-    }
+    typedef uint32_t NodeId;
+    typedef uint32_t ComponentId;
 
-    void AddChild(CallGraphNode* parent, const std::string& child) {
-        parent->AddChild(GetOrCreateNode(child));
-    }
+    NodeId GetOrCreateNode(const std::string& name);
+    bool GetNode(const std::string& name, NodeId& id) const;
+
+    // Merges the pending edges into the adjacency list and recomputes the components.
+    void UpdateIndex();
+    void ComputeComponents();
+    const std::vector<uint64_t>& GetReachableComponents(ComponentId component);
 
-    CallGraphNode* GetNode(const std::string& name) {
-        return nodes[name];
+    static bool TestBit(const std::vector<uint64_t>& bits, size_t index) {
+        return (bits[index / 64] >> (index % 64)) & 1;
     }
 
-    CallGraphNode* GetOrCreateNode(const std::string& name) {
-        auto node = nodes[name];
-        if (!node)
-        {
-            node = new CallGraphNode(name);
-            nodes[name] = node;
-        }
+    std::unordered_map<std::string, NodeId> nodeIds;
+    std::vector<std::string> names;
 
-        return node;
-    }
+    static uint64_t GetEdgeKey(NodeId from, NodeId to) { return ((uint64_t)from << 32) | to; }
+
+    // Edges added since the index was last updated.
+    std::vector<std::pair<NodeId, NodeId>> pendingEdges;
+    bool dirty = false;
+
+    std::unordered_map<uint64_t, uint64_t> edgeWeights;
+
+    // The children of node i are childIndices[childOffsets[i]] to childIndices[childOffsets[i + 1] - 1].
+    std::vector<uint32_t> childOffsets{ 0 };
+    std::vector<NodeId> childIndices;
+
+    // Strongly connected components of the graph.
+    std::vector<ComponentId> componentOf;
+    std::vector<std::vector<NodeId>> componentMembers;
+    std::vector<std::vector<ComponentId>> componentChildren;
 
-    std::unordered_map<std::string, CallGraphNode*> nodes;
+    // Memoized reachability, a bitset over all components for each queried component.
+    std::vector<std::vector<uint64_t>> reachableComponents;
+    std::vector<bool> reachableComputed;
 };
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include "Checkpoint.h"
+#include "Options.h"
+#include "Snapshot.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+bool Checkpoint::inChild = false;
+int Checkpoint::resultPipe = -1;
+bool Checkpoint::paused = false;
+std::function<void(bool)> Checkpoint::pauseHandler;
+std::function<void()> Checkpoint::resumeHandler;
+std::string Checkpoint::childResult;
+std::string Checkpoint::lastResult;
+bool Checkpoint::lastChildSucceeded = false;
+
+bool Checkpoint::UseSnapshots() {
+    static bool useSnapshots = OptionsStore::GetOption("checkpoint_engine") == "snapshot";
+    return useSnapshots;
+}
+
+bool Checkpoint::IsForked() {
+    return !UseSnapshots();
+}
+
+void Checkpoint::SetPauseHandlers(std::function<void(bool forking)> pause, std::function<void()> resume) {
+    pauseHandler = pause;
+    resumeHandler = resume;
+}
+
+int Checkpoint::Save() {
+    // A nested Save (which fails) must not pause the host again.
+    bool pausing = !paused && pauseHandler;
+    if (pausing)
+    {
+        pauseHandler(!UseSnapshots());
+        paused = true;
+    }
+
+    int state = UseSnapshots() ? SnapshotCheckpoint::Save() : SaveFork();
+
+    // Code running from the checkpoint keeps the host paused until the checkpoint is restored,
+    // which returns here again.
+    if (pausing && state != CheckpointInChild)
+    {
+        paused = false;
+        if (resumeHandler)
+            resumeHandler();
+    }
+    return state;
+}
+
+int Checkpoint::Restore() {
+    return UseSnapshots() ? SnapshotCheckpoint::Restore() : RestoreFork();
+}
+
+void Checkpoint::SetResult(const std::string& result) {
+    if (UseSnapshots())
+        SnapshotCheckpoint::SetResult(result);
+    else
+        childResult = result;
+}
+
+int Checkpoint::SaveFork() {
+    if (inChild)
+    {
+        std::cerr << "Nested checkpoints are not supported\n";
+        return CheckpointInPlace;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        std::cerr << "Cannot create checkpoint: " << strerror(errno) << "\n";
+        return CheckpointInPlace;
+    }
+
+    // Otherwise buffered output would be printed by both processes.
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+
+    pid_t child = fork();
+    if (child < 0)
+    {
+        std::cerr << "Cannot create checkpoint: " << strerror(errno) << "\n";
+        close(fds[0]);
+        close(fds[1]);
+        return CheckpointInPlace;
+    }
+
+    if (child == 0)
+    {
+        close(fds[0]);
+        resultPipe = fds[1];
+        inChild = true;
+        childResult.clear();
+        return CheckpointInChild;
+    }
+
+    close(fds[1]);
+    lastResult.clear();
+    char buffer[4096];
+    ssize_t bytes;
+    while ((bytes = read(fds[0], buffer, sizeof(buffer))) != 0)
+    {
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        lastResult.append(buffer, bytes);
+    }
+    close(fds[0]);
+
+    int status;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    lastChildSucceeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFSIGNALED(status))
+        std::cerr << "Checkpointed run terminated by signal " << WTERMSIG(status) << " (" << strsignal(WTERMSIG(status)) << ")\n";
+    else if (!lastChildSucceeded)
+        std::cerr << "Checkpointed run exited with status " << WEXITSTATUS(status) << "\n";
+
+    return CheckpointRestored;
+}
+
+int Checkpoint::RestoreFork() {
+    if (!inChild)
+        return 0;
+
+    size_t written = 0;
+    while (written < childResult.size())
+    {
+        ssize_t bytes = write(resultPipe, childResult.data() + written, childResult.size() - written);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        written += bytes;
+    }
+    close(resultPipe);
+
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+    // Destructors and exit handlers belong to the parent.
+    _exit(0);
+}
+
+bool Checkpoint::GetResult(std::string& result) {
+    if (UseSnapshots())
+        return SnapshotCheckpoint::GetResult(result);
+
+    result = lastResult;
+    return lastChildSucceeded && !lastResult.empty();
+}
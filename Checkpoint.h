@@ -0,0 +1,64 @@
+#pragma once
+#include <functional>
+#include <string>
+
+// Values returned by saveCheckpoint().
+enum CheckpointState {
+    // The state is saved in place (e.g. by a checkpoint tool): restoreCheckpoint() rolls it back.
+    CheckpointInPlace = 0,
+    // Running from the checkpoint (in a forked child, or on a snapshot): restoreCheckpoint()
+    // discards everything done since, and doesn't return.
+    CheckpointInChild = 1,
+    // saveCheckpoint() returning again after restoreCheckpoint(), with the state of the checkpoint.
+    CheckpointRestored = 2,
+};
+
+// Built-in checkpoints, used when no checkpoint tool provides saveCheckpoint/restoreCheckpoint.
+// The "checkpoint_engine" option selects how they work:
+//
+// - "fork" (default): saving a checkpoint forks. The child continues from the checkpoint, and
+//   every change it makes is discarded when it exits in restoreCheckpoint(); the parent waits
+//   for it, and then continues from the checkpoint as well. Pages are shared copy-on-write, so
+//   the cost is proportional to the memory the child touches, plus the cost of the fork itself.
+//   Only the thread that saves the checkpoint exists in the child.
+// - "snapshot": the process tracks the pages written after the checkpoint, and restores them
+//   in place (see Snapshot.h). Cheaper than fork for processes with many mappings or threads.
+//
+// In both cases, code running from the checkpoint can pass a result (e.g. its measurements)
+// to the code that runs after the restore. Checkpoints can't be nested.
+//
+// The host's own threads (background compilation, the control channel) would hold locks in a
+// forked child, or have their memory rolled back under them by a snapshot: the host pauses them
+// through the handlers set with SetPauseHandlers, from before the checkpoint is saved until it
+// has been restored. Threads of the program itself are not paused; the snapshot engine stops them
+// only while it saves and restores memory.
+class Checkpoint {
+public:
+    static int Save();
+    static int Restore();
+
+    // pause is called with true if the checkpoint forks.
+    static void SetPauseHandlers(std::function<void(bool forking)> pause, std::function<void()> resume);
+
+    // True if code running from the checkpoint is in another process.
+    static bool IsForked();
+
+    // Before restoreCheckpoint(): data passed to the code that runs after the restore.
+    static void SetResult(const std::string& result);
+    // After the restore: the result of the last run. False if it sent nothing or didn't exit normally.
+    static bool GetResult(std::string& result);
+
+private:
+    static int SaveFork();
+    static int RestoreFork();
+    static bool UseSnapshots();
+
+    static bool inChild;
+    static int resultPipe;
+    static bool paused;
+    static std::function<void(bool)> pauseHandler;
+    static std::function<void()> resumeHandler;
+    static std::string childResult;
+    static std::string lastResult;
+    static bool lastChildSucceeded;
+};
@@ -0,0 +1,67 @@
+#include "Disassembler.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstPrinter.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+FunctionDisassembler::FunctionDisassembler(const TargetMachine& TM) : TM(TM) {
+    const Target& target = TM.getTarget();
+    const MCAsmInfo* asmInfo = TM.getMCAsmInfo();
+    const MCRegisterInfo* registerInfo = TM.getMCRegisterInfo();
+
+    context.reset(new MCContext(asmInfo, registerInfo, nullptr));
+    disassembler.reset(target.createMCDisassembler(*TM.getMCSubtargetInfo(), *context));
+    printer.reset(target.createMCInstPrinter(TM.getTargetTriple(), asmInfo->getAssemblerDialect(), *asmInfo,
+        *TM.getMCInstrInfo(), *registerInfo));
+
+    if (!disassembler || !printer)
+    {
+        llvm::errs() << "No disassembler available for " << TM.getTargetTriple().str() << "\n";
+        disassembler.reset();
+    }
+}
+
+FunctionDisassembler::~FunctionDisassembler() {}
+
+std::vector<DisassembledInstruction> FunctionDisassembler::Disassemble(uint64_t address, uint64_t size) {
+    std::vector<DisassembledInstruction> instructions;
+    if (!disassembler)
+        return instructions;
+
+    ArrayRef<uint8_t> bytes((const uint8_t*)address, size);
+    for (uint64_t offset = 0; offset < size; )
+    {
+        DisassembledInstruction instruction;
+        instruction.address = address + offset;
+
+        MCInst inst;
+        uint64_t instSize = 0;
+        raw_string_ostream text(instruction.text);
+        if (disassembler->getInstruction(inst, instSize, bytes.slice(offset), instruction.address, nulls(), nulls()) == MCDisassembler::Success)
+        {
+            printer->printInst(&inst, text, "", *TM.getMCSubtargetInfo());
+        }
+        else
+        {
+            instSize = 1;
+            text << "\t.byte\t" << format_hex(bytes[offset], 4);
+        }
+        text.flush();
+
+        instruction.size = instSize;
+        instructions.push_back(instruction);
+        offset += instSize;
+    }
+
+    return instructions;
+}
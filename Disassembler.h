@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class MCContext;
+class MCDisassembler;
+class MCInstPrinter;
+class TargetMachine;
+}
+
+struct DisassembledInstruction {
+    uint64_t address = 0;
+    uint64_t size = 0;
+    std::string text;
+    // Source line the instruction was generated from, if the program has debug info.
+    std::string file;
+    uint32_t line = 0;
+};
+
+// The code of one emitted copy of a function.
+struct DisassembledFunction {
+    std::string symbol;
+    // "original", "optimized", "layout", "instrumented" or "pgo".
+    std::string kind;
+    uint64_t address = 0;
+    std::vector<DisassembledInstruction> instructions;
+};
+
+// Disassembles JIT'd code with the MC layer of the JIT's target.
+class FunctionDisassembler {
+public:
+    FunctionDisassembler(const llvm::TargetMachine& TM);
+    ~FunctionDisassembler();
+
+    bool IsAvailable() const { return disassembler != nullptr; }
+
+    // Bytes that can't be decoded are shown one at a time.
+    std::vector<DisassembledInstruction> Disassemble(uint64_t address, uint64_t size);
+
+private:
+    const llvm::TargetMachine& TM;
+    std::unique_ptr<llvm::MCContext> context;
+    std::unique_ptr<llvm::MCDisassembler> disassembler;
+    std::unique_ptr<llvm::MCInstPrinter> printer;
+};
@@ -63,4 +63,14 @@ std::string ShowPromptAndGetSingleInput(const std::string& prompt) {
     std::getline(std::cin, command);
     trim(command);
     return command;
+}
+
+static HostCommandHandler hostCommandHandler;
+
+void SetHostCommandHandler(HostCommandHandler handler) {
+    hostCommandHandler = handler;
+}
+
+bool HandleHostCommand(const std::vector<std::string>& tokens) {
+    return hostCommandHandler && hostCommandHandler(tokens);
 }
\ No newline at end of file
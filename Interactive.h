@@ -6,6 +6,7 @@
 #include <sstream>
 #include <cstdlib>
 #include <cctype>
+#include <functional>
 
 
 std::vector <std::string> split(std::string strToSplit, char delimeter, bool trimEach = false);
@@ -18,4 +19,11 @@ std::vector<std::string> ShowPromptAndGetInput(const std::string& prompt);
 std::string ShowPromptAndGetSingleInput(const std::string& prompt);
 
 bool IsYes(const std::string& command);
-bool IsNo(const std::string& command);
\ No newline at end of file
+bool IsNo(const std::string& command);
+
+// Commands of the host that the interactive cycle accepts too, such as "pgo": the cycle is
+// compiled with the program, so it only reaches the JIT through this handler.
+using HostCommandHandler = std::function<bool(const std::vector<std::string>& tokens)>;
+void SetHostCommandHandler(HostCommandHandler handler);
+// Returns false if the command is not a host command.
+bool HandleHostCommand(const std::vector<std::string>& tokens);
\ No newline at end of file
@@ -10,17 +10,209 @@
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/InstrProfWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "Checkpoint.h"
+#include "Snapshot.h"
 #include <iostream>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 
 #ifndef WIN32
 #include <dlfcn.h>
+#include <sys/mman.h>
 #endif
 
 // #define USE_LLVM_LOADLIB
 
+// Indirect call targets observed at runtime. Every site has a fixed table of targets, claimed
+// and counted with atomics; tables are allocated in blocks, when the sites are assigned, and
+// never move.
+struct IndirectCallTarget {
+    // 0 if the entry is free.
+    uint64_t target;
+    uint64_t count;
+};
+
+static const size_t TargetsPerIndirectCallSite = 8;
+
+struct IndirectCallSiteTable {
+    IndirectCallTarget targets[TargetsPerIndirectCallSite];
+};
+
+static const size_t IndirectCallSitesPerBlock = 4096;
+static const size_t MaxIndirectCallSiteBlocks = 1024;
+static IndirectCallSiteTable* indirectCallSiteBlocks[MaxIndirectCallSiteBlocks];
+
+// Called with the jitMutex held, before code with these sites runs.
+static void AllocateIndirectCallSiteTables(size_t sites) {
+    size_t blocks = std::min((sites + IndirectCallSitesPerBlock - 1) / IndirectCallSitesPerBlock, MaxIndirectCallSiteBlocks);
+    for (size_t block = 0; block < blocks; ++block)
+    {
+        if (!indirectCallSiteBlocks[block])
+            __atomic_store_n(&indirectCallSiteBlocks[block], new IndirectCallSiteTable[IndirectCallSitesPerBlock](), __ATOMIC_RELEASE);
+    }
+}
+
+static IndirectCallSiteTable* GetIndirectCallSiteTable(uint64_t site) {
+    if (site / IndirectCallSitesPerBlock >= MaxIndirectCallSiteBlocks)
+        return nullptr;
+    IndirectCallSiteTable* block = __atomic_load_n(&indirectCallSiteBlocks[site / IndirectCallSitesPerBlock], __ATOMIC_ACQUIRE);
+    return block ? &block[site % IndirectCallSitesPerBlock] : nullptr;
+}
+
+// Called by program code before every indirect call, when indirect call profiling is enabled.
+// Lock-free: targets that don't fit in the table of the site are not counted.
+static void ProfileIndirectCall(uint64_t site, void* target) {
+    IndirectCallSiteTable* table = GetIndirectCallSiteTable(site);
+    if (!table)
+        return;
+
+    for (auto& entry : table->targets)
+    {
+        uint64_t current = __atomic_load_n(&entry.target, __ATOMIC_RELAXED);
+        if (current == 0 && __atomic_compare_exchange_n(&entry.target, &current, (uint64_t)target, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            current = (uint64_t)target;
+
+        if (current == (uint64_t)target)
+        {
+            __atomic_fetch_add(&entry.count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+// Values observed by PGO instrumentation. As in the profile runtime, every value site of a
+// function has a slot in its Values array (the sites of all kinds are numbered together, in the
+// order of the kinds), which points to a fixed table of values allocated on first use. Tables
+// come from a pool of shared memory, and the Values arrays are shared memory too (see
+// JITMemoryManager), so values observed from a checkpoint survive its restore.
+struct ProfileValueEntry {
+    // 0: free, 1: being claimed, 2: value set.
+    uint64_t state;
+    uint64_t value;
+    uint64_t count;
+};
+
+static const size_t ProfileValuesPerSite = 16;
+
+struct ProfileValueSite {
+    ProfileValueEntry entries[ProfileValuesPerSite];
+};
+
+struct ProfileValuePool {
+    uint64_t used;
+    // Values that didn't fit in their table, or sites that didn't fit in the pool.
+    uint64_t dropped;
+    uint64_t capacity;
+    ProfileValueSite sites[1];
+};
+
+static const size_t ProfileValuePoolSize = 16 << 20;
+static ProfileValuePool* profileValuePool = nullptr;
+
+// Before any instrumented code runs, so that forked children use the same pool.
+static bool MapProfileValuePool() {
+    if (profileValuePool)
+        return true;
+
+    void* memory = mmap(nullptr, ProfileValuePoolSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Cannot allocate memory for value profiling: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    profileValuePool = (ProfileValuePool*)memory;
+    profileValuePool->capacity = (ProfileValuePoolSize - offsetof(ProfileValuePool, sites)) / sizeof(ProfileValueSite);
+    return true;
+}
+
+// Stands in for __llvm_profile_instrument_target of the profile runtime in PGO-instrumented code.
+// Lock-free: values are looked up in the table of the site, and counted with atomics.
+static void ProfileValue(uint64_t value, void* data, uint32_t site) {
+    ProfileValuePool* pool = profileValuePool;
+    auto slots = (ProfileValueSite**)((const RawInstrProf::ProfileData<uint64_t>*)data)->Values;
+    if (!pool || !slots)
+        return;
+
+    ProfileValueSite* table = __atomic_load_n(&slots[site], __ATOMIC_ACQUIRE);
+    if (!table)
+    {
+        uint64_t index = __atomic_fetch_add(&pool->used, 1, __ATOMIC_RELAXED);
+        if (index >= pool->capacity)
+        {
+            __atomic_fetch_add(&pool->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        // Another thread may have allocated a table in the meantime: the new one is wasted.
+        table = &pool->sites[index];
+        ProfileValueSite* expected = nullptr;
+        if (!__atomic_compare_exchange_n(&slots[site], &expected, table, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            table = expected;
+    }
+
+    for (auto& entry : table->entries)
+    {
+        uint64_t state = __atomic_load_n(&entry.state, __ATOMIC_ACQUIRE);
+        if (state == 0)
+        {
+            if (__atomic_compare_exchange_n(&entry.state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            {
+                entry.value = value;
+                entry.count = 1;
+                __atomic_store_n(&entry.state, 2, __ATOMIC_RELEASE);
+                return;
+            }
+        }
+
+        // Entries still being claimed are skipped: the same value may then have two entries,
+        // which are merged when the profile is written.
+        if (state == 2 && entry.value == value)
+        {
+            __atomic_fetch_add(&entry.count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&pool->dropped, 1, __ATOMIC_RELAXED);
+}
+
+// Tables are only referenced by the modules of variants instrumented for PGO: once none is
+// loaded, the pool can be reused.
+static void ResetProfileValuePool() {
+    if (!profileValuePool)
+        return;
+
+    uint64_t used = std::min(profileValuePool->used, profileValuePool->capacity);
+    memset(profileValuePool->sites, 0, used * sizeof(ProfileValueSite));
+    profileValuePool->used = 0;
+    profileValuePool->dropped = 0;
+}
+
+// Counters are read from the data section of each module, so their data needs no registration.
+static void RegisterProfileData() {}
+
 VModuleKey SurgeonJIT::addModule(std::unique_ptr<llvm::Module> M, bool enableCSI, bool addToDatabase, const std::vector<std::string>& tools) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
     if (addToDatabase)
     {
+        if (indirectCallProfiling)
+            AssignIndirectCallSites(*M);
 
         callGraph.AddModule(*M);
 
@@ -44,13 +236,49 @@ VModuleKey SurgeonJIT::addModule(std::unique_ptr<llvm::Module> M, bool enableCSI
 
     modulesCSIEnabled[M.get()] = enableCSI;
     modulesCSITool[M.get()] = tools;
+    modulesOptLevel[M.get()] = 3;
+
+    // The database keeps the original IR, so transition points, profiling hooks and tier-up
+    // checks are only added to the module that is actually emitted. Transition points come
+    // first, since their live values must match the continuations built from the database.
+    if (osrEnabled && addToDatabase)
+        InsertOSRTransitionPoints(*M);
+
+    if (indirectCallProfiling && addToDatabase)
+        InsertIndirectCallProfiling(*M);
+
+    if (tieredCompilation && addToDatabase)
+    {
+        InsertTierUpChecks(*M);
+        modulesOptLevel[M.get()] = baselineOptLevel;
+    }
 
     // Add the module to the JIT with a new VModuleKey.
     auto K = ES.allocateVModule();
 
     isInstrumented[K] = !addToDatabase;
 
-    cantFail(OptimizeLayer.addModule(K, std::move(M)));
+    if (lazyCompilation && addToDatabase)
+    {
+        // Every function defined in the module gets a stub that compiles it on its first call.
+        for (Function& function : *M)
+        {
+            if (!function.isDeclaration() && !function.hasLocalLinkage())
+                lazyFunctions.insert(function.getName());
+        }
+
+        // The module itself is never optimized, only the partitions extracted from it.
+        modulesCSIEnabled.erase(M.get());
+        modulesCSITool.erase(M.get());
+        modulesOptLevel.erase(M.get());
+
+        lazyModules.insert(K);
+        cantFail(CODLayer.addModule(K, std::move(M)));
+    }
+    else
+    {
+        cantFail(OptimizeLayer.addModule(K, std::move(M)));
+    }
 
     return K;
 }
@@ -96,23 +324,199 @@ void RemoveConstrsDestrAliasesAndSetGlobalsExternal(llvm::Module& M, bool remove
     }
 }
 
-void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enableCSI, const std::vector<std::string>& tools) {
-    if (functionModuleMapping.find(functionName) == functionModuleMapping.end())
+// Removes the definitions that became dead after extraction, and all the unused declarations.
+void RemoveUnusedGlobals(llvm::Module& M) {
+    legacy::PassManager passes;
+    passes.add(createGlobalDCEPass());
+    passes.run(M);
+
+    std::vector<GlobalValue*> toRemove;
+    for (auto& function : M)
+    {
+        if (function.isDeclaration() && function.use_empty())
+            toRemove.push_back(&function);
+    }
+    for (auto& global : M.globals())
+    {
+        if (global.isDeclaration() && global.use_empty())
+            toRemove.push_back(&global);
+    }
+
+    for (auto& val : toRemove)
+    {
+        val->eraseFromParent();
+    }
+}
+
+std::unique_ptr<Module> SurgeonJIT::ExtractFunctions(const Module& M, const std::set<std::string>& functionNames) {
+    // Definitions that have to be copied are the requested functions and everything they
+    // (transitively) reference that cannot be resolved against the code already emitted:
+    // private and comdat symbols, and functions that haven't been emitted yet.
+    std::set<const GlobalValue*> definitions;
+    std::vector<const GlobalValue*> worklist;
+
+    auto addDefinition = [&](const GlobalValue* value)
+    {
+        if (definitions.insert(value).second)
+            worklist.push_back(value);
+    };
+
+    for (auto& name : functionNames)
+    {
+        if (const Function* function = M.getFunction(name))
+            addDefinition(function);
+    }
+
+    for (auto& global : M.globals())
+    {
+        if (global.hasName() && (global.getName() == "llvm.global_ctors" || global.getName() == "llvm.global_dtors"))
+            definitions.insert(&global);
+    }
+
+    auto isNeeded = [&](const GlobalValue* value)
+    {
+        if (value->isDeclaration())
+            return false;
+        if (isa<GlobalAlias>(value) || value->hasComdat() || value->hasPrivateLinkage())
+            return true;
+        if (isa<Function>(value) && !IsSymbolEmitted(value->getName()))
+            return true;
+        return false;
+    };
+
+    std::set<const Constant*> visitedConstants;
+    std::function<void(const Value*)> visitOperand = [&](const Value* operand)
+    {
+        if (const GlobalValue* value = dyn_cast<GlobalValue>(operand))
+        {
+            if (isNeeded(value))
+                addDefinition(value);
+        }
+        else if (const Constant* constant = dyn_cast<Constant>(operand))
+        {
+            if (visitedConstants.insert(constant).second)
+            {
+                for (auto& constantOperand : constant->operands())
+                    visitOperand(constantOperand);
+            }
+        }
+    };
+
+    while (!worklist.empty())
+    {
+        const GlobalValue* value = worklist.back();
+        worklist.pop_back();
+
+        if (const Function* function = dyn_cast<Function>(value))
+        {
+            if (function->hasPersonalityFn())
+                visitOperand(function->getPersonalityFn());
+
+            for (auto& block : *function)
+            {
+                for (auto& inst : block)
+                {
+                    for (auto& operand : inst.operands())
+                        visitOperand(operand);
+                }
+            }
+        }
+        else if (const GlobalVariable* global = dyn_cast<GlobalVariable>(value))
+        {
+            if (global->hasInitializer())
+                visitOperand(global->getInitializer());
+        }
+        else if (const GlobalAlias* alias = dyn_cast<GlobalAlias>(value))
+        {
+            visitOperand(alias->getAliasee());
+        }
+    }
+
+    ValueToValueMapTy vMap;
+    return CloneModule(M, vMap, [&](const GlobalValue* value)
+        {
+            return definitions.find(value) != definitions.end();
+        });
+}
+
+void SurgeonJIT::ReportLazyCompilationFailure() {
+    std::cerr << "Lazy compilation of a function failed\n";
+    exit(-1);
+}
+
+bool SurgeonJIT::CanBeInstrumentationRoot(const std::string& functionName) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    auto module = functionModuleMapping.find(functionName);
+    if (module == functionModuleMapping.end())
     {
         llvm::errs() << "Function " << functionName << " to be recompiled cannot be found\n";
+        return false;
+    }
+
+    // The partitioner of the compile-on-demand layer renames functions with local linkage, so
+    // the root can't be found in lazily compiled code.
+    if (lazyCompilation && module->second > 0)
+    {
+        Function* function = modules[module->second - 1]->getFunction(functionName);
+        if (function && function->hasLocalLinkage())
+        {
+            std::cout << "Function " << functionName << " has internal linkage and can't be instrumented with lazy compilation\n";
+            return false;
+        }
+    }
+
+    // Checked under the lock: another thread (e.g. the control channel) may have installed a
+    // variant since the caller looked.
+    if (IsFunctionInstrumented(functionName))
+    {
+        std::cout << "Function " << functionName << " is already in an instrumented tree\n";
+        return false;
+    }
+
+    return true;
+}
+
+void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enableCSI, const std::vector<std::string>& tools) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    if (!CanBeInstrumentationRoot(functionName))
         return nullptr;
+
+    // Use the variant compiled in the background, if there is one.
+    std::unique_ptr<InstrumentedVariant> variant;
+    auto speculative = speculativeVariants.find(GetVariantKey(functionName, enableCSI, tools));
+    if (speculative != speculativeVariants.end())
+    {
+        variant = std::move(speculative->second);
+        speculativeVariants.erase(speculative);
+    }
+    else
+    {
+        variant = PrepareInstrumentedVariant(functionName, enableCSI, tools);
     }
 
+    return InstallInstrumentedVariant(std::move(variant));
+}
+
+std::unique_ptr<SurgeonJIT::InstrumentedVariant> SurgeonJIT::PrepareInstrumentedVariant(const std::string& functionName, bool enableCSI, const std::vector<std::string>& tools,
+    PGOPhase pgo, const InstrumentedVariant* profiled) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
 
-    std::string instrumentationPrefix = GenerateInstrumentationPrefix(functionName);
+    // Objects of PGO variants are never cached: their prefixes are not reused.
+    std::string instrumentationPrefix = GenerateInstrumentationPrefix(functionName,
+        pgo == PGOPhase::None ? GetVariantKey(functionName, enableCSI, tools) : "");
 
-    size_t originalFunctionSize = GetSizeForSymbol(functionName);
-    // llvm::errs() << "Size of original function: " << originalFunctionSize << "\n";
+    // Indirect calls observed so far extend the subtree.
+    if (indirectCallProfiling)
+        MergeIndirectCallProfile();
 
     auto functionSetWhole = callGraph.GetNodeAndAllChildren(functionName);
 
     std::vector<VModuleKey> keys;
     VModuleKey entryKey;
+    std::vector<RecompileJob> jobs;
+    std::vector<std::pair<size_t, std::string>> osrContinuations;
 
     std::unordered_map<size_t, std::set<std::string>> functionsByModule;
     std::set<std::string> allFunctions;
@@ -126,6 +530,23 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
         }
     }
 
+    // The profile names the functions of this variant, so it is written once the prefix is known.
+    SmallString<128> profilePath;
+    if (pgo == PGOPhase::Use)
+    {
+        if (sys::fs::createTemporaryFile("surgeon-pgo", "profdata", profilePath))
+        {
+            llvm::errs() << "Cannot create a temporary file for the profile of " << functionName << "\n";
+            return nullptr;
+        }
+
+        if (WritePGOProfile(*profiled, instrumentationPrefix, allFunctions, profilePath.str()) == 0)
+        {
+            sys::fs::remove(profilePath);
+            return nullptr;
+        }
+    }
+
     for (auto moduleFunctionsPair : functionsByModule)
     {
         size_t moduleIndex = moduleFunctionsPair.first;
@@ -133,7 +554,7 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
         assert(moduleIndex != 0);
         moduleIndex--;
 
-        auto module = std::move(CloneModule(*modules[moduleIndex]));
+        auto module = ExtractFunctions(*modules[moduleIndex], functionSet);
 
         std::vector<Function*> targetFunctions;
 
@@ -146,7 +567,7 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
             if (!function.isDeclaration() && !function.hasComdat() && !IsInSet(name, functionSet) &&
                 function.getLinkage() != llvm::GlobalValue::LinkageTypes::PrivateLinkage)
             {
-                if (GetSizeForSymbol(function.getName()) > 0)
+                if (IsSymbolEmitted(function.getName()))
                 {
                     function.deleteBody();
                     function.setLinkage(llvm::GlobalValue::LinkageTypes::ExternalLinkage);
@@ -179,6 +600,29 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
 
         assert(targetFunctions.size() == functionSet.size());
 
+        // Continuations are built before calls are promoted, which changes the control flow.
+        std::vector<Function*> continuations;
+        if (osrEnabled && IsInSet(functionName, functionSet))
+        {
+            std::string continuationPrefix = instrumentationPrefix + "osr_" + functionName + "_";
+            auto built = BuildOSRContinuations(*module->getFunction(instrumentationPrefix + functionName), continuationPrefix);
+            for (size_t index = 0; index < built.size(); ++index)
+            {
+                if (built[index])
+                {
+                    continuations.push_back(built[index]);
+                    osrContinuations.push_back(std::make_pair(index, continuationPrefix + std::to_string(index)));
+                }
+            }
+        }
+
+        // Both phases of PGO must see the same control flow, and the profile promotes indirect calls by itself.
+        if (indirectCallProfiling && pgo == PGOPhase::None)
+            PromoteIndirectCalls(*module, targetFunctions, allFunctions, instrumentationPrefix);
+
+        // Continuations call the instrumented subtree like the root does.
+        targetFunctions.insert(targetFunctions.end(), continuations.begin(), continuations.end());
+
         for (auto& functionPtr : targetFunctions)
         {
             Function& function = *functionPtr;
@@ -218,22 +662,48 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
             }
         }
 
-        auto key = addModule(std::move(module), enableCSI, false, tools);
-        keys.push_back(key);
+        RemoveUnusedGlobals(*module);
 
-        if (IsInSet(functionName, functionSet))
+        // The module is optimized and compiled in its own context by one of the workers below.
+        jobs.emplace_back();
         {
-            // This VModule will contain the entry point.
-            entryKey = key;
+            raw_svector_ostream bitcodeStream(jobs.back().bitcode);
+            WriteBitcodeToFile(*module, bitcodeStream);
         }
+        jobs.back().containsEntryPoint = IsInSet(functionName, functionSet);
+        jobs.back().pgo = pgo;
+        jobs.back().profileFile = profilePath.str();
+    }
+
+    std::vector<LoadedCSITool> jobTools;
+    std::vector<std::string> toolBitcodeFiles;
+    if (enableCSI)
+    {
+        jobTools = GetCSITools(tools);
+        toolBitcodeFiles = GetCSIToolBitcodeFiles(tools);
+    }
+
+    std::atomic<size_t> nextJob{ 0 };
+    std::vector<std::thread> workers;
+    size_t numWorkers = OptionsStore::GetNumberOfCompileJobs(jobs.size());
+    for (size_t worker = 0; worker < numWorkers; ++worker)
+    {
+        workers.emplace_back([&]()
+            {
+                size_t index;
+                while ((index = nextJob++) < jobs.size())
+                    CompileRecompileJob(jobs[index], enableCSI, jobTools, toolBitcodeFiles);
+            });
     }
 
-    VModuleKey surgeonKey;
+    VModuleKey surgeonKey = 0;
+    // Code optimized with a profile replaces the function, rather than entering the interactive cycle.
+    if (pgo != PGOPhase::Use)
     {
         // Insert the interactive loop.
         FunctionType* functionType = nullptr;
 
-        auto module = std::move(CloneModule(*modules[functionModuleMapping[functionName] - 1]));
+        auto module = ExtractFunctions(*modules[functionModuleMapping[functionName] - 1], { functionName });
 
         auto helperModule = LoadHelperModule(module->getContext());
         std::unique_ptr<Module> helper = std::move(CloneModule(*helperModule));
@@ -251,7 +721,7 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
             if (!function.isDeclaration() && !function.hasComdat() && name != functionName &&
                 function.getLinkage() != llvm::GlobalValue::LinkageTypes::PrivateLinkage)
             {
-                if (GetSizeForSymbol(function.getName()) > 0)
+                if (IsSymbolEmitted(function.getName()))
                 {
                     function.deleteBody();
                     function.setLinkage(llvm::GlobalValue::LinkageTypes::ExternalLinkage);
@@ -282,7 +752,7 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
             addressGlobal->setInitializer(llvm::ConstantInt::getIntegerValue(llvm::IntegerType::getInt64Ty(context),
                 APInt(64, 0x123456789)));
 
-            cycle = (Function*)module->getOrInsertFunction("__surgeon_cycle_" + functionName,
+            cycle = (Function*)module->getOrInsertFunction(instrumentationPrefix + "_cycle_" + functionName,
                 FunctionType::get(llvm::Type::getVoidTy(context), functionType->params(), false));
             llvm::BasicBlock* block = BasicBlock::Create(context, "entryBlock", cycle);
             IRBuilder<> builder{ block };
@@ -372,27 +842,78 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
         surgeonKey = addModule(std::move(module), false, false);
     }
 
-    // This is mainly for debug, to fail early and get meaningful errors
-    // if any symbol cannot be resolved.
-    if (auto Err = OptimizeLayer.emitAndFinalize(keys[0]))
+    // The trampoline doesn't reference the instrumented modules, so it can be
+    // compiled while the workers are busy.
+    if (surgeonKey)
     {
-        llvm::errs() << "Error finalizing first: " << Err << "\n";
-        exit(-1);
+        if (auto Err = OptimizeLayer.emitAndFinalize(surgeonKey))
+        {
+            llvm::errs() << "Error finalizing trampoline: " << Err << "\n";
+            exit(-1);
+        }
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    if (!profilePath.empty())
+        sys::fs::remove(profilePath);
+
+    for (auto& job : jobs)
+    {
+        if (!job.object)
+        {
+            llvm::errs() << "Error compiling instrumented module: " << job.error << "\n";
+            exit(-1);
+        }
+
+        auto key = ES.allocateVModule();
+        isInstrumented[key] = true;
+        cantFail(ObjectLayer.addObject(key, std::move(job.object)));
+        keys.push_back(key);
+
+        if (job.containsEntryPoint)
+        {
+            // This VModule will contain the entry point.
+            entryKey = key;
+        }
     }
 
-    /*if (entryKey != 0)
+    // Link all the objects now, so that installing the variant doesn't require any work.
+    // This also fails early, with meaningful errors, if any symbol cannot be resolved.
+    for (auto key : keys)
     {
-        if (auto Err = OptimizeLayer.emitAndFinalize(entryKey))
+        if (auto Err = OptimizeLayer.emitAndFinalize(key))
         {
             llvm::errs() << "Error finalizing: " << Err << "\n";
             exit(-1);
         }
-    } */
+    }
+
+    auto variant = llvm::make_unique<InstrumentedVariant>();
+    variant->rootFunction = functionName;
+    variant->prefix = instrumentationPrefix;
+    variant->enableCSI = enableCSI;
+    variant->tools = tools;
+    variant->pgo = pgo;
+    variant->keys = keys;
+    variant->entryKey = entryKey;
+    variant->surgeonKey = surgeonKey;
+    variant->osrContinuations = osrContinuations;
+
+    return variant;
+}
 
+void* SurgeonJIT::InstallInstrumentedVariant(std::unique_ptr<InstrumentedVariant> variantPtr) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
 
-    if (enableCSI)
+    InstrumentedVariant& variant = *variantPtr;
+    const std::string& functionName = variant.rootFunction;
+    const std::string& instrumentationPrefix = variant.prefix;
+
+    if (variant.enableCSI)
     {
-        for (auto key : keys)
+        for (auto key : variant.keys)
         {
             //   llvm::errs() << "Calling CSI constructor for module " << key << "\n";
             CallCSIConstructorForModule(key, true);
@@ -400,73 +921,440 @@ void* SurgeonJIT::RecompileFunction(const std::string& functionName, bool enable
     }
 
     //llvm::errs() << "Finding new symbol\n";
-    std::string interactiveFunctionName = instrumentationPrefix + "_interactive_" + functionName;
+    void* finalAddr = (void*)OptimizeLayer.findSymbolIn(variant.entryKey, instrumentationPrefix + functionName, false).getAddress().get();
+    assert(finalAddr);
+
+    if (!variant.surgeonKey)
+    {
+        preemptFunction(functionName, instrumentationPrefix + functionName);
+    }
+    else
+    {
+        std::string interactiveFunctionName = instrumentationPrefix + "_interactive_" + functionName;
+        void* trampAddr = (void*)(findSymbol(interactiveFunctionName).getAddress().get());
 
-    void* finalAddr = (void*)OptimizeLayer.findSymbolIn(entryKey, instrumentationPrefix + functionName, false).getAddress().get();
-    void* trampAddr = (void*)(findSymbol(interactiveFunctionName).getAddress().get());
 
+        void* pointerToAddr = (void*)OptimizeLayer.findSymbolIn(variant.surgeonKey, instrumentationPrefix + "address", false).getAddress().get();
+        assert(trampAddr);
+        assert(pointerToAddr);
 
-    size_t trampolineSize = GetOveriddenSizeForSymbol(interactiveFunctionName);
-    if (trampolineSize > originalFunctionSize) {
-        std::cout << "Trampoline size: " << trampolineSize << ", original size: " << originalFunctionSize << "\n";
-        assert(GetSizeForSymbol(interactiveFunctionName) <= originalFunctionSize);
+        *((uintptr_t*)(pointerToAddr)) = (uintptr_t)finalAddr;
+        preemptFunction(functionName, interactiveFunctionName);
     }
 
-    void* pointerToAddr = (void*)OptimizeLayer.findSymbolIn(surgeonKey, instrumentationPrefix + "address", false).getAddress().get();
-    assert(trampAddr);
-    assert(finalAddr);
-    assert(pointerToAddr);
+    // Frames of the root function that are already running move to the instrumented code
+    // at their next loop header.
+    for (auto& continuation : variant.osrContinuations)
+    {
+        auto flag = findSymbol(GetOSRFlagName(functionName, continuation.first));
+        auto continuationSymbol = OptimizeLayer.findSymbolIn(variant.entryKey, continuation.second, false);
+        if (!flag || !continuationSymbol)
+            continue;
+
+        volatile uint64_t* flagAddress = (volatile uint64_t*)flag.getAddress().get();
+        __atomic_store_n(flagAddress, (uint64_t)continuationSymbol.getAddress().get(), __ATOMIC_RELEASE);
+        variant.osrFlags.push_back(flagAddress);
+    }
 
-    *((uintptr_t*)(pointerToAddr)) = (uintptr_t)finalAddr;
-    preemptFunction(functionName, interactiveFunctionName);
+    installedVariants[functionName] = std::move(variantPtr);
 
     return finalAddr;
 }
 
-void SurgeonJIT::CallCSIConstructorForModule(VModuleKey & key, bool mustExist) {
-    auto csiConstructorSymbol = CompileLayer.findSymbolIn(key, "csirt.unit_ctor", false);
-    if (csiConstructorSymbol)
+bool SurgeonJIT::RemoveInstrumentation(const std::string& functionName, bool unloadCode) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    auto installed = installedVariants.find(functionName);
+    if (installed == installedVariants.end())
+        return false;
+
+    std::unique_ptr<InstrumentedVariant> variant = std::move(installed->second);
+    installedVariants.erase(installed);
+
+    // Restore the original entry and clear the transition flags first, so that no new call
+    // or loop iteration reaches the instrumented code.
+    for (auto flag : variant->osrFlags)
+        __atomic_store_n(flag, (uint64_t)0, __ATOMIC_RELEASE);
+
+    RestoreFunction(functionName);
+
+    // The function goes back to its laid out copy, if it has one.
+    auto layout = layoutFunctions.find(functionName);
+    if (layout != layoutFunctions.end())
     {
-        void* csiConstructor = (void*)cantFail(csiConstructorSymbol.getAddress());
-        void(*fn)(void) = (void(*)(void))csiConstructor;
-        fn();
+        if (auto sym = findSymbol(layout->second))
+            patcher.Restore((void*)sym.getAddress().get());
+        preemptFunction(functionName, layout->second);
+    }
+
+    if (unloadCode)
+    {
+        UnloadVariant(*variant);
+        ReleaseUnusedProfileValues();
     }
     else
+        retiredVariants.push_back(std::move(variant));
+
+    return true;
+}
+
+void SurgeonJIT::RestoreFunction(const std::string& functionName) {
+    if (lazyFunctions.find(functionName) != lazyFunctions.end())
     {
-        if (mustExist)
+        auto stubTarget = preemptedStubTargets.find(functionName);
+        if (stubTarget != preemptedStubTargets.end())
         {
-            llvm::errs() << "CSI constructor not found for VModule " << key << "\n";
-            exit(-1);
+            if (auto Err = CODLayer.updatePointer(functionName, stubTarget->second))
+            {
+                llvm::errs() << "Cannot restore stub for function " << functionName << ": " << Err << "\n";
+                exit(-1);
+            }
+            preemptedStubTargets.erase(stubTarget);
         }
     }
+    else if (auto sym = findSymbol(functionName))
+    {
+        patcher.Restore((void*)sym.getAddress().get());
+    }
 }
 
-JITSymbol SurgeonJIT::findSymbol(const std::string Name, bool exportedOnly) {
-    std::string MangledName = mangle(Name);
-    return OptimizeLayer.findSymbol(MangledName, exportedOnly);
+void SurgeonJIT::UnloadRetiredInstrumentation() {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    for (auto& variant : retiredVariants)
+        UnloadVariant(*variant);
+    retiredVariants.clear();
+    ReleaseUnusedProfileValues();
+
+    for (auto& generation : retiredLayouts)
+    {
+        // Variants installed over the old copies patched them.
+        for (auto& copy : generation.copies)
+        {
+            if (auto sym = findSymbol(copy))
+                patcher.Forget((void*)sym.getAddress().get());
+        }
+
+        // The module goes before its context.
+        removeModule(generation.key);
+        listener.ForgetModule(generation.key);
+        isInstrumented.erase(generation.key);
+    }
+    retiredLayouts.clear();
 }
 
-void SurgeonJIT::preemptFunction(const std::string & functionName, const std::string & preempter) {
-    if (auto sym = findSymbol(functionName))
+void SurgeonJIT::ReleaseUnusedProfileValues() {
+    for (auto& variant : installedVariants)
     {
-        void* addr = (void*)sym.getAddress().get();
-        assert(addr != nullptr);
+        if (variant.second->pgo == PGOPhase::Generate)
+            return;
+    }
+    for (auto& variant : retiredVariants)
+    {
+        if (variant->pgo == PGOPhase::Generate)
+            return;
+    }
+    ResetProfileValuePool();
+}
 
-        void* newAddr = (void*)(findSymbol(preempter).getAddress().get());
+void SurgeonJIT::UnloadVariant(InstrumentedVariant& variant) {
+    // Removing a module destroys its memory manager, which releases all its sections.
+    std::vector<VModuleKey> keys = variant.keys;
+    if (variant.surgeonKey)
+        keys.push_back(variant.surgeonKey);
+    for (auto key : keys)
+    {
+        removeModule(key);
+        listener.ForgetModule(key);
+        isInstrumented.erase(key);
+    }
 
-        assert(newAddr != nullptr);
+    if (variant.pgo == PGOPhase::None)
+        unloadedPrefixes[GetVariantKey(variant.rootFunction, variant.enableCSI, variant.tools)].push_back(variant.prefix);
+}
 
-        memcpy(addr, newAddr, GetOveriddenSizeForSymbol(preempter));
+std::string SurgeonJIT::GetVariantKey(const std::string& rootFunction, bool enableCSI, const std::vector<std::string>& tools) {
+    std::string key = rootFunction + (enableCSI ? "|csi" : "|");
+    for (auto& tool : tools)
+        key += "|" + tool;
+    return key;
+}
 
-        //llvm::errs() << "Preempting function " << functionName << " (size " << GetSizeForSymbol(functionName) << ") with function of size " << GetSizeForSymbol(preempter) << "\n";
-    }
-    else
+void SurgeonJIT::StartSpeculativeCompilation() {
+    if (!speculativeCompilation || speculativeThread.joinable())
+        return;
+
+    std::vector<std::string> roots;
+    std::vector<std::vector<std::string>> toolSets;
     {
-        llvm::errs() << "Cannot find function " << functionName << " to preempt\n";
+        std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+        // Roots are either configured explicitly or the direct callees of main.
+        std::string configuredRoots = OptionsStore::GetOption("speculative_roots");
+        if (configuredRoots.size() > 0)
+            roots = split(configuredRoots, ',', true);
+        else
+            roots = callGraph.GetChildren("main");
+
+        // Tool sets are either configured explicitly or every loaded tool on its own.
+        std::string configuredTools = OptionsStore::GetOption("speculative_tools");
+        if (configuredTools.size() > 0)
+            toolSets.push_back(split(configuredTools, ',', true));
+        else
+        {
+            for (auto& tool : csiTools)
+            {
+                if (tool.first != "cp")
+                    toolSets.push_back({ tool.first });
+            }
+        }
     }
-}
 
-bool SurgeonJIT::LoadCSITool(const CSITool& tool)
+    stopSpeculativeThread = false;
+    speculativeThread = std::thread([this, roots, toolSets]()
+        {
+            for (auto& root : roots)
+            {
+                for (auto& tools : toolSets)
+                {
+                    if (stopSpeculativeThread)
+                        return;
+
+                    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+                    std::string key = GetVariantKey(root, true, tools);
+                    if (functionModuleMapping.find(root) == functionModuleMapping.end() || speculativeVariants.find(key) != speculativeVariants.end())
+                        continue;
+
+                    bool toolsExist = true;
+                    for (auto& tool : tools)
+                        toolsExist = toolsExist && IsCSIToolRegistered(tool);
+                    if (!toolsExist)
+                        continue;
+
+                    speculativeVariants[key] = PrepareInstrumentedVariant(root, true, tools);
+                }
+            }
+        });
+}
+
+void SurgeonJIT::StopSpeculativeCompilation() {
+    // The thread stops after the variant it is working on, if any.
+    stopSpeculativeThread = true;
+}
+
+void SurgeonJIT::CallCSIConstructorForModule(VModuleKey & key, bool mustExist) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    // Program modules compiled lazily are never instrumented.
+    if (lazyModules.find(key) != lazyModules.end())
+        return;
+
+    auto csiConstructorSymbol = CompileLayer.findSymbolIn(key, "csirt.unit_ctor", false);
+    if (csiConstructorSymbol)
+    {
+        void* csiConstructor = (void*)cantFail(csiConstructorSymbol.getAddress());
+        void(*fn)(void) = (void(*)(void))csiConstructor;
+        fn();
+    }
+    else
+    {
+        if (mustExist)
+        {
+            llvm::errs() << "CSI constructor not found for VModule " << key << "\n";
+            exit(-1);
+        }
+    }
+}
+
+JITSymbol SurgeonJIT::findSymbol(const std::string Name, bool exportedOnly) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+    std::string MangledName = mangle(Name);
+
+    // Stubs of lazily compiled functions take precedence over their bodies.
+    if (lazyCompilation)
+    {
+        if (auto Sym = CODLayer.findSymbol(MangledName, exportedOnly))
+            return Sym;
+    }
+
+    return OptimizeLayer.findSymbol(MangledName, exportedOnly);
+}
+
+// Copies of program functions that replace them outside of instrumentation: the optimized tier,
+// surgeon_optimized_<function>, and the laid out copies, surgeon_layout_<generation>_<function>.
+// Strips the prefix of the copy and sets its kind.
+static bool StripCopyPrefix(std::string& symbol, std::string& kind) {
+    const std::string optimizedPrefix = "surgeon_optimized_";
+    const std::string layoutPrefix = "surgeon_layout_";
+    if (symbol.compare(0, optimizedPrefix.size(), optimizedPrefix) == 0)
+    {
+        symbol = symbol.substr(optimizedPrefix.size());
+        kind = "optimized";
+        return true;
+    }
+    if (symbol.compare(0, layoutPrefix.size(), layoutPrefix) == 0 && symbol.find('_', layoutPrefix.size()) != std::string::npos)
+    {
+        symbol = symbol.substr(symbol.find('_', layoutPrefix.size()) + 1);
+        kind = "layout";
+        return true;
+    }
+    return false;
+}
+
+bool SurgeonJIT::SymbolizeAddress(uint64_t address, std::string& name) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+    std::string symbol;
+    if (!listener.FindFunctionForAddress(address, symbol))
+        return false;
+
+    std::string tag;
+    if (!StripCopyPrefix(symbol, tag))
+    {
+        std::vector<const InstrumentedVariant*> variants;
+        for (auto& variant : installedVariants)
+            variants.push_back(variant.second.get());
+        for (auto& variant : retiredVariants)
+            variants.push_back(variant.get());
+        for (auto& variant : speculativeVariants)
+            variants.push_back(variant.second.get());
+
+        for (auto variant : variants)
+        {
+            if (symbol.compare(0, variant->prefix.size(), variant->prefix) != 0)
+                continue;
+
+            symbol = symbol.substr(variant->prefix.size());
+            tag = variant->pgo == PGOPhase::Use ? "pgo" : "instrumented";
+            // Continuations are named osr_<function>_<loop index>.
+            if (symbol.compare(0, 4, "osr_") == 0 && symbol.rfind('_') > 4)
+            {
+                symbol = symbol.substr(4, symbol.rfind('_') - 4);
+                tag += ", osr";
+            }
+            break;
+        }
+    }
+
+    name = Profiler::Demangle(symbol);
+    if (!tag.empty())
+        name += " [" + tag + "]";
+    return true;
+}
+
+std::vector<DisassembledFunction> SurgeonJIT::DisassembleFunction(const std::string& functionName) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+    std::vector<DisassembledFunction> copies;
+
+    if (!disassembler)
+        disassembler.reset(new FunctionDisassembler(*TM));
+    if (!disassembler->IsAvailable())
+        return copies;
+
+    std::vector<std::pair<std::string, std::string>> symbols{
+        { functionName, "original" },
+        { "surgeon_optimized_" + functionName, "optimized" } };
+    auto layout = layoutFunctions.find(functionName);
+    if (layout != layoutFunctions.end())
+        symbols.push_back(std::make_pair(layout->second, "layout"));
+    for (auto& variant : installedVariants)
+        symbols.push_back(std::make_pair(variant.second->prefix + functionName, variant.second->pgo == PGOPhase::Use ? "pgo" : "instrumented"));
+
+    for (auto& symbol : symbols)
+    {
+        for (auto& function : listener.FindFunctionsByName(symbol.first))
+        {
+            DisassembledFunction copy;
+            copy.symbol = symbol.first;
+            copy.kind = symbol.second;
+            copy.address = function.first;
+            copy.instructions = disassembler->Disassemble(function.first, function.second);
+
+            // Each instruction takes the last line that starts at or before it.
+            DILineInfoTable lines = listener.GetLineInfo(function.first, function.second);
+            size_t nextLine = 0;
+            for (auto& instruction : copy.instructions)
+            {
+                while (nextLine < lines.size() && lines[nextLine].first <= instruction.address)
+                    nextLine++;
+                if (nextLine > 0)
+                {
+                    instruction.file = lines[nextLine - 1].second.FileName;
+                    instruction.line = lines[nextLine - 1].second.Line;
+                }
+            }
+
+            copies.push_back(std::move(copy));
+        }
+    }
+
+    return copies;
+}
+
+void SurgeonJIT::preemptFunction(const std::string & functionName, const std::string & preempter) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    if (auto sym = findSymbol(functionName))
+    {
+        void* addr = (void*)sym.getAddress().get();
+        assert(addr != nullptr);
+
+        void* newAddr = (void*)(findSymbol(preempter).getAddress().get());
+
+        assert(newAddr != nullptr);
+
+        // Laid out callers call the copy of the function directly.
+        auto layout = layoutFunctions.find(functionName);
+        if (layout != layoutFunctions.end() && layout->second != preempter)
+        {
+            if (auto copy = findSymbol(layout->second))
+            {
+                void* copyAddr = (void*)copy.getAddress().get();
+                if (!patcher.Redirect(copyAddr, listener.GetPatchableSize((uint64_t)copyAddr, GetSizeForSymbol(layout->second)), newAddr))
+                    llvm::errs() << "Cannot redirect function " << layout->second << "\n";
+            }
+        }
+
+        // Every call to a lazily compiled function goes through its stub, so it is enough
+        // to point the stub to the preempter.
+        if (lazyFunctions.find(functionName) != lazyFunctions.end())
+        {
+            // Keep the first target, so that the function can be restored.
+            if (preemptedStubTargets.find(functionName) == preemptedStubTargets.end())
+                preemptedStubTargets[functionName] = ReadStubTarget((JITTargetAddress)addr);
+
+            if (auto Err = CODLayer.updatePointer(functionName, (JITTargetAddress)newAddr))
+            {
+                llvm::errs() << "Cannot update stub for function " << functionName << ": " << Err << "\n";
+                exit(-1);
+            }
+            return;
+        }
+
+        size_t patchableSize = listener.GetPatchableSize((uint64_t)addr, GetSizeForSymbol(functionName));
+        if (!patcher.Redirect(addr, patchableSize, newAddr))
+        {
+            llvm::errs() << "Cannot redirect function " << functionName << " (size " << patchableSize << ")\n";
+        }
+
+        //llvm::errs() << "Preempting function " << functionName << " (size " << GetSizeForSymbol(functionName) << ") with function of size " << GetSizeForSymbol(preempter) << "\n";
+    }
+    else
+    {
+        llvm::errs() << "Cannot find function " << functionName << " to preempt\n";
+    }
+}
+
+JITTargetAddress SurgeonJIT::ReadStubTarget(JITTargetAddress stub) {
+    // x86-64 stubs are "jmpq *disp32(%rip)", which jumps through a pointer slot.
+    const uint8_t* code = (const uint8_t*)stub;
+    assert(code[0] == 0xFF && code[1] == 0x25);
+    int32_t displacement;
+    memcpy(&displacement, code + 2, sizeof(displacement));
+    return *(const JITTargetAddress*)(stub + 6 + displacement);
+}
+
+bool SurgeonJIT::LoadCSITool(const CSITool& tool)
 {
     auto& toolName = tool.GetToolName();
     auto& libraryFilename = tool.GetLibraryFilename();
@@ -519,6 +1407,20 @@ JITSymbol SurgeonJIT::resolveSymbol(const std::string Name) {
         return Sym;
     }
 
+    if (Name == mangle("__surgeon_profile_indirect_call"))
+        return JITSymbol((uint64_t)&ProfileIndirectCall, JITSymbolFlags::Exported);
+    if (Name == mangle("__llvm_profile_instrument_target"))
+        return JITSymbol((uint64_t)&ProfileValue, JITSymbolFlags::Exported);
+    if (Name == mangle("__llvm_profile_register_function") || Name == mangle("__llvm_profile_register_names_function"))
+        return JITSymbol((uint64_t)&RegisterProfileData, JITSymbolFlags::Exported);
+
+    // With snapshots, library functions that have the kernel write into memory make it writable first.
+    if (!Checkpoint::IsForked())
+    {
+        if (void* wrapper = SnapshotCheckpoint::GetSystemCallWrapper(Name))
+            return JITSymbol((uint64_t)wrapper, JITSymbolFlags::Exported);
+    }
+
     // __cxa_atexit and __dso_handle are handled in a special way.
     if (auto Sym = overrides.searchOverrides(actualName))
         return Sym;
@@ -547,13 +1449,11 @@ JITSymbol SurgeonJIT::resolveSymbol(const std::string Name) {
     return JITSymbol(nullptr);
 }
 
-std::vector<LoadedCSITool>  toolsForCSIPass;
-
 static void addComprehensiveStaticInstrumentationPass(const llvm::PassManagerBuilder & builder,
-    llvm::legacy::PassManagerBase & PM) {
+    llvm::legacy::PassManagerBase & PM, const std::vector<LoadedCSITool>& tools) {
     CSIOptions options;
     options.jitMode = true;
-    for (auto& tool : toolsForCSIPass)
+    for (auto& tool : tools)
         options.tools.push_back(std::make_pair(tool.GetToolName(), tool.GetBitcodeFilename()));
     PM.add(createComprehensiveStaticInstrumentationLegacyPass(options));
 
@@ -573,15 +1473,53 @@ static void addComprehensiveStaticInstrumentationPass(const llvm::PassManagerBui
     }
 }
 
-std::unique_ptr<Module> SurgeonJIT::optimizeModule(std::unique_ptr<Module> M) {
-    bool enableCSI = modulesCSIEnabled[M.get()];
+// The profiler unwinds JIT'd code through frame pointers, which are only kept with the
+// "profile_frame_pointers" option, since they cost a register. Called before the key of the
+// module is computed, so that cached objects have them too, and again after passes that add
+// functions.
+static void KeepFramePointers(Module& M) {
+    static bool keepFramePointers = OptionsStore::GetOption("profile_frame_pointers") == "1";
+    if (!keepFramePointers)
+        return;
+
+    for (auto& function : M)
+    {
+        if (!function.isDeclaration())
+            function.addFnAttr("no-frame-pointer-elim", "true");
+    }
+}
+
+// Runs the optimization pipeline on the module, instrumenting it with the given CSI tools if
+// enableCSI is set. Only the module's own context is touched, so this can run concurrently
+// on modules that live in different contexts.
+//
+// With PGOPhase::Generate, the module is instrumented for profiling; with PGOPhase::Use, the
+// indexed profile in profileFile is attached to it as branch weights and entry counts. Both
+// phases run at the same point of the pipeline, so that the functions they see, and the hashes
+// of their control flow, are the same.
+static void OptimizeModule(Module& M, unsigned optLevel, bool enableCSI, const std::vector<LoadedCSITool>& tools,
+    PGOPhase pgo = PGOPhase::None, const std::string& profileFile = "") {
     llvm::PassManagerBuilder builder;
-    builder.OptLevel = 3;
+    builder.OptLevel = optLevel;
+
+    if (pgo == PGOPhase::Generate)
+    {
+        builder.EnablePGOInstrGen = true;
+        // The JIT reads the counters itself: defining the hook variable keeps the instrumentation
+        // from referencing the profile runtime, which the process doesn't have.
+        Type* int32Type = Type::getInt32Ty(M.getContext());
+        new GlobalVariable(M, int32Type, false, GlobalValue::WeakAnyLinkage, ConstantInt::get(int32Type, 0),
+            getInstrProfRuntimeHookVarName());
+    }
+    else if (pgo == PGOPhase::Use)
+    {
+        builder.PGOInstrUse = profileFile;
+    }
 
     legacy::PassManager modulePasses;
 
     // Create a function pass manager.
-    auto FPM = llvm::make_unique<legacy::FunctionPassManager>(M.get());
+    auto FPM = llvm::make_unique<legacy::FunctionPassManager>(&M);
 
     /* // Add some optimizations.
      FPM->add(createInstructionCombiningPass());
@@ -591,13 +1529,12 @@ std::unique_ptr<Module> SurgeonJIT::optimizeModule(std::unique_ptr<Module> M) {
 
     if (enableCSI)
     {
-        // llvm::errs() << "Enabling CSI for module " << M->getName() << "\n";
-        auto tools = modulesCSITool[M.get()];
-        toolsForCSIPass.clear();
-        for (auto& tool : tools)
-            toolsForCSIPass.push_back(csiTools[tool]);
+        // llvm::errs() << "Enabling CSI for module " << M.getName() << "\n";
         builder.addExtension(llvm::PassManagerBuilder::EP_TapirLate,
-            addComprehensiveStaticInstrumentationPass);
+            [tools](const llvm::PassManagerBuilder& builder, llvm::legacy::PassManagerBase& PM)
+            {
+                addComprehensiveStaticInstrumentationPass(builder, PM, tools);
+            });
     }
 
     builder.populateFunctionPassManager(*FPM);
@@ -607,19 +1544,292 @@ std::unique_ptr<Module> SurgeonJIT::optimizeModule(std::unique_ptr<Module> M) {
 
     // Run the optimizations over all functions in the module being added to
     // the JIT.
-    for (auto& F : *M)
+    for (auto& F : M)
         FPM->run(F);
 
-    modulePasses.run(*M);
+    modulePasses.run(M);
 
     FPM->doFinalization();
 
     if (getenv("SURGEON_PRINT_MODULE"))
-        llvm::errs() << *M;
+        llvm::errs() << M;
+}
+
+// Blocks that are unlikely to run: those that end in unreachable (noreturn calls, failed
+// assertions), call cold functions or are only reached through unlikely branches
+// (__builtin_expect), and the blocks that only lead to, or are only reached from, them.
+static std::set<BasicBlock*> FindColdBlocks(Function& F) {
+    const BranchProbability unlikely(1, 1000);
+
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(F, LI);
+    BasicBlock* entry = &F.getEntryBlock();
+
+    std::set<BasicBlock*> cold;
+    for (auto& block : F)
+    {
+        if (&block == entry)
+            continue;
+
+        bool isCold = isa<UnreachableInst>(block.getTerminator());
+        for (auto& inst : block)
+        {
+            if (auto call = dyn_cast<CallInst>(&inst))
+                isCold |= call->hasFnAttr(Attribute::Cold);
+        }
+
+        bool unlikelyPredecessors = pred_begin(&block) != pred_end(&block);
+        for (BasicBlock* predecessor : predecessors(&block))
+            unlikelyPredecessors &= BPI.getEdgeProbability(predecessor, &block) <= unlikely;
+
+        if (isCold || unlikelyPredecessors)
+            cold.insert(&block);
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto& block : F)
+        {
+            if (&block == entry || cold.count(&block))
+                continue;
+
+            auto isColdBlock = [&cold](BasicBlock* other) { return cold.count(other) > 0; };
+            bool onlyLeadsToCold = succ_begin(&block) != succ_end(&block) && std::all_of(succ_begin(&block), succ_end(&block), isColdBlock);
+            bool onlyReachedFromCold = pred_begin(&block) != pred_end(&block) && std::all_of(pred_begin(&block), pred_end(&block), isColdBlock);
+            if (onlyLeadsToCold || onlyReachedFromCold)
+            {
+                cold.insert(&block);
+                changed = true;
+            }
+        }
+    }
+
+    return cold;
+}
+
+// Moves the cold regions of the function (see FindColdBlocks) to functions of their own in
+// the .text.unlikely section, which JITMemoryManager allocates apart from the rest of the code.
+// Returns the number of regions moved.
+static size_t SplitColdBlocks(Function& F) {
+    const size_t minRegionInstructions = 4;
+
+    if (F.isDeclaration() || F.hasFnAttribute(Attribute::Cold))
+        return 0;
+
+    std::set<BasicBlock*> cold = FindColdBlocks(F);
+    if (cold.empty())
+        return 0;
+
+    // A region is the subtree of the dominator tree under a cold block whose immediate
+    // dominator is hot, restricted to cold blocks.
+    DominatorTree DT(F);
+    std::vector<std::vector<BasicBlock*>> regions;
+    for (auto& block : F)
+    {
+        DomTreeNode* node = DT.getNode(&block);
+        if (!cold.count(&block) || !node || !node->getIDom() || cold.count(node->getIDom()->getBlock()))
+            continue;
+
+        std::vector<BasicBlock*> region;
+        std::vector<DomTreeNode*> worklist{ node };
+        while (!worklist.empty())
+        {
+            DomTreeNode* current = worklist.back();
+            worklist.pop_back();
+            if (!cold.count(current->getBlock()))
+                continue;
+            region.push_back(current->getBlock());
+            worklist.insert(worklist.end(), current->begin(), current->end());
+        }
+
+        // Only the first block may have predecessors outside of the region.
+        bool removed = true;
+        while (removed)
+        {
+            removed = false;
+            std::set<BasicBlock*> inRegion(region.begin(), region.end());
+            for (size_t index = 1; index < region.size(); ++index)
+            {
+                BasicBlock* regionBlock = region[index];
+                if (std::any_of(pred_begin(regionBlock), pred_end(regionBlock), [&inRegion](BasicBlock* predecessor) { return !inRegion.count(predecessor); }))
+                {
+                    region.erase(region.begin() + index);
+                    removed = true;
+                    break;
+                }
+            }
+        }
+
+        size_t instructions = 0;
+        for (auto regionBlock : region)
+            instructions += regionBlock->size();
+        if (instructions >= minRegionInstructions)
+            regions.push_back(region);
+    }
+
+    size_t split = 0;
+    for (auto& region : regions)
+    {
+        CodeExtractor extractor(region);
+        if (!extractor.isEligible())
+            continue;
+
+        Function* coldFunction = extractor.extractCodeRegion();
+        if (!coldFunction)
+            continue;
+
+        coldFunction->addFnAttr(Attribute::Cold);
+        coldFunction->addFnAttr(Attribute::NoInline);
+        coldFunction->addFnAttr(Attribute::MinSize);
+        coldFunction->setSection(".text.unlikely");
+        split++;
+    }
+
+    return split;
+}
+
+TargetMachine* SurgeonJIT::SelectTargetMachine() {
+    EngineBuilder builder;
+    // All the JIT'd code and data are in one region (see JITMemoryManager.h), so calls and
+    // RIP-relative accesses between modules are direct. Position-independent code reaches
+    // the rest of the process through the GOT and stubs of each object.
+    if (JITMemoryManager::hasNearRegion())
+        builder.setCodeModel(CodeModel::Small).setRelocationModel(Reloc::PIC_);
+    return builder.selectTarget();
+}
+
+// Programs are compiled with the static relocation model, which makes every declaration
+// DSO-local. With the small code model, only declarations in range of the JIT region may
+// stay so: symbols defined by other JIT'd modules are in the region, and the libraries the
+// region is reserved next to usually are. Lazily compiled functions are called through
+// stubs outside of the region.
+void SurgeonJIT::MarkFarDeclarations(Module& M) {
+    if (!JITMemoryManager::hasNearRegion())
+        return;
+
+    for (GlobalValue& GV : M.global_values())
+    {
+        if (!GV.isDeclaration() || GV.hasLocalLinkage())
+            continue;
+        if (auto F = dyn_cast<Function>(&GV))
+            if (F->isIntrinsic())
+                continue;
+
+        uint64_t address = (uint64_t)DynamicLibrary::SearchForAddressOfSymbol(GV.getName());
+        if (address)
+            GV.setDSOLocal(JITMemoryManager::isReachableFromRegion(address));
+        else
+            GV.setDSOLocal(!GV.hasExternalWeakLinkage() && !(lazyCompilation && isa<Function>(GV)));
+    }
+}
+
+std::vector<LoadedCSITool> SurgeonJIT::GetCSITools(const std::vector<std::string>& tools) {
+    std::vector<LoadedCSITool> loadedTools;
+    for (auto& tool : tools)
+        loadedTools.push_back(csiTools[tool]);
+    return loadedTools;
+}
+
+std::vector<std::string> SurgeonJIT::GetCSIToolBitcodeFiles(const std::vector<std::string>& tools) {
+    std::vector<std::string> toolBitcodeFiles;
+    for (auto& tool : tools)
+        toolBitcodeFiles.push_back(csiTools[tool].GetBitcodeFilename());
+    return toolBitcodeFiles;
+}
+
+std::unique_ptr<Module> SurgeonJIT::optimizeModule(std::unique_ptr<Module> M) {
+    // Modules not added through addModule are partitions of the compile-on-demand layer,
+    // compiled at O3 without CSI. The settings of a module are dropped once it is here,
+    // since a later module may be allocated at the same address.
+    bool enableCSI = false;
+    std::vector<std::string> moduleTools;
+    unsigned optLevel = 3;
+    auto csiEnabled = modulesCSIEnabled.find(M.get());
+    if (csiEnabled != modulesCSIEnabled.end())
+    {
+        enableCSI = csiEnabled->second;
+        modulesCSIEnabled.erase(csiEnabled);
+    }
+    auto csiTool = modulesCSITool.find(M.get());
+    if (csiTool != modulesCSITool.end())
+    {
+        moduleTools = std::move(csiTool->second);
+        modulesCSITool.erase(csiTool);
+    }
+    auto moduleOptLevel = modulesOptLevel.find(M.get());
+    if (moduleOptLevel != modulesOptLevel.end())
+    {
+        optLevel = moduleOptLevel->second;
+        modulesOptLevel.erase(moduleOptLevel);
+    }
 
+    // If an object for this module is already cached, the compile layer will load it
+    // directly and there is no need to optimize the module.
+    std::vector<std::string> toolBitcodeFiles;
+    if (enableCSI)
+        toolBitcodeFiles = GetCSIToolBitcodeFiles(moduleTools);
+    bool isLayout = layoutModules.erase(M.get()) > 0;
+
+    // Before the key of the module is computed: cached objects only have direct references
+    // that are still in range.
+    MarkFarDeclarations(*M);
+    KeepFramePointers(*M);
+    if (objectCache.PrepareModule(*M, optLevel, toolBitcodeFiles))
+        return M;
+
+    OptimizeModule(*M, optLevel, enableCSI, enableCSI ? GetCSITools(moduleTools) : std::vector<LoadedCSITool>());
+    // Instrumentation declares the hooks of the tools.
+    MarkFarDeclarations(*M);
+
+    // Cold code is split out of the laid out functions once they are optimized, so that it
+    // isn't inlined back. Extracted functions are appended to the module, after the hot ones.
+    if (isLayout)
+    {
+        std::vector<Function*> functions;
+        for (auto& function : *M)
+            functions.push_back(&function);
+        for (auto function : functions)
+            splitColdRegions += SplitColdBlocks(*function);
+    }
+
+    KeepFramePointers(*M);
     return M;
 }
 
+void SurgeonJIT::CompileRecompileJob(RecompileJob& job, bool enableCSI, const std::vector<LoadedCSITool>& tools,
+    const std::vector<std::string>& toolBitcodeFiles) {
+    // Note: the jitMutex is not held here. Only the job, the object cache and
+    // objects owned by this function can be touched.
+    LLVMContext context;
+
+    auto moduleOrError = parseBitcodeFile(MemoryBufferRef(StringRef(job.bitcode.data(), job.bitcode.size()), "instrumented"), context);
+    if (!moduleOrError)
+    {
+        job.error = toString(moduleOrError.takeError());
+        return;
+    }
+    std::unique_ptr<Module> M = std::move(moduleOrError.get());
+
+    // Instrumented modules are always optimized at O3. The key of a module doesn't cover its
+    // profile, so objects of PGO variants are never cached.
+    MarkFarDeclarations(*M);
+    KeepFramePointers(*M);
+    if (job.pgo != PGOPhase::None || !objectCache.PrepareModule(*M, 3, toolBitcodeFiles))
+    {
+        OptimizeModule(*M, 3, enableCSI, tools, job.pgo, job.profileFile);
+        MarkFarDeclarations(*M);
+        KeepFramePointers(*M);
+    }
+
+    // The target machine is not thread-safe either.
+    std::unique_ptr<TargetMachine> jobTM(SelectTargetMachine());
+    SimpleCompiler compiler(*jobTM, &objectCache);
+    job.object = compiler(*M);
+}
+
 std::string SurgeonJIT::mangle(StringRef Name) {
     std::string MangledName;
     raw_string_ostream MangledNameStream(MangledName);
@@ -628,9 +1838,22 @@ std::string SurgeonJIT::mangle(StringRef Name) {
     return MangledName;
 }
 
-std::string SurgeonJIT::GenerateInstrumentationPrefix(const std::string & rootFunctionName)
+std::string SurgeonJIT::GenerateInstrumentationPrefix(const std::string & rootFunctionName, const std::string& variantKey)
 {
-    return "surgeon_instr_" + rootFunctionName + "_";
+    // Loaded variants of the same root need distinct symbols, but a variant prepared again after
+    // an identical one has been unloaded takes its prefix, so that its objects are cached.
+    auto unloaded = unloadedPrefixes.find(variantKey);
+    if (unloaded != unloadedPrefixes.end() && !unloaded->second.empty())
+    {
+        std::string prefix = unloaded->second.back();
+        unloaded->second.pop_back();
+        return prefix;
+    }
+
+    size_t variant = variantsPerRoot[rootFunctionName]++;
+    if (variant == 0)
+        return "surgeon_instr_" + rootFunctionName + "_";
+    return "surgeon_instr_" + rootFunctionName + "_" + std::to_string(variant) + "_";
 }
 
 std::unique_ptr<llvm::Module> SurgeonJIT::LoadHelperModule(LLVMContext & context) {
@@ -693,3 +1916,835 @@ void SurgeonJIT::LoadAndAddModule(const std::string & moduleName, bool enableCSI
         exit(-1);
     }
 }
+
+
+void SurgeonJIT::LoadTieredCompilationOptions() {
+    tieredCompilation = OptionsStore::GetOption("tiered_compilation") == "1";
+    if (tieredCompilation && lazyCompilation)
+    {
+        std::cout << "Tiered compilation cannot be used together with lazy compilation and will be disabled\n";
+        tieredCompilation = false;
+    }
+
+    std::string option = OptionsStore::GetOption("tier_baseline_opt_level");
+    if (option.size() > 0)
+    {
+        char* end = nullptr;
+        long level = std::strtol(option.c_str(), &end, 10);
+        if (end == option.c_str() || *end != '\0')
+        {
+            std::cout << "Invalid tier_baseline_opt_level '" << option << "', using " << baselineOptLevel << "\n";
+        }
+        else
+        {
+            baselineOptLevel = (unsigned)std::min(std::max(level, 0L), 3L);
+            if (baselineOptLevel != level)
+                std::cout << "tier_baseline_opt_level must be between 0 and 3, using " << baselineOptLevel << "\n";
+        }
+    }
+
+    option = OptionsStore::GetOption("tier_up_threshold");
+    if (option.size() > 0)
+        tierUpThreshold = std::strtoull(option.c_str(), nullptr, 10);
+
+    option = OptionsStore::GetOption("tier_up_interval_ms");
+    if (option.size() > 0)
+        tierUpIntervalMs = std::max(std::atoi(option.c_str()), 1);
+}
+
+void SurgeonJIT::InsertTierUpChecks(Module & M) {
+    auto& context = M.getContext();
+    Type* int64Type = Type::getInt64Ty(context);
+
+    for (Function& function : M)
+    {
+        if (function.isDeclaration() || function.hasLocalLinkage() || function.hasAvailableExternallyLinkage() ||
+            function.isVarArg() || !function.hasName())
+            continue;
+
+        std::string name = function.getName();
+
+        // The counter and the dispatch slot follow the linkage of the function, so that
+        // functions defined in multiple modules don't clash.
+        GlobalValue::LinkageTypes linkage = function.hasExternalLinkage() ? GlobalValue::LinkageTypes::ExternalLinkage : function.getLinkage();
+        GlobalVariable* counter = new GlobalVariable(M, int64Type, false, linkage,
+            ConstantInt::get(int64Type, 0), "__surgeon_tier_counter_" + name);
+        GlobalVariable* target = new GlobalVariable(M, int64Type, false, linkage,
+            ConstantInt::get(int64Type, 0), "__surgeon_tier_target_" + name);
+        if (function.hasComdat())
+        {
+            counter->setComdat(function.getComdat());
+            target->setComdat(function.getComdat());
+        }
+
+        BasicBlock* originalEntry = &function.getEntryBlock();
+        BasicBlock* entry = BasicBlock::Create(context, "tier.entry", &function, originalEntry);
+        BasicBlock* optimized = BasicBlock::Create(context, "tier.optimized", &function, originalEntry);
+        BasicBlock* baseline = BasicBlock::Create(context, "tier.baseline", &function, originalEntry);
+
+        // Static allocas have to stay in the entry block to be promoted to registers.
+        std::vector<AllocaInst*> allocas;
+        for (auto& inst : *originalEntry)
+        {
+            AllocaInst* alloca = dyn_cast<AllocaInst>(&inst);
+            if (alloca && isa<Constant>(alloca->getArraySize()))
+                allocas.push_back(alloca);
+        }
+        for (auto alloca : allocas)
+        {
+            alloca->removeFromParent();
+            entry->getInstList().push_back(alloca);
+        }
+
+        // If an optimized version has been published, forward the call to it.
+        IRBuilder<> builder{ entry };
+        LoadInst* optimizedAddress = builder.CreateLoad(target);
+        optimizedAddress->setAlignment(8);
+        optimizedAddress->setAtomic(AtomicOrdering::Monotonic);
+        builder.CreateCondBr(builder.CreateICmpNE(optimizedAddress, builder.getInt64(0)), optimized, baseline);
+
+        builder.SetInsertPoint(optimized);
+        std::vector<Value*> args;
+        for (Argument& arg : function.args())
+        {
+            args.push_back(&arg);
+        }
+        Value* optimizedFunction = builder.CreateIntToPtr(optimizedAddress, function.getFunctionType()->getPointerTo());
+        CallInst* call = builder.CreateCall(optimizedFunction, args);
+        call->setCallingConv(function.getCallingConv());
+        call->setAttributes(function.getAttributes());
+        call->setTailCall();
+        if (!function.getReturnType()->isVoidTy())
+        {
+            builder.CreateRet(call);
+        }
+        else {
+            builder.CreateRetVoid();
+        }
+
+        // Otherwise count the call and run the baseline code. Lost increments due to
+        // concurrent calls are acceptable.
+        builder.SetInsertPoint(baseline);
+        LoadInst* count = builder.CreateLoad(counter);
+        count->setAlignment(8);
+        count->setAtomic(AtomicOrdering::Monotonic);
+        StoreInst* store = builder.CreateStore(builder.CreateAdd(count, builder.getInt64(1)), counter);
+        store->setAlignment(8);
+        store->setAtomic(AtomicOrdering::Monotonic);
+        builder.CreateBr(originalEntry);
+
+        tieredFunctions[name];
+    }
+}
+
+void SurgeonJIT::StartTieredCompilation(const std::vector<VModuleKey>& keys) {
+    if (!tieredCompilation)
+        return;
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+        // Emit everything up front: baseline code is cheap to generate, and it guarantees
+        // that the program never triggers a compilation while the background thread is working.
+        for (auto key : keys)
+        {
+            if (auto Err = OptimizeLayer.emitAndFinalize(key))
+            {
+                llvm::errs() << "Error emitting baseline module: " << Err << "\n";
+                exit(-1);
+            }
+        }
+    }
+
+    StartTierUpThread();
+}
+
+void SurgeonJIT::StartTierUpThread() {
+    stopTierUpThread = false;
+    tierUpThread = std::thread([this]()
+        {
+            while (!stopTierUpThread)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(tierUpIntervalMs));
+                TierUpHotFunctions();
+            }
+        });
+}
+
+void SurgeonJIT::PauseBackgroundThreads(bool holdLock) {
+    // Speculation is restarted at the next prompt.
+    StopSpeculativeCompilation();
+    if (speculativeThread.joinable())
+        speculativeThread.join();
+
+    tierUpPaused = tierUpThread.joinable();
+    stopTierUpThread = true;
+    if (tierUpThread.joinable())
+        tierUpThread.join();
+
+    if (holdLock)
+        jitMutex.lock();
+    jitMutexHeld = holdLock;
+}
+
+void SurgeonJIT::ResumeBackgroundThreads() {
+    if (jitMutexHeld)
+        jitMutex.unlock();
+    jitMutexHeld = false;
+
+    if (tierUpPaused)
+        StartTierUpThread();
+    tierUpPaused = false;
+}
+
+void SurgeonJIT::TierUpHotFunctions() {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    for (auto& pair : tieredFunctions)
+    {
+        auto& function = pair.second;
+        if (function.tier != Tier::Baseline)
+            continue;
+
+        if (function.counter == nullptr)
+        {
+            // The baseline optimizer may have dropped the function.
+            std::string counterName = "__surgeon_tier_counter_" + pair.first;
+            if (GetSizeForSymbol(counterName) == 0)
+                continue;
+
+            function.counter = (volatile uint64_t*)cantFail(findSymbol(counterName, false).getAddress());
+            function.target = (volatile uint64_t*)cantFail(findSymbol("__surgeon_tier_target_" + pair.first, false).getAddress());
+        }
+
+        if (*function.counter >= tierUpThreshold)
+            TierUpFunction(pair.first, function);
+    }
+}
+
+void SurgeonJIT::TierUpFunction(const std::string & functionName, TieredFunction & function) {
+    size_t moduleIndex = functionModuleMapping[functionName];
+    if (moduleIndex == 0)
+        return;
+
+    std::string optimizedName = "surgeon_optimized_" + functionName;
+
+    // Only the function and the definitions it needs that aren't emitted yet are copied.
+    auto module = ExtractFunctions(*modules[moduleIndex - 1], { functionName });
+    RemoveConstrsDestrAliasesAndSetGlobalsExternal(*module);
+
+    for (auto& fn : *module)
+    {
+        std::string name = fn.getName();
+        if (name == functionName)
+        {
+            fn.setName(optimizedName);
+            fn.setLinkage(GlobalValue::LinkageTypes::ExternalLinkage);
+            fn.setComdat(nullptr);
+        }
+        else if (!fn.isDeclaration() && !fn.hasComdat() &&
+            fn.getLinkage() != llvm::GlobalValue::LinkageTypes::PrivateLinkage && IsSymbolEmitted(name))
+        {
+            fn.deleteBody();
+            fn.setLinkage(llvm::GlobalValue::LinkageTypes::ExternalLinkage);
+        }
+    }
+
+    auto key = addModule(std::move(module), false, false);
+    if (auto Err = OptimizeLayer.emitAndFinalize(key))
+    {
+        llvm::errs() << "Error emitting optimized version of " << functionName << ": " << Err << "\n";
+        function.tier = Tier::Failed;
+        return;
+    }
+
+    uint64_t optimizedAddress = cantFail(OptimizeLayer.findSymbolIn(key, optimizedName, false).getAddress());
+    __atomic_store_n(function.target, optimizedAddress, __ATOMIC_RELEASE);
+    function.tier = Tier::Optimized;
+}
+
+void SurgeonJIT::PrintTiers() {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    if (!tieredCompilation)
+    {
+        std::cout << "Tiered compilation is disabled, every function is compiled at O3\n";
+        return;
+    }
+
+    for (auto& pair : tieredFunctions)
+    {
+        auto& function = pair.second;
+        if (function.counter == nullptr)
+            continue;
+
+        if (function.tier == Tier::Optimized)
+            std::cout << pair.first << ": optimized (O3)";
+        else if (function.tier == Tier::Failed)
+            std::cout << pair.first << ": baseline (O" << baselineOptLevel << "), optimization failed";
+        else
+            std::cout << pair.first << ": baseline (O" << baselineOptLevel << ")";
+        std::cout << ", " << *function.counter << " calls\n";
+    }
+}
+
+bool SurgeonJIT::FindProgramFunction(uint64_t address, std::string& name) {
+    std::string kind;
+    if (!listener.FindFunctionForAddress(address, name))
+        return false;
+    StripCopyPrefix(name, kind);
+    return functionModuleMapping.find(name) != functionModuleMapping.end();
+}
+
+std::vector<std::string> SurgeonJIT::ComputeFunctionLayout() {
+    // C3 (call-chain clustering): visit the functions from the hottest, and append the cluster
+    // of each one to the cluster of its most frequent caller, unless the result gets too large
+    // or much sparser than the caller's cluster. Clusters are then placed by decreasing density.
+    const uint64_t maxClusterSize = 1024 * 1024;
+    const double maxDensityDegradation = 8;
+
+    // Samples are attributed to the program function that ran, whatever copy of it did.
+    // A function weighs its own samples and the samples of the calls it receives.
+    std::map<std::string, uint64_t> weights;
+    std::map<std::string, std::map<std::string, uint64_t>> callers;
+    std::string caller, callee;
+    for (auto& sample : Profiler::GetInstructionSamples())
+    {
+        if (FindProgramFunction(sample.first, callee))
+            weights[callee] += sample.second;
+    }
+    for (auto& sample : Profiler::GetCallSamples())
+    {
+        if (!FindProgramFunction(sample.first.first, caller) || !FindProgramFunction(sample.first.second, callee) || caller == callee)
+            continue;
+        weights[caller];
+        weights[callee] += sample.second;
+        callers[callee][caller] += sample.second;
+    }
+
+    // Roots of installed instrumentation must keep jumping to their variant.
+    for (auto& variant : installedVariants)
+        weights.erase(variant.first);
+
+    struct Cluster {
+        std::vector<std::string> functions;
+        uint64_t size;
+        uint64_t weight;
+    };
+
+    std::vector<Cluster> clusters;
+    std::map<std::string, size_t> clusterOf;
+    std::vector<std::pair<uint64_t, std::string>> byWeight;
+    for (auto& function : weights)
+    {
+        size_t size = GetSizeForSymbol(function.first);
+        if (size == 0)
+            continue;
+        clusterOf[function.first] = clusters.size();
+        clusters.push_back(Cluster{ { function.first }, size, function.second });
+        byWeight.push_back(std::make_pair(function.second, function.first));
+    }
+    std::sort(byWeight.begin(), byWeight.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b)
+        {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+    for (auto& function : byWeight)
+    {
+        auto functionCallers = callers.find(function.second);
+        if (functionCallers == callers.end())
+            continue;
+
+        std::string bestCaller;
+        uint64_t bestSamples = 0;
+        for (auto& candidate : functionCallers->second)
+        {
+            if (candidate.second > bestSamples && clusterOf.find(candidate.first) != clusterOf.end())
+            {
+                bestCaller = candidate.first;
+                bestSamples = candidate.second;
+            }
+        }
+        if (bestCaller.empty())
+            continue;
+
+        Cluster& into = clusters[clusterOf[bestCaller]];
+        Cluster& from = clusters[clusterOf[function.second]];
+        if (&into == &from || into.size + from.size > maxClusterSize)
+            continue;
+
+        double density = (double)into.weight / into.size;
+        double mergedDensity = (double)(into.weight + from.weight) / (into.size + from.size);
+        if (mergedDensity * maxDensityDegradation < density)
+            continue;
+
+        size_t intoIndex = clusterOf[bestCaller];
+        for (auto& moved : from.functions)
+        {
+            clusterOf[moved] = intoIndex;
+            into.functions.push_back(moved);
+        }
+        into.size += from.size;
+        into.weight += from.weight;
+        from = Cluster{ {}, 0, 0 };
+    }
+
+    std::vector<Cluster*> placed;
+    for (auto& cluster : clusters)
+    {
+        if (!cluster.functions.empty())
+            placed.push_back(&cluster);
+    }
+    std::stable_sort(placed.begin(), placed.end(), [](const Cluster* a, const Cluster* b)
+        {
+            return (double)a->weight / a->size > (double)b->weight / b->size;
+        });
+
+    std::vector<std::string> layout;
+    for (auto cluster : placed)
+        layout.insert(layout.end(), cluster->functions.begin(), cluster->functions.end());
+    return layout;
+}
+
+std::unique_ptr<Module> SurgeonJIT::BuildLayoutModule(const std::vector<std::string>& layout, const std::string& prefix, LLVMContext& context) {
+    std::set<std::string> hotFunctions(layout.begin(), layout.end());
+    std::map<size_t, std::set<std::string>> functionsByModule;
+    for (auto& function : layout)
+        functionsByModule[functionModuleMapping[function]].insert(function);
+
+    // The functions come from modules in different contexts: each part is moved to the
+    // context of the layout module through bitcode, and linked into it.
+    std::unique_ptr<Module> layoutModule = llvm::make_unique<Module>("surgeon_layout", context);
+    Linker linker(*layoutModule);
+
+    for (auto& moduleFunctionsPair : functionsByModule)
+    {
+        auto& functionSet = moduleFunctionsPair.second;
+        auto module = ExtractFunctions(*modules[moduleFunctionsPair.first - 1], functionSet);
+        RemoveConstrsDestrAliasesAndSetGlobalsExternal(*module);
+
+        for (auto& function : *module)
+        {
+            std::string name = function.getName();
+            if (IsInSet(name, hotFunctions))
+            {
+                // Hot functions of other modules are declared under the name of their copy,
+                // so that calls between copies are direct.
+                if (!IsInSet(name, functionSet) && !function.isDeclaration())
+                    function.deleteBody();
+                function.setName(prefix + name);
+                function.setLinkage(GlobalValue::LinkageTypes::ExternalLinkage);
+                function.setComdat(nullptr);
+            }
+            else if (!function.isDeclaration() && !function.hasComdat() &&
+                function.getLinkage() != llvm::GlobalValue::LinkageTypes::PrivateLinkage && IsSymbolEmitted(name))
+            {
+                function.deleteBody();
+                function.setLinkage(llvm::GlobalValue::LinkageTypes::ExternalLinkage);
+            }
+        }
+
+        RemoveUnusedGlobals(*module);
+
+        SmallVector<char, 0> bitcode;
+        {
+            raw_svector_ostream bitcodeStream(bitcode);
+            WriteBitcodeToFile(*module, bitcodeStream);
+        }
+        auto moduleOrError = parseBitcodeFile(MemoryBufferRef(StringRef(bitcode.data(), bitcode.size()), "layout"), context);
+        if (!moduleOrError)
+        {
+            llvm::errs() << "Cannot build the layout module: " << toString(moduleOrError.takeError()) << "\n";
+            return nullptr;
+        }
+        if (linker.linkInModule(std::move(moduleOrError.get())))
+        {
+            llvm::errs() << "Cannot link the layout module\n";
+            return nullptr;
+        }
+    }
+
+    // Functions are emitted in the order of the module.
+    for (auto& function : layout)
+    {
+        if (Function* copy = layoutModule->getFunction(prefix + function))
+        {
+            copy->removeFromParent();
+            layoutModule->getFunctionList().push_back(copy);
+        }
+    }
+
+    return layoutModule;
+}
+
+bool SurgeonJIT::OptimizeLayout() {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    if (Profiler::IsRunning())
+    {
+        std::cout << "Stop the profiler before optimizing the layout\n";
+        return false;
+    }
+
+    std::vector<std::string> layout = ComputeFunctionLayout();
+    if (layout.empty())
+    {
+        std::cout << "The last profile has no samples in program functions (use 'profile start' and 'profile stop')\n";
+        return false;
+    }
+
+    // Copies of an earlier layout may still be running, so they are only unloaded once main
+    // returns, and the new copies get names of their own.
+    std::string prefix = "surgeon_layout_" + std::to_string(++layoutGeneration) + "_";
+
+    // The module lives as long as its code, like its context.
+    LayoutGeneration generation;
+    generation.context = llvm::make_unique<LLVMContext>();
+    auto module = BuildLayoutModule(layout, prefix, *generation.context);
+    if (!module)
+        return false;
+
+    layoutModules.insert(module.get());
+    splitColdRegions = 0;
+    generation.key = addModule(std::move(module), false, false);
+    if (auto Err = OptimizeLayer.emitAndFinalize(generation.key))
+    {
+        llvm::errs() << "Error emitting the layout: " << Err << "\n";
+        // The module can't be removed safely: it is kept, with its context.
+        generation.context.release();
+        return false;
+    }
+
+    // Functions that are no longer hot go back to their original code.
+    std::set<std::string> hotFunctions(layout.begin(), layout.end());
+    for (auto& function : layoutFunctions)
+    {
+        if (!IsInSet(function.first, hotFunctions) && installedVariants.find(function.first) == installedVariants.end())
+            RestoreFunction(function.first);
+    }
+    layoutFunctions.clear();
+
+    if (currentLayout.key)
+        retiredLayouts.push_back(std::move(currentLayout));
+    currentLayout = std::move(generation);
+
+    size_t layoutSize = 0;
+    for (auto& function : layout)
+    {
+        if (!findSymbol(prefix + function))
+            continue;
+        preemptFunction(function, prefix + function);
+        layoutFunctions[function] = prefix + function;
+        currentLayout.copies.push_back(prefix + function);
+        layoutSize += GetSizeForSymbol(prefix + function);
+    }
+
+    std::cout << "Laid out " << layoutFunctions.size() << " hot functions (" << layoutSize << " bytes)";
+    if (splitColdRegions > 0)
+        std::cout << ", moved " << splitColdRegions << " cold regions out of them";
+    std::cout << "\n";
+    return true;
+}
+
+void* SurgeonJIT::InstrumentForPGO(const std::string& functionName) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    if (!CanBeInstrumentationRoot(functionName))
+        return nullptr;
+
+    // Without the pool, only the counters are profiled.
+    MapProfileValuePool();
+    return InstallInstrumentedVariant(PrepareInstrumentedVariant(functionName, false, {}, PGOPhase::Generate));
+}
+
+bool SurgeonJIT::OptimizeWithProfile(const std::string& functionName) {
+    std::lock_guard<std::recursive_mutex> lock(jitMutex);
+
+    auto installed = installedVariants.find(functionName);
+    if (installed == installedVariants.end() || installed->second->pgo != PGOPhase::Generate)
+        return false;
+
+    auto variant = PrepareInstrumentedVariant(functionName, false, {}, PGOPhase::Use, installed->second.get());
+    if (!variant)
+        return false;
+
+    // The instrumented code may be running, so it is only retired.
+    auto pointerToAddr = OptimizeLayer.findSymbolIn(installed->second->surgeonKey, installed->second->prefix + "address", false);
+    RemoveInstrumentation(functionName, false);
+    void* optimizedAddr = InstallInstrumentedVariant(std::move(variant));
+
+    // An interactive cycle that is still open keeps calling the subtree through the trampoline
+    // of the instrumented variant: its next iterations run the optimized code.
+    if (pointerToAddr)
+        *((uintptr_t*)pointerToAddr.getAddress().get()) = (uintptr_t)optimizedAddr;
+
+    std::cout << "Optimized " << functionName << " with its profile\n";
+    return true;
+}
+
+size_t SurgeonJIT::WritePGOProfile(const InstrumentedVariant& profiled, const std::string& prefix, const std::set<std::string>& subtree,
+    const std::string& path) {
+    typedef RawInstrProf::ProfileData<uint64_t> ProfileData;
+
+    InstrProfWriter writer;
+    cantFail(writer.setIsIRLevelProfile(true));
+
+    size_t functions = 0;
+    size_t functionsRun = 0;
+    for (auto key : profiled.keys)
+    {
+        // Records refer to their function by the MD5 hash of its name.
+        std::map<uint64_t, std::string> functionsByHash;
+        for (auto& name : listener.GetFunctionNames(key))
+        {
+            if (name.compare(0, profiled.prefix.size(), profiled.prefix) == 0)
+                functionsByHash[IndexedInstrProf::ComputeHash(name)] = name.substr(profiled.prefix.size());
+        }
+
+        auto section = listener.GetProfileData(key);
+        const ProfileData* data = (const ProfileData*)section.first;
+        for (size_t index = 0; index < section.second / sizeof(ProfileData); ++index)
+        {
+            auto function = functionsByHash.find(data[index].NameRef);
+            if (function == functionsByHash.end())
+                continue;
+
+            const uint64_t* counters = (const uint64_t*)data[index].CounterPtr;
+            std::vector<uint64_t> counts(counters, counters + data[index].NumCounters);
+            functions++;
+            if (std::any_of(counts.begin(), counts.end(), [](uint64_t count) { return count > 0; }))
+                functionsRun++;
+
+            // The optimized variant has the same functions under its own prefix.
+            std::string name = prefix + function->second;
+            NamedInstrProfRecord record(name, data[index].FuncHash, std::move(counts));
+
+            uint32_t site = 0;
+            for (uint32_t kind = IPVK_First; kind <= IPVK_Last; ++kind)
+            {
+                record.reserveSites(kind, data[index].NumValueSites[kind]);
+                for (uint32_t kindSite = 0; kindSite < data[index].NumValueSites[kind]; ++kindSite, ++site)
+                {
+                    std::vector<InstrProfValueData> values;
+                    auto slots = (ProfileValueSite* const*)data[index].Values;
+                    if (slots && slots[site])
+                    {
+                        std::map<uint64_t, uint64_t> observed;
+                        for (auto& entry : slots[site]->entries)
+                        {
+                            if (entry.state == 2)
+                                observed[entry.value] += entry.count;
+                        }
+
+                        for (auto& value : observed)
+                        {
+                            InstrProfValueData valueData{ value.first, value.second };
+
+                            // Call targets are identified by the hash of their name, as seen from the
+                            // optimized variant, which calls the functions of the subtree under its prefix.
+                            if (kind == IPVK_IndirectCallTarget)
+                            {
+                                std::string target;
+                                std::string copyKind;
+                                if (!listener.FindFunctionForAddress(value.first, target))
+                                    continue;
+                                if (target.compare(0, profiled.prefix.size(), profiled.prefix) == 0)
+                                    target = target.substr(profiled.prefix.size());
+                                else
+                                    StripCopyPrefix(target, copyKind);
+                                if (subtree.find(target) != subtree.end())
+                                    target = prefix + target;
+                                valueData.Value = IndexedInstrProf::ComputeHash(target);
+                            }
+
+                            values.push_back(valueData);
+                        }
+                    }
+
+                    record.addValueData(kind, kindSite, values.data(), values.size(), nullptr);
+                }
+            }
+
+            writer.addRecord(std::move(record), [](Error E) { consumeError(std::move(E)); });
+        }
+    }
+
+    if (functionsRun == 0)
+    {
+        std::cout << "The instrumented code of " << profiled.rootFunction << " hasn't run yet (use 'run' in the interactive cycle)\n";
+        return 0;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream out(path, EC, sys::fs::F_None);
+    if (EC)
+    {
+        llvm::errs() << "Cannot write the profile to " << path << ": " << EC.message() << "\n";
+        return 0;
+    }
+    writer.write(out);
+
+    std::cout << "Profiled " << functions << " functions, " << functionsRun << " of which ran\n";
+    if (profileValuePool && profileValuePool->dropped > 0)
+        std::cout << profileValuePool->dropped << " observed values didn't fit in the value profile\n";
+    return functionsRun;
+}
+
+static CallSite GetIndirectCallSite(Instruction& inst) {
+    if (isa<CallInst>(inst) || isa<InvokeInst>(inst))
+    {
+        CallSite callSite(&inst);
+        if (!callSite.isInlineAsm() && !isa<Function>(callSite.getCalledValue()->stripPointerCasts()))
+            return callSite;
+    }
+    return CallSite();
+}
+
+void SurgeonJIT::AssignIndirectCallSites(Module & M) {
+    auto& context = M.getContext();
+    Type* int64Type = Type::getInt64Ty(context);
+
+    // Site IDs are attached as metadata, so they survive in the database and in every
+    // module cloned from it.
+    for (Function& function : M)
+    {
+        for (auto& block : function)
+        {
+            for (auto& inst : block)
+            {
+                if (GetIndirectCallSite(inst))
+                {
+                    uint64_t site = indirectCallSites.size();
+                    indirectCallSites.push_back(function.getName());
+                    inst.setMetadata("surgeon.site", MDNode::get(context,
+                        ConstantAsMetadata::get(ConstantInt::get(int64Type, site))));
+                }
+            }
+        }
+    }
+
+    AllocateIndirectCallSiteTables(indirectCallSites.size());
+}
+
+static bool GetIndirectCallSiteID(Instruction& inst, uint64_t& site) {
+    MDNode* node = inst.getMetadata("surgeon.site");
+    if (!node)
+        return false;
+
+    site = mdconst::extract<ConstantInt>(node->getOperand(0))->getZExtValue();
+    return true;
+}
+
+void SurgeonJIT::InsertIndirectCallProfiling(Module & M) {
+    auto& context = M.getContext();
+    Type* int64Type = Type::getInt64Ty(context);
+    Type* pointerType = Type::getInt8PtrTy(context);
+
+    Constant* hook = M.getOrInsertFunction("__surgeon_profile_indirect_call",
+        FunctionType::get(Type::getVoidTy(context), { int64Type, pointerType }, false));
+
+    for (Function& function : M)
+    {
+        for (auto& block : function)
+        {
+            for (auto& inst : block)
+            {
+                uint64_t site;
+                CallSite callSite = GetIndirectCallSite(inst);
+                if (!callSite || !GetIndirectCallSiteID(inst, site))
+                    continue;
+
+                IRBuilder<> builder(&inst);
+                builder.CreateCall(hook, { ConstantInt::get(int64Type, site),
+                    builder.CreatePointerCast(callSite.getCalledValue(), pointerType) });
+            }
+        }
+    }
+}
+
+void SurgeonJIT::MergeIndirectCallProfile() {
+    for (uint64_t site = 0; site < indirectCallSites.size(); ++site)
+    {
+        IndirectCallSiteTable* table = GetIndirectCallSiteTable(site);
+        if (!table)
+            break;
+
+        for (auto& entry : table->targets)
+        {
+            uint64_t address = __atomic_load_n(&entry.target, __ATOMIC_RELAXED);
+            if (address == 0)
+                break;
+
+            // Targets keep their entries; only the calls counted since the last merge are added.
+            uint64_t count = __atomic_exchange_n(&entry.count, 0, __ATOMIC_RELAXED);
+            std::string target;
+            if (count == 0 || !listener.FindFunctionForAddress(address, target))
+                continue;
+
+            // Calls into instrumented code or trampolines are not part of the program.
+            if (functionModuleMapping.find(target) == functionModuleMapping.end())
+                continue;
+
+            indirectCallTargets[site][target] += count;
+            callGraph.AddEdge(indirectCallSites[site], target, count);
+        }
+    }
+}
+
+void SurgeonJIT::PromoteIndirectCalls(Module & M, const std::vector<Function*>& functions, const std::set<std::string>& instrumentedFunctions,
+    const std::string & instrumentationPrefix) {
+    std::vector<std::pair<Instruction*, uint64_t>> sites;
+    for (Function* function : functions)
+    {
+        for (auto& block : *function)
+        {
+            for (auto& inst : block)
+            {
+                uint64_t site;
+                if (GetIndirectCallSite(inst) && GetIndirectCallSiteID(inst, site) &&
+                    indirectCallTargets.find(site) != indirectCallTargets.end())
+                    sites.push_back(std::make_pair(&inst, site));
+            }
+        }
+    }
+
+    for (auto& sitePair : sites)
+    {
+        // Most frequent targets first.
+        std::vector<std::pair<uint64_t, std::string>> targets;
+        for (auto& target : indirectCallTargets[sitePair.second])
+        {
+            if (instrumentedFunctions.find(target.first) != instrumentedFunctions.end())
+                targets.push_back(std::make_pair(target.second, target.first));
+        }
+        std::sort(targets.rbegin(), targets.rend());
+        if (targets.size() > maxPromotedTargetsPerSite)
+            targets.resize(maxPromotedTargetsPerSite);
+
+        // Every promotion leaves the original indirect call in the else branch,
+        // which is then promoted for the next target.
+        Instruction* inst = sitePair.first;
+        for (auto& target : targets)
+        {
+            const std::string& targetName = target.second;
+            Function* original = modules[functionModuleMapping[targetName] - 1]->getFunction(targetName);
+
+            // The comparison is against the address of the original function, but the
+            // promoted call goes to its instrumented version.
+            Function* declaration = M.getFunction(targetName);
+            if (!declaration)
+                declaration = Function::Create(original->getFunctionType(), GlobalValue::LinkageTypes::ExternalLinkage, targetName, &M);
+
+            CallSite callSite(inst);
+            if (declaration->getFunctionType() != original->getFunctionType() || !isLegalToPromote(callSite, declaration))
+                continue;
+
+            MDBuilder mdBuilder(M.getContext());
+            Instruction* directCall = promoteCallWithIfThenElse(callSite, declaration,
+                mdBuilder.createBranchWeights(target.first, 1));
+
+            Constant* substitute = M.getOrInsertFunction(instrumentationPrefix + targetName, original->getFunctionType());
+            CallSite(directCall).setCalledFunction(substitute);
+        }
+    }
+}
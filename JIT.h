@@ -2,7 +2,9 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
@@ -18,16 +20,28 @@
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/Object/SymbolSize.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "JITMemoryManager.h"
+#include "JITObjectCache.h"
+#include "OSR.h"
+#include "Patcher.h"
+#include "PerfMap.h"
+#include "Profiler.h"
 #include <algorithm>
 #include <memory>
 #include <string>
 #include <iostream>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include "CallGraph.h"
+#include "Disassembler.h"
 #include "Options.h"
 #include "CSITool.h"
 
@@ -51,29 +65,199 @@ public:
             if (size.second > 0)
             {
                 if (instrumentationMap[H])
+                {
                     overiddenSymbolSizes[size.first.getName().get()] = size.second;
+                    moduleOverriddenSymbols[H].push_back(size.first.getName().get());
+                }
                 else
                     symbolSizes[size.first.getName().get()] = size.second;
 
+                IndexFunctionSymbol(H, Object, size.first, size.second, LOS);
             }
         }
 
+        perfMap.NotifyLoaded(H, Object, LOS);
+
+        for (auto& section : Object.sections())
+        {
+            StringRef sectionName;
+            if (section.getName(sectionName))
+                continue;
+
+            // Line tables are only read when code is disassembled.
+            if (sectionName == ".debug_line")
+                debugObjects[H] = LOS.getObjectForDebug(Object);
+            // Per-function records of PGO instrumentation, which point to the counters.
+            else if (sectionName == "__llvm_prf_data")
+                profileData[H] = std::make_pair((uint64_t)LOS.getSectionLoadAddress(section), section.getSize());
+        }
+    }
+
+    void NotifyFinalized(VModuleKey H) {
+        perfMap.NotifyFinalized(H);
     }
 
     void RegisterInstrumentationMap(std::unordered_map<VModuleKey, bool>& map) {
         isInstrumented = &map;
     }
 
+    // Forgets the symbols of a module that has been removed from the JIT.
+    void ForgetModule(VModuleKey H) {
+        for (auto& name : moduleOverriddenSymbols[H])
+            overiddenSymbolSizes.erase(name);
+        for (auto address : moduleAddresses[H])
+            functionsByAddress.erase(address);
+        moduleOverriddenSymbols.erase(H);
+        moduleAddresses.erase(H);
+        debugContexts.erase(H);
+        debugObjects.erase(H);
+        profileData.erase(H);
+        perfMap.ForgetModule(H);
+    }
+
     size_t GetSizeForSymbol(const std::string& name) { return symbolSizes[name]; }
     size_t GetOveriddenSizeForSymbol(const std::string& name) { return overiddenSymbolSizes[name]; }
 
+    // Finds the JIT'd function whose code contains the given address.
+    bool FindFunctionForAddress(uint64_t address, std::string& name) {
+        auto it = functionsByAddress.upper_bound(address);
+        if (it == functionsByAddress.begin())
+            return false;
+        --it;
+        if (address >= it->first + it->second.second)
+            return false;
+        name = it->second.first;
+        return true;
+    }
+
+    // Start addresses and sizes of the loaded functions with the given symbol.
+    std::vector<std::pair<uint64_t, size_t>> FindFunctionsByName(const std::string& name) {
+        std::vector<std::pair<uint64_t, size_t>> functions;
+        for (auto& function : functionsByAddress)
+        {
+            if (function.second.first == name)
+                functions.push_back(std::make_pair(function.first, function.second.second));
+        }
+        return functions;
+    }
+
+    // Names of the functions loaded from a module.
+    std::vector<std::string> GetFunctionNames(VModuleKey H) {
+        std::vector<std::string> names;
+        for (auto address : moduleAddresses[H])
+            names.push_back(functionsByAddress[address].first);
+        return names;
+    }
+
+    // Address and size of the PGO data section of a module, or (0, 0) if it has none.
+    std::pair<uint64_t, uint64_t> GetProfileData(VModuleKey H) {
+        auto it = profileData.find(H);
+        return it != profileData.end() ? it->second : std::make_pair((uint64_t)0, (uint64_t)0);
+    }
+
+    // Source lines of the code in [address, address + size), if its module has debug info.
+    DILineInfoTable GetLineInfo(uint64_t address, uint64_t size) {
+        for (auto& module : moduleAddresses)
+        {
+            if (std::find(module.second.begin(), module.second.end(), address) == module.second.end())
+                continue;
+
+            auto debugObject = debugObjects.find(module.first);
+            if (debugObject == debugObjects.end() || !debugObject->second.getBinary())
+                break;
+
+            auto& context = debugContexts[module.first];
+            if (!context)
+                context = DWARFContext::create(*debugObject->second.getBinary());
+            return context->getLineInfoForAddressRange(address, size,
+                DILineInfoSpecifier(DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath, DILineInfoSpecifier::FunctionNameKind::None));
+        }
+        return DILineInfoTable();
+    }
+
+    // Number of bytes that can be overwritten at the entry of a function: its size plus the
+    // alignment padding that follows it, if the next function starts right after the padding.
+    size_t GetPatchableSize(uint64_t address, size_t size) {
+        auto next = functionsByAddress.upper_bound(address);
+        if (next != functionsByAddress.end() && next->first - address <= llvm::alignTo(size, 16))
+            return next->first - address;
+        return size;
+    }
+
 private:
+    template <typename ObjT, typename LoadResult>
+    void IndexFunctionSymbol(VModuleKey H, const ObjT& Object, const llvm::object::SymbolRef& symbol, uint64_t size, const LoadResult& LOS) {
+        auto type = symbol.getType();
+        if (!type || type.get() != llvm::object::SymbolRef::ST_Function)
+        {
+            llvm::consumeError(type.takeError());
+            return;
+        }
+
+        auto name = symbol.getName();
+        auto offset = symbol.getAddress();
+        auto section = symbol.getSection();
+        if (!name || !offset || !section || section.get() == Object.section_end())
+        {
+            llvm::consumeError(name.takeError());
+            llvm::consumeError(offset.takeError());
+            llvm::consumeError(section.takeError());
+            return;
+        }
+
+        // Symbols in relocatable objects are relative to their section.
+        uint64_t address = LOS.getSectionLoadAddress(*section.get()) + offset.get() - section.get()->getAddress();
+        functionsByAddress[address] = std::make_pair(name.get().str(), size);
+        moduleAddresses[H].push_back(address);
+    }
+
     std::unordered_map<std::string, size_t> symbolSizes;
     std::unordered_map<std::string, size_t> overiddenSymbolSizes;
+    // Start address -> (name, size) of every function loaded by the JIT.
+    std::map<uint64_t, std::pair<std::string, size_t>> functionsByAddress;
+    std::unordered_map<VModuleKey, std::vector<std::string>> moduleOverriddenSymbols;
+    std::unordered_map<VModuleKey, std::vector<uint64_t>> moduleAddresses;
+    // Objects with debug info, relocated at their load addresses.
+    std::unordered_map<VModuleKey, object::OwningBinary<object::ObjectFile>> debugObjects;
+    std::unordered_map<VModuleKey, std::unique_ptr<DWARFContext>> debugContexts;
+    std::unordered_map<VModuleKey, std::pair<uint64_t, uint64_t>> profileData;
     std::unique_ptr<JITEventListener> listener;
     std::unordered_map<VModuleKey, bool>* isInstrumented = nullptr;
+    PerfMap perfMap;
+};
+
+
+// Phases of the profile-guided optimization of a subtree ("pgo <function>").
+enum class PGOPhase {
+    None,
+    // IR-level profile instrumentation: counters on the edges of every function and value
+    // profiling of indirect call targets and memory operation sizes.
+    Generate,
+    // Optimized with the profile gathered by the instrumented subtree.
+    Use,
 };
 
+// Compile callbacks of the compile-on-demand layer run on the program threads that call a
+// stub, possibly on several of them at once. This wraps them so that every lazy compilation
+// holds the given lock, like any other access to the layers.
+class LockedCompileCallbackManager {
+public:
+    LockedCompileCallbackManager(JITCompileCallbackManager& manager, std::recursive_mutex& mutex)
+        : manager(manager), mutex(mutex) {}
+
+    Expected<JITTargetAddress> getCompileCallback(JITCompileCallbackManager::CompileFunction Compile) {
+        std::recursive_mutex& lockedMutex = mutex;
+        return manager.getCompileCallback([&lockedMutex, Compile]()
+            {
+                std::lock_guard<std::recursive_mutex> lock(lockedMutex);
+                return Compile();
+            });
+    }
+
+private:
+    JITCompileCallbackManager& manager;
+    std::recursive_mutex& mutex;
+};
 
 class SurgeonJIT {
 
@@ -87,15 +271,18 @@ private:
     std::shared_ptr<SymbolResolver> Resolver;
     std::unique_ptr<TargetMachine> TM;
     DataLayout DL;
+    JITObjectCache objectCache;
     RTDyldObjectLinkingLayer ObjectLayer;
     IRCompileLayer<RTDyldObjectLinkingLayer, SimpleCompiler> CompileLayer;
     LocalCXXRuntimeOverrides overrides;
+    FunctionPatcher patcher;
 
     JITCallGraph callGraph;
     std::vector<std::unique_ptr<Module>> modules;
     std::unordered_map<std::string, size_t> functionModuleMapping;
     std::unordered_map<llvm::Module*, bool> modulesCSIEnabled;
     std::unordered_map<llvm::Module*, std::vector<std::string>> modulesCSITool;
+    std::unordered_map<llvm::Module*, unsigned> modulesOptLevel;
     std::unordered_map<VModuleKey, bool> isInstrumented;
 
     std::unordered_map<std::string, LoadedCSITool> csiTools;
@@ -105,6 +292,124 @@ private:
 
     IRTransformLayer<decltype(CompileLayer), OptimizeFunction> OptimizeLayer;
 
+    // Lazy compilation: program modules are added to the compile-on-demand layer,
+    // which emits a stub for every function and compiles it on its first call.
+    bool lazyCompilation = false;
+    std::unique_ptr<JITCompileCallbackManager> CompileCallbackManager;
+    LockedCompileCallbackManager LockedCallbackManager;
+    CompileOnDemandLayer<decltype(OptimizeLayer), LockedCompileCallbackManager> CODLayer;
+    std::map<VModuleKey, std::shared_ptr<SymbolResolver>> lazyResolvers;
+    std::set<VModuleKey> lazyModules;
+    std::set<std::string> lazyFunctions;
+
+    // Tiered compilation: program modules are first emitted at a low optimization level
+    // with a call counter and a patchable dispatch slot at the entry of each function.
+    // A background thread recompiles hot functions at O3 and publishes them in the slot.
+    // Functions whose optimized version fails to compile stay at the baseline, as Failed, and
+    // are not tried again.
+    enum class Tier { Baseline, Optimized, Failed };
+
+    struct TieredFunction {
+        Tier tier = Tier::Baseline;
+        volatile uint64_t* counter = nullptr;
+        volatile uint64_t* target = nullptr;
+    };
+
+    bool tieredCompilation = false;
+    unsigned baselineOptLevel = 0;
+    uint64_t tierUpThreshold = 1000;
+    unsigned tierUpIntervalMs = 50;
+    std::map<std::string, TieredFunction> tieredFunctions;
+    std::thread tierUpThread;
+    std::atomic<bool> stopTierUpThread{ false };
+    bool tierUpPaused = false;
+    bool jitMutexHeld = false;
+
+    // An instrumented copy of the subtree rooted at a function, together with the trampoline
+    // that enters the interactive cycle. Variants are fully emitted when prepared, so they
+    // can be installed by just patching the root function.
+    struct InstrumentedVariant {
+        std::string rootFunction;
+        std::string prefix;
+        bool enableCSI = false;
+        std::vector<std::string> tools;
+        PGOPhase pgo = PGOPhase::None;
+        std::vector<VModuleKey> keys;
+        VModuleKey entryKey = 0;
+        // Variants optimized with a profile are entered directly, without a trampoline.
+        VModuleKey surgeonKey = 0;
+        // Continuations of the root function, as (loop index, symbol), and the transition
+        // flags they have been published in.
+        std::vector<std::pair<size_t, std::string>> osrContinuations;
+        std::vector<volatile uint64_t*> osrFlags;
+    };
+
+    std::unordered_map<std::string, size_t> variantsPerRoot;
+    // Prefixes of unloaded variants, by variant key (see GetVariantKey).
+    std::map<std::string, std::vector<std::string>> unloadedPrefixes;
+
+    // Variants currently installed, by root function.
+    std::map<std::string, std::unique_ptr<InstrumentedVariant>> installedVariants;
+    // Variants removed while the program was running, whose code can't be unloaded yet.
+    std::vector<std::unique_ptr<InstrumentedVariant>> retiredVariants;
+    // Original stub targets of lazily compiled functions that have been preempted.
+    std::map<std::string, JITTargetAddress> preemptedStubTargets;
+
+    // A module of an instrumented variant, serialized so that it can be optimized and
+    // compiled in its own context on a worker thread.
+    struct RecompileJob {
+        SmallVector<char, 0> bitcode;
+        bool containsEntryPoint = false;
+        PGOPhase pgo = PGOPhase::None;
+        std::string profileFile;
+        std::unique_ptr<MemoryBuffer> object;
+        std::string error;
+    };
+
+    // Speculative compilation: while the user sits at the prompt, a background thread
+    // prepares variants for likely roots, so that a later break only has to install them.
+    bool speculativeCompilation = false;
+    std::map<std::string, std::unique_ptr<InstrumentedVariant>> speculativeVariants;
+    std::thread speculativeThread;
+    std::atomic<bool> stopSpeculativeThread{ false };
+
+    // Indirect call profiling: program modules report the target of every indirect call
+    // to the host. Observed targets are added to the call graph, so they become part of
+    // instrumented subtrees, and recompiled call sites are promoted to direct calls to
+    // their instrumented versions.
+    bool indirectCallProfiling = false;
+    size_t maxPromotedTargetsPerSite = 4;
+    // Caller of every indirect call site, indexed by site ID.
+    std::vector<std::string> indirectCallSites;
+    // Site ID -> (target -> number of calls observed).
+    std::map<uint64_t, std::map<std::string, uint64_t>> indirectCallTargets;
+
+    // On-stack replacement: loop headers of program functions get transition points, so that
+    // a frame that is already running moves into an instrumented variant of its function.
+    bool osrEnabled = false;
+
+    std::unique_ptr<FunctionDisassembler> disassembler;
+
+    // Function layout: copies of the hot functions, emitted together in one module, replace
+    // them. Original function -> copy.
+    std::map<std::string, std::string> layoutFunctions;
+    size_t layoutGeneration = 0;
+    // The module of a layout, with the context it lives in and its copies.
+    struct LayoutGeneration {
+        VModuleKey key = 0;
+        std::unique_ptr<LLVMContext> context;
+        std::vector<std::string> copies;
+    };
+    LayoutGeneration currentLayout;
+    // Layouts replaced while the program was running, whose code can't be unloaded yet.
+    std::vector<LayoutGeneration> retiredLayouts;
+    // Layout modules waiting to be optimized, and the cold regions split out of the last one.
+    std::set<Module*> layoutModules;
+    size_t splitColdRegions = 0;
+
+    // Serializes every access to the ORC layers, which are not thread-safe.
+    std::recursive_mutex jitMutex;
+
 public:
 
     SurgeonJIT()
@@ -118,23 +423,43 @@ public:
 
             },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()),
+        TM(SelectTargetMachine()),
                 DL(TM->createDataLayout()),
+                objectCache(OptionsStore::GetOption("object_cache_dir"), *TM),
                 ObjectLayer(ES,
-                    [this](VModuleKey)
+                    [this](VModuleKey K)
                     {
                         return RTDyldObjectLinkingLayer::Resources{
-                            std::make_shared<JITMemoryManager>(), Resolver };
-                    }, std::ref(listener)),
-                CompileLayer(ObjectLayer, SimpleCompiler(*TM)),
+                            std::make_shared<JITMemoryManager>(), GetResolverForModule(K) };
+                    }, std::ref(listener),
+                    [this](VModuleKey K) { listener.NotifyFinalized(K); }),
+                CompileLayer(ObjectLayer, SimpleCompiler(*TM, &objectCache)),
                         OptimizeLayer(CompileLayer, [this](std::unique_ptr<Module> M)
                             {
                                 return optimizeModule(std::move(M));
                             }),
+                        CompileCallbackManager(createLocalCompileCallbackManager(TM->getTargetTriple(), ES, (JITTargetAddress)&SurgeonJIT::ReportLazyCompilationFailure)),
+                        LockedCallbackManager(*CompileCallbackManager, jitMutex),
+                        CODLayer(ES, OptimizeLayer,
+                            [this](VModuleKey K) { return GetResolverForModule(K); },
+                            [this](VModuleKey K, std::shared_ptr<SymbolResolver> R) { lazyResolvers[K] = std::move(R); },
+                            [](Function& F) { return std::set<Function*>({ &F }); },
+                            LockedCallbackManager,
+                            createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())),
                         overrides([this](const std::string& S) { return mangle(S); })
     {
         llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
         listener.RegisterInstrumentationMap(isInstrumented);
+        lazyCompilation = OptionsStore::GetOption("lazy_compilation") == "1";
+        LoadTieredCompilationOptions();
+        speculativeCompilation = OptionsStore::GetOption("speculative_compilation") == "1";
+        if (speculativeCompilation && lazyCompilation)
+        {
+            std::cout << "Speculative compilation cannot be used together with lazy compilation and will be disabled\n";
+            speculativeCompilation = false;
+        }
+        indirectCallProfiling = OptionsStore::GetOption("indirect_call_profiling") == "1";
+        osrEnabled = OptionsStore::GetOption("osr") == "1";
         CSITool checkpointTool{ "cp",
             OptionsStore::GetOptionOrError("checkpoint_tool_library"),
             OptionsStore::GetOptionOrError("checkpoint_tool_bitcode") };
@@ -143,6 +468,13 @@ public:
     }
 
                             ~SurgeonJIT() {
+                                stopTierUpThread = true;
+                                if (tierUpThread.joinable())
+                                    tierUpThread.join();
+                                StopSpeculativeCompilation();
+                                if (speculativeThread.joinable())
+                                    speculativeThread.join();
+
                                 // Run any registered destructor.
                                 overrides.runDestructors();
                             }
@@ -151,12 +483,43 @@ public:
 
                             VModuleKey addModule(std::unique_ptr<Module> M, bool enableCSI = false, bool addToDatabase = true, const std::vector<std::string>& tools = {});
 
+                            // Returns nullptr if the function can't be recompiled, e.g. because it is already in an instrumented tree.
                             void* RecompileFunction(const std::string& functionName, bool enableCSI, const std::vector<std::string>& tools);
+
+                            // Starts/stops precompiling instrumented variants in the background.
+                            // Does nothing unless speculative compilation is enabled.
+                            void StartSpeculativeCompilation();
+                            void StopSpeculativeCompilation();
+
+                            // Stops background compilation (speculation and tier-up) until ResumeBackgroundThreads,
+                            // e.g. while a checkpoint is active. Must not be called with jitMutex held; holdLock keeps
+                            // it locked by the calling thread until the resume, so that no other thread enters the JIT.
+                            void PauseBackgroundThreads(bool holdLock = false);
+                            void ResumeBackgroundThreads();
                             void CallCSIConstructorForModule(VModuleKey& key, bool mustExist = false);
 
+                            // Detaches the instrumentation installed at the given root: restores the original entry
+                            // of the function and unloads the instrumented code and the trampoline, releasing their memory.
+                            // If threads may still be running the instrumented code, unloadCode must be false:
+                            // the code is then kept until UnloadRetiredInstrumentation is called.
+                            bool RemoveInstrumentation(const std::string& functionName, bool unloadCode = true);
+                            // Unloads retired variants and the layouts replaced by OptimizeLayout, once no thread runs them.
+                            void UnloadRetiredInstrumentation();
+
+                            // Returns true if the function is part of the subtree of any installed instrumentation.
+                            bool IsFunctionInstrumented(const std::string& function) {
+                                std::lock_guard<std::recursive_mutex> lock(jitMutex);
+                                for (auto& variant : installedVariants) { if (IsFunctionInSubtree(function, variant.first)) return true; }
+                                return false;
+                            }
+                            bool IsInstrumentationRoot(const std::string& function) {
+                                std::lock_guard<std::recursive_mutex> lock(jitMutex);
+                                return installedVariants.find(function) != installedVariants.end();
+                            }
+
                             bool IsFunctionInSubtree(const std::string& function, const std::string& subtreeRoot) {
-                                auto tree = callGraph.GetNodeAndAllChildren(subtreeRoot);
-                                return tree.find(function) != tree.end();
+                                std::lock_guard<std::recursive_mutex> lock(jitMutex);
+                                return callGraph.IsReachable(subtreeRoot, function);
                             }
                             bool IsFunctionInAnySubtree(const std::string& function, const std::set<std::string>& subtreeRoots) {
                                 for (auto& subtreeRoot : subtreeRoots) { if (IsFunctionInSubtree(function, subtreeRoot)) return true; }
@@ -165,8 +528,26 @@ public:
 
                             JITSymbol findSymbol(const std::string Name, bool exportedOnly = true);
 
+                            // Finds the JIT'd function containing the address, for the profiler. Copies are reported
+                            // under the name of the original function, tagged with the kind of copy.
+                            bool SymbolizeAddress(uint64_t address, std::string& name);
+
+                            // Disassembles every emitted copy of a function: the original, its optimized tier, its laid out copy and its
+                            // instrumented copies in the installed variants.
+                            std::vector<DisassembledFunction> DisassembleFunction(const std::string& functionName);
+
                             void removeModule(VModuleKey K) {
-                                cantFail(OptimizeLayer.removeModule(K));
+                                std::lock_guard<std::recursive_mutex> lock(jitMutex);
+                                if (lazyModules.find(K) != lazyModules.end())
+                                    cantFail(CODLayer.removeModule(K));
+                                else
+                                    cantFail(OptimizeLayer.removeModule(K));
+                            }
+
+                            // Returns true if a definition of the symbol can be referenced from other modules,
+                            // either because it has already been emitted or because it has a lazy compilation stub.
+                            bool IsSymbolEmitted(const std::string& name) {
+                                return GetSizeForSymbol(name) > 0 || lazyFunctions.find(name) != lazyFunctions.end();
                             }
 
                             void preemptFunction(const std::string& functionName, const std::string& preempter);
@@ -180,17 +561,48 @@ public:
                             size_t GetSizeForSymbol(const std::string& name) { return listener.GetSizeForSymbol(name); }
                             size_t GetOveriddenSizeForSymbol(const std::string& name) { return listener.GetOveriddenSizeForSymbol(name); }
 
+                            // Emits the given program modules at the baseline tier and starts promoting hot functions.
+                            // Does nothing unless tiered compilation is enabled.
+                            void StartTieredCompilation(const std::vector<VModuleKey>& keys);
+                            bool IsTieredCompilationEnabled() { return tieredCompilation; }
+                            void PrintTiers();
+
+                            // Re-emits the hot functions of the last profile next to each other, in call-chain order and
+                            // without their cold blocks, and redirects the functions to these copies.
+                            bool OptimizeLayout();
+
+                            // Profile-guided optimization of the subtree of a function, in two steps. InstrumentForPGO
+                            // installs a variant with profile counters, which the interactive cycle enters like an
+                            // instrumented one; OptimizeWithProfile then recompiles the subtree at O3 with the profile
+                            // gathered so far and redirects the function to it. Counters and observed values are kept in
+                            // shared memory, so iterations that run from a built-in checkpoint are profiled too.
+                            void* InstrumentForPGO(const std::string& functionName);
+                            bool OptimizeWithProfile(const std::string& functionName);
+                            bool IsProfilingForPGO(const std::string& functionName) {
+                                std::lock_guard<std::recursive_mutex> lock(jitMutex);
+                                auto installed = installedVariants.find(functionName);
+                                return installed != installedVariants.end() && installed->second->pgo == PGOPhase::Generate;
+                            }
+
                             bool LoadCSITool(const CSITool& tool);
                             bool IsCSIToolRegistered(const std::string& toolName) { return csiTools.find(toolName) != csiTools.end(); }
 
 private:
     JITSymbol resolveSymbol(const std::string Name);
 
+    std::shared_ptr<SymbolResolver> GetResolverForModule(VModuleKey K) {
+        auto it = lazyResolvers.find(K);
+        return it != lazyResolvers.end() ? it->second : Resolver;
+    }
+
     std::unique_ptr<Module> optimizeModule(std::unique_ptr<Module> M);
+    std::vector<LoadedCSITool> GetCSITools(const std::vector<std::string>& tools);
+    std::vector<std::string> GetCSIToolBitcodeFiles(const std::vector<std::string>& tools);
 
     std::string mangle(StringRef Name);
 
-    std::string GenerateInstrumentationPrefix(const std::string& rootFunctionName);
+    // variantKey is empty for variants whose prefix must not be reused.
+    std::string GenerateInstrumentationPrefix(const std::string& rootFunctionName, const std::string& variantKey);
 
 
     std::unique_ptr<llvm::Module> LoadHelperModule(LLVMContext& context);
@@ -201,6 +613,52 @@ private:
 
     void LoadAndAddModule(const std::string& moduleName, bool enableCSI, const std::vector<std::string>& tools);
 
+    // Copies the given functions and the definitions they need into a new module.
+    std::unique_ptr<Module> ExtractFunctions(const Module& M, const std::set<std::string>& functionNames);
+    // With PGOPhase::Use, profiled is the variant instrumented by PGOPhase::Generate whose profile is used.
+    std::unique_ptr<InstrumentedVariant> PrepareInstrumentedVariant(const std::string& functionName, bool enableCSI, const std::vector<std::string>& tools,
+        PGOPhase pgo = PGOPhase::None, const InstrumentedVariant* profiled = nullptr);
+    void* InstallInstrumentedVariant(std::unique_ptr<InstrumentedVariant> variant);
+    void CompileRecompileJob(RecompileJob& job, bool enableCSI, const std::vector<LoadedCSITool>& tools,
+        const std::vector<std::string>& toolBitcodeFiles);
+    static std::string GetVariantKey(const std::string& rootFunction, bool enableCSI, const std::vector<std::string>& tools);
+
+    static TargetMachine* SelectTargetMachine();
+    void MarkFarDeclarations(Module& M);
+
+    void AssignIndirectCallSites(Module& M);
+    void InsertIndirectCallProfiling(Module& M);
+    void MergeIndirectCallProfile();
+    void PromoteIndirectCalls(Module& M, const std::vector<Function*>& functions, const std::set<std::string>& instrumentedFunctions,
+        const std::string& instrumentationPrefix);
+
+    // Writes the counters and values gathered by a PGO-instrumented variant as an indexed profile, for the
+    // functions of the variant with the given prefix. subtree is the set of functions it recompiles.
+    // Returns the number of functions that have run, or 0 if there is nothing to optimize with.
+    size_t WritePGOProfile(const InstrumentedVariant& profiled, const std::string& prefix, const std::set<std::string>& subtree,
+        const std::string& path);
+
+    static JITTargetAddress ReadStubTarget(JITTargetAddress stub);
+    void UnloadVariant(InstrumentedVariant& variant);
+    // Prints why the function can't be the root of a variant, if it can't.
+    bool CanBeInstrumentationRoot(const std::string& functionName);
+    // Called instead of a lazily compiled function that fails to compile.
+    static void ReportLazyCompilationFailure();
+    void ReleaseUnusedProfileValues();
+    // Sends calls back to the original code of a preempted function.
+    void RestoreFunction(const std::string& functionName);
+
+    // Finds the program function whose code, or a copy of it outside of instrumentation, contains the address.
+    bool FindProgramFunction(uint64_t address, std::string& name);
+    std::vector<std::string> ComputeFunctionLayout();
+    std::unique_ptr<Module> BuildLayoutModule(const std::vector<std::string>& layout, const std::string& prefix, LLVMContext& context);
+
+    void LoadTieredCompilationOptions();
+    void InsertTierUpChecks(Module& M);
+    void TierUpHotFunctions();
+    void StartTierUpThread();
+    void TierUpFunction(const std::string& functionName, TieredFunction& function);
+
     friend class ObjectListener;
 
 };
@@ -1,8 +1,17 @@
 
  #include "JITMemoryManager.h"
  #include "llvm/Config/config.h"
+ #include "llvm/Support/DynamicLibrary.h"
  #include "llvm/Support/MathExtras.h"
  #include "llvm/Support/Process.h"
+ #include "llvm/Support/raw_ostream.h"
+ #include "Options.h"
+ #include <cerrno>
+ #include <cstdlib>
+ #include <map>
+ #include <mutex>
+ #include <set>
+ #include <sys/mman.h>
  
  namespace llvm {
  
@@ -11,6 +20,10 @@
                                                     unsigned SectionID,
                                                     StringRef SectionName,
                                                     bool IsReadOnly) {
+   // Counters and value sites of PGO instrumentation.
+   if (SectionName == "__llvm_prf_cnts" || SectionName == "__llvm_prf_vals")
+     return allocateSection(JITMemoryManager::AllocationPurpose::SharedData,
+                            Size, Alignment);
    if (IsReadOnly)
      return allocateSection(JITMemoryManager::AllocationPurpose::ROData,
                             Size, Alignment);
@@ -22,6 +35,9 @@
                                                     unsigned Alignment,
                                                     unsigned SectionID,
                                                     StringRef SectionName) {
+   if (SectionName.startswith(".text.unlikely"))
+     return allocateSection(JITMemoryManager::AllocationPurpose::ColdCode,
+                            Size, Alignment);
    return allocateSection(JITMemoryManager::AllocationPurpose::Code, Size,
                           Alignment);
  }
@@ -41,10 +57,14 @@
      switch (Purpose) {
      case AllocationPurpose::Code:
        return CodeMem;
+     case AllocationPurpose::ColdCode:
+       return ColdCodeMem;
      case AllocationPurpose::ROData:
        return RODataMem;
      case AllocationPurpose::RWData:
        return RWDataMem;
+     case AllocationPurpose::SharedData:
+       return SharedDataMem;
      }
      llvm_unreachable("Unknown JITMemoryManager::AllocationPurpose");
    }();
@@ -130,13 +150,15 @@
    std::error_code ec;
  
    // Make code memory executable.
-   ec = applyMemoryGroupPermissions(CodeMem,
-                                    sys::Memory::MF_READ | sys::Memory::MF_EXEC | sys::Memory::MF_WRITE);
-   if (ec) {
-     if (ErrMsg) {
-       *ErrMsg = ec.message();
+   for (MemoryGroup *Group : {&CodeMem, &ColdCodeMem}) {
+     ec = applyMemoryGroupPermissions(*Group,
+                                      sys::Memory::MF_READ | sys::Memory::MF_EXEC | sys::Memory::MF_WRITE);
+     if (ec) {
+       if (ErrMsg) {
+         *ErrMsg = ec.message();
+       }
+       return true;
      }
-     return true;
    }
  
    // Make read-only data memory read-only.
@@ -206,12 +228,15 @@
  }
  
  void JITMemoryManager::invalidateInstructionCache() {
-   for (sys::MemoryBlock &Block : CodeMem.PendingMem)
-     sys::Memory::InvalidateInstructionCache(Block.base(), Block.size());
+   for (MemoryGroup *Group : {&CodeMem, &ColdCodeMem}) {
+     for (sys::MemoryBlock &Block : Group->PendingMem)
+       sys::Memory::InvalidateInstructionCache(Block.base(), Block.size());
+   }
  }
  
  JITMemoryManager::~JITMemoryManager() {
-   for (MemoryGroup *Group : {&CodeMem, &RWDataMem, &RODataMem}) {
+   for (MemoryGroup *Group :
+        {&CodeMem, &ColdCodeMem, &RWDataMem, &RODataMem, &SharedDataMem}) {
      for (sys::MemoryBlock &Block : Group->AllocatedMem)
        MMapper.releaseMappedMemory(Block);
    }
@@ -234,6 +259,16 @@
      // to page size to get extra space for free.
      static const size_t PageSize = sys::Process::getPageSize();
      size_t ReqBytes = (NumBytes + PageSize - 1) & ~(PageSize - 1);
+     if (Purpose == JITMemoryManager::AllocationPurpose::SharedData) {
+       void *Pages = mmap(nullptr, ReqBytes, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+       if (Pages == MAP_FAILED) {
+         EC = std::error_code(errno, std::generic_category());
+         return sys::MemoryBlock();
+       }
+       EC = std::error_code();
+       return sys::MemoryBlock(Pages, ReqBytes);
+     }
      return sys::Memory::allocateMappedMemory(ReqBytes, NearBlock, Flags, EC);
    }
  
@@ -248,9 +283,416 @@
  };
  
  DefaultMMapper DefaultMMapperInstance;
+ 
+ // Implementation of JITMemoryManager::MemoryMapper that packs the sections of
+ // every module into large chunks of memory, one set of chunks per purpose, and
+ // reuses the memory of the modules that are removed. Cold code has chunks of its
+ // own, so it never sits between hot functions.
+ //
+ // Free memory is kept in segregated bins by size class (powers of two pages),
+ // so allocations take the smallest fitting block of the first non-empty bin
+ // instead of scanning every block. Blocks are coalesced with their free
+ // neighbours when they are released, and chunks that become completely free
+ // are returned to the system, except for one per purpose, kept for the next
+ // module.
+ //
+ // With the "huge_pages" option, chunks are 2MB-aligned and backed by
+ // MAP_HUGETLB pages ("hugetlb") if available, or by transparent huge pages
+ // ("thp", madvise(MADV_HUGEPAGE)), to reduce iTLB misses. If neither can be
+ // used, chunks fall back to normal pages. Huge pages can't have different
+ // protections within them, so huge chunks are mapped with the permissions
+ // their sections end up with (code is read-write-execute, as finalizeMemory
+ // leaves it) and protection requests inside them are ignored. Snapshots (see
+ // Snapshot.h) don't restore hugetlb chunks.
+ //
+ // With the "jit_region_mb" option, a single range of that size is reserved up
+ // front, close to the CSI runtime (the tool libraries are loaded next to it),
+ // and every chunk is carved from it. Code and data of all the modules are then
+ // within 2GB of each other, and the JIT compiles them for the small code
+ // model. Chunks of the range are never unmapped: their pages are given back to
+ // the system instead.
+ //
+ // Shared data has chunks of its own, which are shared mappings with normal
+ // pages.
+ class PooledMapper final : public JITMemoryManager::MemoryMapper {
+ public:
+   enum class PageKind { Normal, Transparent, HugeTLB };
+ 
+   PooledMapper(PageKind Kind, size_t RegionSize) : Kind(Kind) {
+     if (RegionSize)
+       reserveRegion(RegionSize);
+   }
+ 
+   sys::MemoryBlock
+   allocateMappedMemory(JITMemoryManager::AllocationPurpose Purpose,
+                        size_t NumBytes, const sys::MemoryBlock *const NearBlock,
+                        unsigned Flags, std::error_code &EC) override {
+     static const size_t PageSize = sys::Process::getPageSize();
+     size_t ReqBytes = alignTo(NumBytes, PageSize);
+ 
+     std::lock_guard<std::mutex> Lock(Mutex);
+     Pool &P = Pools[(int)Purpose];
+     uintptr_t Start = takeFreeBlock(P, ReqBytes);
+     if (!Start) {
+       if (!reserveChunk(P, Purpose, ReqBytes, EC))
+         return sys::MemoryBlock();
+       Start = takeFreeBlock(P, ReqBytes);
+     }
+ 
+     auto Owner = findChunk(Start);
+     Owner->second.Used += ReqBytes;
+     Allocated[Start] = ReqBytes;
+ 
+     // The block may have been left with the permissions of a removed module.
+     sys::MemoryBlock Block((void *)Start, ReqBytes);
+     if (!Owner->second.Huge)
+       EC = sys::Memory::protectMappedMemory(Block, Flags);
+     return Block;
+   }
+ 
+   std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                       unsigned Flags) override {
+     if (isInHugeChunk((uintptr_t)Block.base()))
+       return std::error_code();
+     return sys::Memory::protectMappedMemory(Block, Flags);
+   }
+ 
+   std::error_code releaseMappedMemory(sys::MemoryBlock &M) override {
+     std::lock_guard<std::mutex> Lock(Mutex);
+     uintptr_t Start = (uintptr_t)M.base();
+     auto Allocation = Allocated.find(Start);
+     if (Allocation == Allocated.end())
+       return std::make_error_code(std::errc::invalid_argument);
+     size_t Size = Allocation->second;
+     Allocated.erase(Allocation);
+ 
+     auto Owner = findChunk(Start);
+     Pool &P = *Owner->second.Owner;
+     Owner->second.Used -= Size;
+ 
+     // Coalesce with the free neighbours in the same chunk.
+     auto Next = P.FreeByAddress.lower_bound(Start);
+     if (Next != P.FreeByAddress.end() && Next->first == Start + Size &&
+         findChunk(Next->first) == Owner) {
+       Size += Next->second;
+       removeFreeBlock(P, Next->first);
+     }
+     auto Previous = P.FreeByAddress.lower_bound(Start);
+     if (Previous != P.FreeByAddress.begin()) {
+       --Previous;
+       if (Previous->first + Previous->second == Start &&
+           findChunk(Previous->first) == Owner) {
+         Start = Previous->first;
+         Size += Previous->second;
+         removeFreeBlock(P, Start);
+       }
+     }
+     addFreeBlock(P, Start, Size);
+ 
+     if (Owner->second.Used == 0)
+       releaseChunk(P, Owner);
+ 
+     M = sys::MemoryBlock();
+     return std::error_code();
+   }
+ 
+   bool isInHugeChunk(uintptr_t Address) {
+     std::lock_guard<std::mutex> Lock(Mutex);
+     auto Owner = findChunk(Address);
+     return Owner != Chunks.end() && Owner->second.Huge;
+   }
+ 
+   bool hasRegion() const { return RegionSize != 0; }
+ 
+   bool isReachableFromRegion(uintptr_t Address) const {
+     // Displacements are relative to the end of the instruction, which may be
+     // anywhere in the range: check from both of its ends.
+     int64_t FromStart = (int64_t)(Address - RegionStart);
+     int64_t FromEnd = (int64_t)(Address - (RegionStart + RegionSize));
+     return FromStart >= INT32_MIN && FromStart <= INT32_MAX &&
+            FromEnd >= INT32_MIN && FromEnd <= INT32_MAX;
+   }
+ 
+ private:
+   static const size_t ChunkSize = 2 * 1024 * 1024;
+   static const unsigned NumSizeClasses = 32;
+   static const size_t MaxRegionSize = 1024 * 1024 * 1024;
+ 
+   struct Pool {
+     // Start -> size of every free block.
+     std::map<uintptr_t, size_t> FreeByAddress;
+     // (size, start) of the free blocks, by size class.
+     std::set<std::pair<size_t, uintptr_t>> Bins[NumSizeClasses];
+     // A completely free chunk kept for the next allocation, if any.
+     uintptr_t SpareChunk = 0;
+   };
+ 
+   struct Chunk {
+     size_t Size;
+     // Bytes handed out to modules.
+     size_t Used;
+     bool Huge;
+     Pool *Owner;
+   };
+ 
+   static unsigned getSizeClass(size_t Size) {
+     static const size_t PageSize = sys::Process::getPageSize();
+     unsigned Class = Log2_64(Size / PageSize);
+     return Class < NumSizeClasses ? Class : NumSizeClasses - 1;
+   }
+ 
+   void addFreeBlock(Pool &P, uintptr_t Start, size_t Size) {
+     P.FreeByAddress[Start] = Size;
+     P.Bins[getSizeClass(Size)].insert(std::make_pair(Size, Start));
+   }
+ 
+   void removeFreeBlock(Pool &P, uintptr_t Start) {
+     auto It = P.FreeByAddress.find(Start);
+     P.Bins[getSizeClass(It->second)].erase(std::make_pair(It->second, Start));
+     P.FreeByAddress.erase(It);
+   }
+ 
+   // Best fit within the first size class that has a large enough block.
+   uintptr_t takeFreeBlock(Pool &P, size_t Size) {
+     for (unsigned Class = getSizeClass(Size); Class < NumSizeClasses; ++Class) {
+       auto It = P.Bins[Class].lower_bound(std::make_pair(Size, (uintptr_t)0));
+       if (It == P.Bins[Class].end())
+         continue;
+ 
+       uintptr_t Start = It->second;
+       size_t Remaining = It->first - Size;
+       removeFreeBlock(P, Start);
+       if (Remaining > 0)
+         addFreeBlock(P, Start + Size, Remaining);
+       if (findChunk(Start)->first == P.SpareChunk)
+         P.SpareChunk = 0;
+       return Start;
+     }
+     return 0;
+   }
+ 
+   bool reserveChunk(Pool &P, JITMemoryManager::AllocationPurpose Purpose,
+                     size_t MinSize, std::error_code &EC) {
+     size_t Size = alignTo(MinSize, ChunkSize);
+     void *Address = nullptr;
+     if (hasRegion()) {
+       // Code compiled for the small code model can't reach memory outside
+       // of the range.
+       if (RegionNext + Size > RegionStart + RegionSize) {
+         errs() << "The JIT region is full: increase jit_region_mb\n";
+         EC = std::make_error_code(std::errc::not_enough_memory);
+         return false;
+       }
+       Address = (void *)RegionNext;
+     }
+ 
+     bool Shared = Purpose == JITMemoryManager::AllocationPurpose::SharedData;
+     bool Huge = false;
+     void *Start = nullptr;
+     if (Kind != PageKind::Normal && !Shared) {
+       Start = reserveHugeChunk(Address, Size, getHugeProtection(Purpose));
+       Huge = Start != nullptr;
+     }
+     if (!Start) {
+       Start = mapPages(Address, Size, PROT_READ | PROT_WRITE,
+                        Shared ? MAP_SHARED : MAP_PRIVATE);
+       if (!Start) {
+         EC = std::error_code(errno, std::generic_category());
+         return false;
+       }
+     }
+ 
+     if (Address)
+       RegionNext += Size;
+     Chunks[(uintptr_t)Start] = Chunk{Size, 0, Huge, &P};
+     addFreeBlock(P, (uintptr_t)Start, Size);
+     return true;
+   }
+ 
+   void releaseChunk(Pool &P, std::map<uintptr_t, Chunk>::iterator Owner) {
+     if (!P.SpareChunk) {
+       P.SpareChunk = Owner->first;
+       return;
+     }
+     if (hasRegion()) {
+       // The chunk stays free in the pool, without backing pages. Pages of
+       // shared memory are only freed by MADV_REMOVE.
+       bool Shared =
+           &P == &Pools[(int)JITMemoryManager::AllocationPurpose::SharedData];
+       madvise((void *)Owner->first, Owner->second.Size,
+               Shared ? MADV_REMOVE : MADV_DONTNEED);
+       return;
+     }
+     removeFreeBlock(P, Owner->first);
+     munmap((void *)Owner->first, Owner->second.Size);
+     Chunks.erase(Owner);
+   }
+ 
+   static int getHugeProtection(JITMemoryManager::AllocationPurpose Purpose) {
+     if (Purpose == JITMemoryManager::AllocationPurpose::Code ||
+         Purpose == JITMemoryManager::AllocationPurpose::ColdCode)
+       return PROT_READ | PROT_WRITE | PROT_EXEC;
+     // Read-only data is written by relocations, and can't be made read-only
+     // without splitting the huge pages.
+     return PROT_READ | PROT_WRITE;
+   }
+ 
+   // Maps pages at Address, which is in the region, or anywhere if it's null.
+   // Flags include MAP_PRIVATE or MAP_SHARED.
+   static void *mapPages(void *Address, size_t Size, int Protection,
+                         int Flags) {
+     Flags |= MAP_ANONYMOUS;
+     if (Address)
+       Flags |= MAP_FIXED;
+     void *Pages = mmap(Address, Size, Protection, Flags, -1, 0);
+     return Pages == MAP_FAILED ? nullptr : Pages;
+   }
+ 
+   // Address is 2MB-aligned, if not null.
+   void *reserveHugeChunk(void *Address, size_t Size, int Protection) {
+     if (Kind == PageKind::HugeTLB) {
+       void *Pages =
+           mapPages(Address, Size, Protection, MAP_PRIVATE | MAP_HUGETLB);
+       if (Pages)
+         return Pages;
+       // No huge pages are reserved: don't try again.
+       Kind = PageKind::Transparent;
+     }
+ 
+     uintptr_t Start = (uintptr_t)Address;
+     if (Address) {
+       if (!mapPages(Address, Size, Protection, MAP_PRIVATE))
+         return nullptr;
+     } else {
+       // Aligned by over-allocating and trimming both ends.
+       size_t MappedSize = Size + ChunkSize;
+       void *Mapped = mapPages(nullptr, MappedSize, Protection, MAP_PRIVATE);
+       if (!Mapped)
+         return nullptr;
+       Start = alignTo((uintptr_t)Mapped, ChunkSize);
+       if (Start > (uintptr_t)Mapped)
+         munmap(Mapped, Start - (uintptr_t)Mapped);
+       munmap((void *)(Start + Size),
+              (uintptr_t)Mapped + MappedSize - Start - Size);
+     }
+ 
+     if (madvise((void *)Start, Size, MADV_HUGEPAGE) != 0) {
+       // Transparent huge pages are not available: use normal pages. In the
+       // region, the caller maps them over this chunk.
+       if (!Address)
+         munmap((void *)Start, Size);
+       Kind = PageKind::Normal;
+       return nullptr;
+     }
+     return (void *)Start;
+   }
+ 
+   // Reserves the range without backing it, 2MB-aligned and as close as
+   // possible below the CSI runtime (or the C library, if it isn't loaded).
+   // Without a suitable range, chunks are allocated anywhere.
+   void reserveRegion(size_t Size) {
+     Size = alignTo(Size < MaxRegionSize ? Size : MaxRegionSize, ChunkSize);
+     uintptr_t Anchor = (uintptr_t)sys::DynamicLibrary::SearchForAddressOfSymbol(
+         "__csirt_unit_init");
+     if (!Anchor)
+       Anchor = (uintptr_t)&mmap;
+ 
+     // Other libraries may already be mapped below the anchor: move down until
+     // the kernel accepts the hint.
+     static const size_t Step = 64 * 1024 * 1024;
+     size_t MappedSize = Size + ChunkSize;
+     for (size_t Distance = 0; Distance < MaxRegionSize; Distance += Step) {
+       if (Anchor < MappedSize + Distance)
+         break;
+       uintptr_t Hint = Anchor - MappedSize - Distance;
+       void *Mapped =
+           mmap((void *)(Hint & ~(uintptr_t)(ChunkSize - 1)), MappedSize,
+                PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+       if (Mapped == MAP_FAILED)
+         break;
+ 
+       uintptr_t Start = alignTo((uintptr_t)Mapped, ChunkSize);
+       if (Start > (uintptr_t)Mapped)
+         munmap(Mapped, Start - (uintptr_t)Mapped);
+       munmap((void *)(Start + Size),
+              (uintptr_t)Mapped + MappedSize - Start - Size);
+ 
+       RegionStart = RegionNext = Start;
+       RegionSize = Size;
+       if (isReachableFromRegion(Anchor))
+         return;
+       munmap((void *)Start, Size);
+       RegionStart = RegionNext = RegionSize = 0;
+     }
+     errs() << "Cannot reserve the JIT region near the runtime libraries\n";
+   }
+ 
+   std::map<uintptr_t, Chunk>::iterator findChunk(uintptr_t Address) {
+     auto It = Chunks.upper_bound(Address);
+     if (It == Chunks.begin())
+       return Chunks.end();
+     --It;
+     return Address < It->first + It->second.Size ? It : Chunks.end();
+   }
+ 
+   std::mutex Mutex;
+   PageKind Kind;
+   Pool Pools[5];
+   // Start -> chunk.
+   std::map<uintptr_t, Chunk> Chunks;
+   // Start -> size of every block handed out.
+   std::map<uintptr_t, size_t> Allocated;
+   // The reserved range, if any. Chunks are carved from it in order.
+   uintptr_t RegionStart = 0;
+   size_t RegionSize = 0;
+   uintptr_t RegionNext = 0;
+ };
+ 
+ // Memory is pooled unless the "jit_memory_pool" option is 0 and there is no
+ // "jit_region_mb" option. The "huge_pages" option selects the kind of pages:
+ // "thp" or "hugetlb" (falling back to "thp").
+ JITMemoryManager::MemoryMapper &getDefaultMapper() {
+   static JITMemoryManager::MemoryMapper *Mapper =
+       []() -> JITMemoryManager::MemoryMapper * {
+     // Invalid sizes are ignored, like a missing option.
+     long RegionMB = std::atol(OptionsStore::GetOption("jit_region_mb").c_str());
+     size_t RegionSize = RegionMB > 0 ? (size_t)RegionMB * 1024 * 1024 : 0;
+     std::string HugePages = OptionsStore::GetOption("huge_pages");
+     if (HugePages == "thp")
+       return new PooledMapper(PooledMapper::PageKind::Transparent, RegionSize);
+     if (HugePages == "hugetlb")
+       return new PooledMapper(PooledMapper::PageKind::HugeTLB, RegionSize);
+     if (OptionsStore::GetOption("jit_memory_pool") == "0" && !RegionSize)
+       return &DefaultMMapperInstance;
+     return new PooledMapper(PooledMapper::PageKind::Normal, RegionSize);
+   }();
+   return *Mapper;
+ }
+ 
+ PooledMapper *getPooledMapper() {
+   JITMemoryManager::MemoryMapper &Mapper = getDefaultMapper();
+   if (&Mapper == &DefaultMMapperInstance)
+     return nullptr;
+   return static_cast<PooledMapper *>(&Mapper);
+ }
  } // namespace
  
+ bool JITMemoryManager::isInHugePageRegion(uintptr_t Address) {
+   PooledMapper *Mapper = getPooledMapper();
+   return Mapper && Mapper->isInHugeChunk(Address);
+ }
+ 
+ bool JITMemoryManager::hasNearRegion() {
+   PooledMapper *Mapper = getPooledMapper();
+   return Mapper && Mapper->hasRegion();
+ }
+ 
+ bool JITMemoryManager::isReachableFromRegion(uintptr_t Address) {
+   PooledMapper *Mapper = getPooledMapper();
+   return Mapper && Mapper->hasRegion() && Mapper->isReachableFromRegion(Address);
+ }
+ 
  JITMemoryManager::JITMemoryManager(MemoryMapper *MM)
-     : MMapper(MM ? *MM : DefaultMMapperInstance) {}
+     : MMapper(MM ? *MM : getDefaultMapper()) {}
  
  } // namespace llvm
\ No newline at end of file
@@ -1,3 +1,4 @@
+#pragma once
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
@@ -29,6 +30,11 @@ namespace llvm {
             Code,
             ROData,
             RWData,
+            /// Code in ".text.unlikely" sections, kept apart from the rest.
+            ColdCode,
+            /// Profile counters, in memory shared with forked children and never
+            /// tracked by snapshots, so that what runs from a checkpoint is counted.
+            SharedData,
         };
 
         /// Implementations of this interface are used by JITMemoryManager to
@@ -125,6 +131,21 @@ namespace llvm {
         /// \returns true if an error occurred, false otherwise.
         bool finalizeMemory(std::string *ErrMsg = nullptr) override;
 
+        /// Returns true if the address is in a region of huge pages shared by all
+        /// the instances (see the "huge_pages" option). Protections can't be
+        /// changed in these regions: they always have their final permissions.
+        static bool isInHugePageRegion(uintptr_t Address);
+
+        /// Returns true if the sections of every instance are allocated from a
+        /// single range reserved near the runtime libraries (see the
+        /// "jit_region_mb" option), so that code can be compiled for the small
+        /// code model.
+        static bool hasNearRegion();
+
+        /// Returns true if \p Address can be reached with a 32-bit displacement
+        /// from anywhere in that range.
+        static bool isReachableFromRegion(uintptr_t Address);
+
         /// Invalidate instruction cache for code sections.
         ///
         /// Some platforms with separate data cache and instruction cache require
@@ -168,8 +189,10 @@ namespace llvm {
         void anchor() override;
 
         MemoryGroup CodeMem;
+        MemoryGroup ColdCodeMem;
         MemoryGroup RWDataMem;
         MemoryGroup RODataMem;
+        MemoryGroup SharedDataMem;
         MemoryMapper &MMapper;
     };
 
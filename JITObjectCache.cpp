@@ -0,0 +1,125 @@
+#include "JITObjectCache.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+JITObjectCache::JITObjectCache(const std::string& cacheDirectory, const TargetMachine& TM) :
+    directory(cacheDirectory)
+{
+    if (!IsEnabled())
+        return;
+
+    if (auto EC = sys::fs::create_directories(directory))
+    {
+        llvm::errs() << "Cannot create object cache directory " << directory << ": " << EC.message() << "\n";
+        directory.clear();
+        return;
+    }
+
+    raw_string_ostream config(targetConfiguration);
+    config << LLVM_VERSION_STRING << ";" << TM.getTargetTriple().str() << ";" << TM.getTargetCPU() << ";"
+        << TM.getTargetFeatureString() << ";" << (int)TM.getCodeModel() << ";" << (int)TM.getRelocationModel();
+    config.flush();
+}
+
+bool JITObjectCache::PrepareModule(const Module& M, unsigned optLevel, const std::vector<std::string>& toolBitcodeFiles) {
+    if (!IsEnabled())
+        return false;
+
+    std::string key = ComputeKey(M, optLevel, toolBitcodeFiles);
+    // The object is loaded now: if it were only checked for, it could disappear before the
+    // compiler asks for it, and the module, which isn't optimized, would be compiled and cached
+    // under the key of the optimized one.
+    auto buffer = MemoryBuffer::getFile(GetPathForKey(key), -1, false);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    moduleKeys[&M] = key;
+    if (!buffer)
+        return false;
+
+    cachedObjects[&M] = std::move(buffer.get());
+    return true;
+}
+
+void JITObjectCache::notifyObjectCompiled(const Module* M, MemoryBufferRef Obj) {
+    std::string key;
+    if (!TakeKeyForModule(M, key))
+        return;
+
+    // Write to a temporary file first, so that concurrent sessions never see a partial object.
+    SmallString<128> tempPath;
+    int fd;
+    if (sys::fs::createUniqueFile(GetPathForKey(key) + ".tmp%%%%%%", fd, tempPath))
+        return;
+
+    {
+        raw_fd_ostream out(fd, true);
+        out << Obj.getBuffer();
+    }
+
+    if (sys::fs::rename(tempPath, GetPathForKey(key)))
+        sys::fs::remove(tempPath);
+}
+
+std::unique_ptr<MemoryBuffer> JITObjectCache::getObject(const Module* M) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cachedObjects.find(M);
+    if (it == cachedObjects.end())
+        return nullptr;
+
+    // The module will not be compiled, so its key is no longer needed.
+    auto buffer = std::move(it->second);
+    cachedObjects.erase(it);
+    moduleKeys.erase(M);
+    return buffer;
+}
+
+std::string JITObjectCache::ComputeKey(const Module& M, unsigned optLevel, const std::vector<std::string>& toolBitcodeFiles) {
+    SmallVector<char, 0> bitcode;
+    raw_svector_ostream bitcodeStream(bitcode);
+    WriteBitcodeToFile(M, bitcodeStream);
+
+    MD5 hash;
+    hash.update(targetConfiguration);
+    hash.update(";O" + std::to_string(optLevel));
+    hash.update(StringRef(bitcode.data(), bitcode.size()));
+    for (auto& toolBitcode : toolBitcodeFiles)
+        hash.update(GetFileHash(toolBitcode));
+
+    MD5::MD5Result result;
+    hash.final(result);
+    return result.digest().str();
+}
+
+std::string JITObjectCache::GetFileHash(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = fileHashes.find(filename);
+    if (it != fileHashes.end())
+        return it->second;
+
+    MD5 hash;
+    hash.update(filename);
+    if (auto buffer = MemoryBuffer::getFile(filename))
+        hash.update(buffer.get()->getBuffer());
+
+    MD5::MD5Result result;
+    hash.final(result);
+    return fileHashes[filename] = result.digest().str();
+}
+
+bool JITObjectCache::TakeKeyForModule(const Module* M, std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = moduleKeys.find(M);
+    if (it == moduleKeys.end())
+        return false;
+
+    key = it->second;
+    moduleKeys.erase(it);
+    return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// On-disk cache of the objects produced by the JIT, shared across Surgeon sessions.
+//
+// Objects are keyed by a hash of the IR handed to the optimizer (which covers the
+// source code and the compilation arguments), the configuration of the target machine
+// and, for instrumented modules, the set of CSI tools they are instrumented with.
+// A module must be registered through PrepareModule before it reaches the compiler;
+// if an object is already available, the module doesn't need to be optimized at all.
+class JITObjectCache : public llvm::ObjectCache {
+public:
+    JITObjectCache(const std::string& cacheDirectory, const llvm::TargetMachine& TM);
+
+    bool IsEnabled() const { return !directory.empty(); }
+
+    // Computes the key for the module and returns true if an object for it is cached. The object
+    // is loaded, and held until the compiler asks for it.
+    bool PrepareModule(const llvm::Module& M, unsigned optLevel, const std::vector<std::string>& toolBitcodeFiles = {});
+
+    void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override;
+
+private:
+    std::string ComputeKey(const llvm::Module& M, unsigned optLevel, const std::vector<std::string>& toolBitcodeFiles);
+    std::string GetFileHash(const std::string& filename);
+    std::string GetPathForKey(const std::string& key) { return directory + "/" + key + ".o"; }
+    bool TakeKeyForModule(const llvm::Module* M, std::string& key);
+
+    std::string directory;
+    std::string targetConfiguration;
+
+    std::mutex mutex;
+    std::unordered_map<const llvm::Module*, std::string> moduleKeys;
+    std::unordered_map<const llvm::Module*, std::unique_ptr<llvm::MemoryBuffer>> cachedObjects;
+    std::unordered_map<std::string, std::string> fileHashes;
+};
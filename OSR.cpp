@@ -0,0 +1,322 @@
+#include "OSR.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include <set>
+
+using namespace llvm;
+
+// A loop header where a running frame can leave the function.
+struct TransitionPoint {
+    BasicBlock* header = nullptr;
+    bool supported = true;
+    // Blocks that can run after the transition.
+    std::set<BasicBlock*> region;
+    // Values live at the beginning of the header (after its phis), in a deterministic order.
+    std::vector<Value*> liveValues;
+    // Promotable allocas are passed by value, so that the continuation can keep them in registers.
+    // Everything else in the frame is accessed through pointers, since the frame stays alive
+    // until the continuation returns.
+    std::vector<bool> passByValue;
+};
+
+std::string GetOSRFlagName(const std::string& functionName, size_t loopIndex) {
+    return "__surgeon_osr_" + functionName + "_" + std::to_string(loopIndex);
+}
+
+static bool CanHaveTransitionPoints(Function& F) {
+    return !F.isDeclaration() && !F.hasLocalLinkage() && !F.hasAvailableExternallyLinkage() &&
+        !F.isVarArg() && F.hasName();
+}
+
+static std::vector<TransitionPoint> FindTransitionPoints(Function& F) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+
+    std::vector<TransitionPoint> points;
+    for (BasicBlock& header : F)
+    {
+        if (!LI.isLoopHeader(&header))
+            continue;
+
+        points.emplace_back();
+        TransitionPoint& point = points.back();
+        point.header = &header;
+
+        std::vector<BasicBlock*> worklist{ &header };
+        point.region.insert(&header);
+        while (!worklist.empty())
+        {
+            BasicBlock* block = worklist.back();
+            worklist.pop_back();
+            for (BasicBlock* successor : successors(block))
+            {
+                if (point.region.insert(successor).second)
+                    worklist.push_back(successor);
+            }
+        }
+
+        std::set<Value*> seen;
+        auto addLiveValue = [&](Value* value)
+        {
+            if (seen.insert(value).second)
+                point.liveValues.push_back(value);
+        };
+
+        // A value used after the transition is live if it is computed before it: arguments,
+        // values defined outside the region and values defined in outer loops.
+        auto visitOperand = [&](Value* operand)
+        {
+            if (isa<Argument>(operand))
+            {
+                addLiveValue(operand);
+            }
+            else if (Instruction* definition = dyn_cast<Instruction>(operand))
+            {
+                BasicBlock* block = definition->getParent();
+                if (point.region.find(block) == point.region.end() ||
+                    (block != &header && DT.dominates(block, &header)))
+                    addLiveValue(definition);
+            }
+        };
+
+        for (PHINode& phi : header.phis())
+            addLiveValue(&phi);
+
+        for (BasicBlock& block : F)
+        {
+            if (point.region.find(&block) == point.region.end())
+                continue;
+
+            for (Instruction& inst : block)
+            {
+                if (CallInst* call = dyn_cast<CallInst>(&inst))
+                {
+                    if (call->isMustTailCall())
+                        point.supported = false;
+                }
+
+                if (PHINode* phi = dyn_cast<PHINode>(&inst))
+                {
+                    // Edges from outside the region are never taken after the transition.
+                    for (unsigned i = 0; i < phi->getNumIncomingValues(); ++i)
+                    {
+                        if (point.region.find(phi->getIncomingBlock(i)) != point.region.end())
+                            visitOperand(phi->getIncomingValue(i));
+                    }
+                }
+                else
+                {
+                    for (Value* operand : inst.operands())
+                        visitOperand(operand);
+                }
+            }
+        }
+
+        for (Value* value : point.liveValues)
+        {
+            if (!value->getType()->isFirstClassType() || value->getType()->isTokenTy())
+                point.supported = false;
+
+            AllocaInst* alloca = dyn_cast<AllocaInst>(value);
+            point.passByValue.push_back(alloca && alloca->isStaticAlloca() &&
+                point.region.find(alloca->getParent()) == point.region.end() && isAllocaPromotable(alloca));
+        }
+    }
+
+    return points;
+}
+
+static FunctionType* GetContinuationType(Function& F, const TransitionPoint& point) {
+    std::vector<Type*> params;
+    for (size_t i = 0; i < point.liveValues.size(); ++i)
+    {
+        if (point.passByValue[i])
+            params.push_back(cast<AllocaInst>(point.liveValues[i])->getAllocatedType());
+        else
+            params.push_back(point.liveValues[i]->getType());
+    }
+
+    return FunctionType::get(F.getReturnType(), params, false);
+}
+
+static void InsertTransitionPoints(Function& F) {
+    // Live values have to be computed before the function is changed.
+    auto points = FindTransitionPoints(F);
+
+    Module& M = *F.getParent();
+    auto& context = F.getContext();
+    Type* int64Type = Type::getInt64Ty(context);
+    std::string name = F.getName();
+
+    for (size_t index = 0; index < points.size(); ++index)
+    {
+        TransitionPoint& point = points[index];
+        if (!point.supported)
+            continue;
+
+        // The flag follows the linkage of the function, like the tier-up counters.
+        GlobalValue::LinkageTypes linkage = F.hasExternalLinkage() ? GlobalValue::LinkageTypes::ExternalLinkage : F.getLinkage();
+        GlobalVariable* flag = new GlobalVariable(M, int64Type, false, linkage,
+            ConstantInt::get(int64Type, 0), GetOSRFlagName(name, index));
+        if (F.hasComdat())
+            flag->setComdat(F.getComdat());
+
+        BasicBlock* header = point.header;
+        BasicBlock* resume = header->splitBasicBlock(header->getFirstNonPHI(), "osr.resume");
+        BasicBlock* transition = BasicBlock::Create(context, "osr.transition", &F, resume);
+        header->getTerminator()->eraseFromParent();
+
+        IRBuilder<> builder(header);
+        LoadInst* continuation = builder.CreateLoad(flag, "osr.continuation");
+        continuation->setAtomic(AtomicOrdering::Acquire);
+        continuation->setAlignment(8);
+        MDBuilder mdBuilder(context);
+        builder.CreateCondBr(builder.CreateICmpNE(continuation, ConstantInt::get(int64Type, 0)), transition, resume,
+            mdBuilder.createBranchWeights(1, 1 << 20));
+
+        builder.SetInsertPoint(transition);
+        std::vector<Value*> args;
+        for (size_t i = 0; i < point.liveValues.size(); ++i)
+        {
+            if (point.passByValue[i])
+                args.push_back(builder.CreateLoad(point.liveValues[i]));
+            else
+                args.push_back(point.liveValues[i]);
+        }
+
+        FunctionType* continuationType = GetContinuationType(F, point);
+        CallInst* call = builder.CreateCall(builder.CreateIntToPtr(continuation, continuationType->getPointerTo()), args);
+        if (F.getReturnType()->isVoidTy())
+            builder.CreateRetVoid();
+        else
+            builder.CreateRet(call);
+    }
+}
+
+void InsertOSRTransitionPoints(Module& M) {
+    for (Function& function : M)
+    {
+        if (CanHaveTransitionPoints(function))
+            InsertTransitionPoints(function);
+    }
+}
+
+static Function* BuildContinuation(Function& F, TransitionPoint& point, const std::string& name) {
+    Module& M = *F.getParent();
+    auto& context = F.getContext();
+
+    Function* continuation = Function::Create(GetContinuationType(F, point), GlobalValue::LinkageTypes::ExternalLinkage, name, &M);
+
+    // Live arguments become arguments of the continuation; the others are never used.
+    ValueToValueMapTy vMap;
+    std::vector<Value*> newArgs;
+    for (Argument& arg : continuation->args())
+        newArgs.push_back(&arg);
+    for (Argument& arg : F.args())
+        vMap[&arg] = UndefValue::get(arg.getType());
+    for (size_t i = 0; i < point.liveValues.size(); ++i)
+    {
+        if (isa<Argument>(point.liveValues[i]))
+            vMap[point.liveValues[i]] = newArgs[i];
+    }
+
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(continuation, &F, vMap, false, returns);
+    // The debug info of the function can't be shared.
+    stripDebugInfo(*continuation);
+
+    std::set<BasicBlock*> region;
+    for (BasicBlock* block : point.region)
+        region.insert(cast<BasicBlock>(vMap[block]));
+    BasicBlock* header = cast<BasicBlock>(vMap[point.header]);
+
+    BasicBlock* entry = BasicBlock::Create(context, "osr.entry", continuation, &continuation->front());
+    IRBuilder<> builder(entry);
+
+    std::vector<std::pair<Instruction*, Value*>> outerLoopValues;
+    for (size_t i = 0; i < point.liveValues.size(); ++i)
+    {
+        Value* liveValue = point.liveValues[i];
+        if (isa<Argument>(liveValue))
+            continue;
+
+        Value* replacement = newArgs[i];
+        if (point.passByValue[i])
+        {
+            AllocaInst* copy = builder.CreateAlloca(cast<AllocaInst>(liveValue)->getAllocatedType());
+            builder.CreateStore(newArgs[i], copy);
+            replacement = copy;
+        }
+
+        Instruction* cloned = cast<Instruction>(vMap[liveValue]);
+        if (cloned->getParent() == header && isa<PHINode>(cloned))
+        {
+            cast<PHINode>(cloned)->addIncoming(replacement, entry);
+        }
+        else if (region.find(cloned->getParent()) == region.end())
+        {
+            for (auto use = cloned->use_begin(); use != cloned->use_end();)
+            {
+                Use& currentUse = *use++;
+                Instruction* user = cast<Instruction>(currentUse.getUser());
+                if (region.find(user->getParent()) != region.end())
+                    currentUse.set(replacement);
+            }
+        }
+        else
+        {
+            outerLoopValues.push_back(std::make_pair(cloned, replacement));
+        }
+    }
+    builder.CreateBr(header);
+
+    // Everything before the loop header is gone.
+    removeUnreachableBlocks(*continuation);
+
+    // Values of outer loops come from the frame the first time, and are recomputed
+    // when the outer loop iterates again.
+    for (auto& outerLoopValue : outerLoopValues)
+    {
+        Instruction* definition = outerLoopValue.first;
+        SSAUpdater updater;
+        updater.Initialize(definition->getType(), definition->getName());
+        updater.AddAvailableValue(entry, outerLoopValue.second);
+        updater.AddAvailableValue(definition->getParent(), definition);
+
+        for (auto use = definition->use_begin(); use != definition->use_end();)
+        {
+            Use& currentUse = *use++;
+            Instruction* user = cast<Instruction>(currentUse.getUser());
+            if (user->getParent() == definition->getParent() && !isa<PHINode>(user))
+                continue;
+            updater.RewriteUse(currentUse);
+        }
+    }
+
+    return continuation;
+}
+
+std::vector<Function*> BuildOSRContinuations(Function& F, const std::string& namePrefix) {
+    std::vector<Function*> continuations;
+    if (!CanHaveTransitionPoints(F))
+        return continuations;
+
+    auto points = FindTransitionPoints(F);
+    for (size_t index = 0; index < points.size(); ++index)
+    {
+        if (points[index].supported)
+            continuations.push_back(BuildContinuation(F, points[index], namePrefix + std::to_string(index)));
+        else
+            continuations.push_back(nullptr);
+    }
+
+    return continuations;
+}
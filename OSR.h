@@ -0,0 +1,27 @@
+#pragma once
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include <string>
+#include <vector>
+
+// On-stack replacement at loop headers.
+//
+// Program functions get a transition point at every loop header: a check of a flag global
+// (see GetOSRFlagName) that stays zero until a continuation is published in it. A continuation
+// resumes the function at that loop header, taking the values live there as arguments; the
+// running frame calls it and returns whatever it returns.
+//
+// Transition points and continuations are built from identical IR (the emitted module and
+// the database copy of the same function, before any other transformation), and compute
+// the live values in the same way, so their signatures always match. Loop headers are
+// indexed in block order.
+
+std::string GetOSRFlagName(const std::string& functionName, size_t loopIndex);
+
+// Adds transition points to the functions of the module. Must run on the IR as it is
+// stored in the database.
+void InsertOSRTransitionPoints(llvm::Module& M);
+
+// Builds the continuations for every loop header of the function (named namePrefix followed
+// by the loop index) in its module. Headers that can't have a transition point get a nullptr.
+std::vector<llvm::Function*> BuildOSRContinuations(llvm::Function& F, const std::string& namePrefix);
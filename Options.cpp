@@ -1,4 +1,6 @@
 #include "Options.h"
+#include <algorithm>
+#include <thread>
 
 std::unordered_map<std::string, std::string> OptionsStore::options;
 
@@ -18,6 +20,20 @@ std::string OptionsStore::GetOptionOrError(const std::string& optName) {
     }
 }
 
+size_t OptionsStore::GetNumberOfCompileJobs(size_t numUnits) {
+    size_t numJobs = std::thread::hardware_concurrency();
+    std::string option = GetOption("compile_jobs");
+    if (option.size() > 0)
+    {
+        numJobs = std::atoi(option.c_str());
+    }
+
+    if (numJobs == 0)
+        numJobs = 1;
+
+    return std::min(numJobs, std::max(numUnits, (size_t)1));
+}
+
 void OptionsStore::LoadOptions(const std::string& filename) {
     std::ifstream file{ filename };
 
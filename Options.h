@@ -14,4 +14,8 @@ public:
     static std::string GetOptionOrError(const std::string& optName);
 
     static void LoadOptions(const std::string& filename);
+
+    // Number of threads to use for compiling numUnits independent units of work,
+    // as configured by the compile_jobs option.
+    static size_t GetNumberOfCompileJobs(size_t numUnits);
 };
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "Patcher.h"
+#include "JITMemoryManager.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <iostream>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Commands of the membarrier syscall (linux/membarrier.h), which older headers may not have.
+static const int MembarrierRegisterPrivateExpeditedSyncCore = 1 << 6;
+static const int MembarrierPrivateExpeditedSyncCore = 1 << 5;
+
+// Only one function is patched at a time. The SIGTRAP handler uses these to find out
+// whether an int3 belongs to a patch.
+static std::atomic<uintptr_t> patchAddress{ 0 };
+static std::atomic<uintptr_t> patchTarget{ 0 };
+static std::atomic<bool> patchInProgress{ false };
+
+static struct sigaction previousTrapAction;
+static bool canSerializeThreads = false;
+
+// Other threads are stopped in StopHandler until the last stop request is released. Those
+// interrupted between stopStart and stopEnd are counted in threadsInPatch.
+static std::atomic<uintptr_t> stopStart{ 0 };
+static std::atomic<uintptr_t> stopEnd{ 0 };
+static std::atomic<size_t> threadsStopped{ 0 };
+static std::atomic<size_t> threadsInPatch{ 0 };
+static std::atomic<uint64_t> stopsRequested{ 0 };
+static std::atomic<uint64_t> stopsReleased{ 0 };
+
+static int StopSignal() {
+    return SIGRTMIN + 1;
+}
+
+static void StopHandler(int signo, siginfo_t* info, void* context) {
+    int savedErrno = errno;
+    ucontext_t* ucontext = (ucontext_t*)context;
+    uintptr_t address = (uintptr_t)ucontext->uc_mcontext.gregs[REG_RIP];
+    uint64_t request = stopsRequested.load();
+
+    // Nothing to do for a signal delivered after its stop has been released.
+    if (stopsReleased.load() < request)
+    {
+        if (address > stopStart.load() && address < stopEnd.load())
+            threadsInPatch++;
+        threadsStopped++;
+
+        while (stopsReleased.load() < request)
+            sched_yield();
+    }
+    errno = savedErrno;
+}
+
+static void TrapHandler(int signo, siginfo_t* info, void* context) {
+    ucontext_t* ucontext = (ucontext_t*)context;
+    // The int3 has already been executed: the instruction pointer is one byte past it.
+    uintptr_t trapAddress = (uintptr_t)ucontext->uc_mcontext.gregs[REG_RIP] - 1;
+
+    if (trapAddress == patchAddress.load())
+    {
+        if (patchInProgress.load())
+            ucontext->uc_mcontext.gregs[REG_RIP] = (greg_t)patchTarget.load();
+        else
+            // The patch was completed after the trap, so execute the final code.
+            ucontext->uc_mcontext.gregs[REG_RIP] = (greg_t)trapAddress;
+        return;
+    }
+
+    // Not ours.
+    if (previousTrapAction.sa_flags & SA_SIGINFO)
+    {
+        previousTrapAction.sa_sigaction(signo, info, context);
+    }
+    else if (previousTrapAction.sa_handler != SIG_DFL && previousTrapAction.sa_handler != SIG_IGN)
+    {
+        previousTrapAction.sa_handler(signo);
+    }
+    else
+    {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+    }
+}
+
+FunctionPatcher::FunctionPatcher() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = TrapHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGTRAP, &action, &previousTrapAction) != 0)
+        std::cerr << "WARNING: Can't install SIGTRAP handler for function patching\n";
+
+    action.sa_sigaction = StopHandler;
+    if (sigaction(StopSignal(), &action, nullptr) != 0)
+        std::cerr << "WARNING: Can't install the handler that stops threads for function patching\n";
+
+#ifdef SYS_membarrier
+    canSerializeThreads = syscall(SYS_membarrier, MembarrierRegisterPrivateExpeditedSyncCore, 0) == 0;
+#endif
+}
+
+bool FunctionPatcher::Redirect(void* function, size_t patchableSize, void* target) {
+    uintptr_t address = (uintptr_t)function;
+    if (patchableSize < JumpSize)
+        return false;
+
+    Patch patch;
+    auto existing = patches.find(address);
+    if (existing != patches.end())
+    {
+        patch = existing->second;
+
+        // Already jumping through a stub: only the stub needs to change.
+        if (patch.stubSlot)
+        {
+            SetWritable((uintptr_t)patch.stubSlot, sizeof(uint64_t), true);
+            __atomic_store_n(patch.stubSlot, (uint64_t)target, __ATOMIC_SEQ_CST);
+            SetWritable((uintptr_t)patch.stubSlot, sizeof(uint64_t), false);
+
+            existing->second.target = (uintptr_t)target;
+            return true;
+        }
+    }
+    else
+    {
+        memcpy(patch.originalBytes, function, JumpSize);
+    }
+
+    uintptr_t jumpTarget = (uintptr_t)target;
+    patch.stubSlot = nullptr;
+    if (!FitsInRel32(address + JumpSize, jumpTarget))
+    {
+        patch.stubSlot = AllocateStub(address, (uintptr_t)target);
+        if (!patch.stubSlot)
+            return false;
+        // The stub starts 8 bytes before its slot.
+        jumpTarget = (uintptr_t)patch.stubSlot - 8;
+    }
+
+    uint8_t jump[JumpSize];
+    jump[0] = 0xE9;
+    int32_t displacement = (int32_t)((int64_t)jumpTarget - (int64_t)(address + JumpSize));
+    memcpy(jump + 1, &displacement, sizeof(displacement));
+
+    WriteCode(address, jump, JumpSize, (uintptr_t)target);
+
+    patch.target = (uintptr_t)target;
+    patches[address] = patch;
+    return true;
+}
+
+bool FunctionPatcher::Restore(void* function) {
+    uintptr_t address = (uintptr_t)function;
+    auto patch = patches.find(address);
+    if (patch == patches.end())
+        return false;
+
+    // Stubs are not reused, since a thread may still be running through them.
+    WriteCode(address, patch->second.originalBytes, JumpSize, patch->second.target);
+    patches.erase(patch);
+    return true;
+}
+
+uint64_t* FunctionPatcher::AllocateStub(uintptr_t nearAddress, uintptr_t target) {
+    // A stub is "jmp *2(%rip)", two bytes of padding and the absolute address of the
+    // target, which is 8-byte aligned so that it can be updated atomically.
+    static const uint8_t stubCode[8] = { 0xFF, 0x25, 0x02, 0x00, 0x00, 0x00, 0xCC, 0xCC };
+    static const size_t stubSize = 16;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    StubPage* page = nullptr;
+    for (auto& candidate : stubPages)
+    {
+        if (candidate.used + stubSize <= pageSize && FitsInRel32(nearAddress + JumpSize, candidate.address) &&
+            FitsInRel32(nearAddress + JumpSize, candidate.address + pageSize))
+        {
+            page = &candidate;
+            break;
+        }
+    }
+
+    if (!page)
+    {
+        // Look for free memory at increasing distances from the function.
+        uintptr_t base = nearAddress & ~(uintptr_t)(pageSize - 1);
+        for (uintptr_t distance = 1 << 20; distance < ((uintptr_t)1 << 31) && !page; distance <<= 1)
+        {
+            for (uintptr_t hint : { base - distance, base + distance })
+            {
+                void* memory = mmap((void*)hint, pageSize, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED)
+                    continue;
+
+                if (FitsInRel32(nearAddress + JumpSize, (uintptr_t)memory) &&
+                    FitsInRel32(nearAddress + JumpSize, (uintptr_t)memory + pageSize))
+                {
+                    stubPages.push_back(StubPage{ (uintptr_t)memory, 0 });
+                    page = &stubPages.back();
+                    break;
+                }
+                munmap(memory, pageSize);
+            }
+        }
+    }
+
+    if (!page)
+    {
+        std::cerr << "Cannot allocate a jump stub within 2GB of " << (void*)nearAddress << "\n";
+        return nullptr;
+    }
+
+    uintptr_t stub = page->address + page->used;
+    page->used += stubSize;
+
+    SetWritable(stub, stubSize, true);
+    memcpy((void*)stub, stubCode, sizeof(stubCode));
+    uint64_t* slot = (uint64_t*)(stub + 8);
+    *slot = target;
+    SetWritable(stub, stubSize, false);
+    __builtin___clear_cache((char*)stub, (char*)(stub + stubSize));
+
+    return slot;
+}
+
+void FunctionPatcher::WriteCode(uintptr_t address, const uint8_t* bytes, size_t size, uintptr_t target) {
+    if (!SetWritable(address, size, true))
+    {
+        std::cerr << "Cannot make code at " << (void*)address << " writable\n";
+        exit(-1);
+    }
+
+    patchTarget = target;
+    patchAddress = address;
+    patchInProgress = true;
+
+    // From here on, no thread starts executing the bytes being replaced.
+    __atomic_store_n((uint8_t*)address, (uint8_t)0xCC, __ATOMIC_SEQ_CST);
+    SerializeAllThreads();
+
+    // Threads that were already past the first byte must be out of the rest of them.
+    size_t threadsNotStopped = StopOtherThreads(address, address + size);
+
+    if ((address & 7) + size <= 8)
+    {
+        // The whole jump lies in one aligned word: a single store replaces it atomically.
+        uint64_t* word = (uint64_t*)(address & ~(uintptr_t)7);
+        uint64_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+        memcpy((uint8_t*)&value + (address & 7), bytes, size);
+        __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        memcpy((void*)(address + 1), bytes + 1, size - 1);
+        SerializeAllThreads();
+
+        __atomic_store_n((uint8_t*)address, bytes[0], __ATOMIC_SEQ_CST);
+    }
+    SerializeAllThreads();
+
+    ResumeOtherThreads();
+
+    // Other threads may have been stopped while holding the lock of the stream.
+    if (threadsNotStopped > 0)
+        std::cerr << "WARNING: " << threadsNotStopped << " threads could not be stopped for function patching\n";
+
+    // patchAddress is left as is, in case a thread trapped right before the last write
+    // is still on its way to the handler.
+    patchInProgress = false;
+
+    __builtin___clear_cache((char*)address, (char*)(address + size));
+    SetWritable(address, size, false);
+}
+
+size_t FunctionPatcher::StopOtherThreads(uintptr_t start, uintptr_t end) {
+    pid_t process = getpid();
+    pid_t self = (pid_t)syscall(SYS_gettid);
+    stopStart = start;
+    stopEnd = end;
+
+    for (int attempt = 0;; ++attempt)
+    {
+        threadsStopped = 0;
+        threadsInPatch = 0;
+        stopsRequested++;
+
+        // Threads created after this are not a concern: they can only reach the patch through
+        // its first byte.
+        size_t signaled = 0;
+        if (DIR* tasks = opendir("/proc/self/task"))
+        {
+            while (dirent* task = readdir(tasks))
+            {
+                pid_t thread = (pid_t)atoi(task->d_name);
+                if (thread > 0 && thread != self && syscall(SYS_tgkill, process, thread, StopSignal()) == 0)
+                    signaled++;
+            }
+            closedir(tasks);
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (threadsStopped.load() < signaled && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::yield();
+
+        if (threadsInPatch.load() == 0)
+            return signaled - std::min(threadsStopped.load(), signaled);
+
+        // Let the threads run out of the patched bytes.
+        ResumeOtherThreads();
+        std::this_thread::sleep_for(std::chrono::milliseconds(attempt < 10 ? 0 : 1));
+    }
+}
+
+void FunctionPatcher::ResumeOtherThreads() {
+    stopsReleased = stopsRequested.load();
+}
+
+bool FunctionPatcher::FitsInRel32(uintptr_t from, uintptr_t to) {
+    int64_t displacement = (int64_t)to - (int64_t)from;
+    return displacement >= INT32_MIN && displacement <= INT32_MAX;
+}
+
+bool FunctionPatcher::SetWritable(uintptr_t address, size_t size, bool writable) {
+    // Huge pages can't be protected piecewise: code in them is always writable.
+    if (llvm::JITMemoryManager::isInHugePageRegion(address))
+        return true;
+
+    // Other threads may be running code in the same pages, so they stay executable.
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = address & ~(pageSize - 1);
+    uintptr_t end = (address + size + pageSize - 1) & ~(pageSize - 1);
+    int protection = PROT_READ | PROT_EXEC | (writable ? PROT_WRITE : 0);
+    return mprotect((void*)start, end - start, protection) == 0;
+}
+
+void FunctionPatcher::SerializeAllThreads() {
+    // Makes sure that no other core still executes stale instructions.
+#ifdef SYS_membarrier
+    if (canSerializeThreads)
+        syscall(SYS_membarrier, MembarrierPrivateExpeditedSyncCore, 0);
+#endif
+}
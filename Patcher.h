@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Redirects JIT'd functions to other code by writing a jump at their entry (x86-64 only).
+//
+// The jump is a 5-byte "jmp rel32". If the target is more than 2GB away, the jump goes
+// through a stub allocated near the function, which holds the absolute address of the target.
+// Patching is safe while other threads are running the function:
+// - the first byte is replaced by an int3 first. Threads hitting it in the meantime are sent to
+//   the target by a SIGTRAP handler;
+// - every other thread is then stopped in a signal handler (SIGRTMIN + 1), which reports where it
+//   was interrupted. If a thread is in the middle of the bytes that the jump overwrites (i.e. past
+//   a first instruction shorter than the jump), the threads are let go and stopped again a bit
+//   later, so that no thread ever resumes in the middle of the jump;
+// - while they are stopped, the jump is written with a single atomic store if it fits in an
+//   aligned 8-byte word, or otherwise by writing the rest of the jump and then its first byte.
+// Code pages are made writable only while they are patched. The original bytes are kept,
+// so redirected functions can be restored.
+//
+// Threads that block SIGRTMIN + 1 can't be stopped: after a second, patching goes on without
+// them, with a warning.
+class FunctionPatcher {
+public:
+    FunctionPatcher();
+
+    // Redirects every call to the function to the target. patchableSize is the number of bytes
+    // that can be overwritten at the entry. Returns false if that's smaller than a jump.
+    bool Redirect(void* function, size_t patchableSize, void* target);
+
+    // Restores the original entry of a redirected function.
+    bool Restore(void* function);
+
+    bool IsRedirected(void* function) const { return patches.find((uintptr_t)function) != patches.end(); }
+
+    // Drops the patch of a function whose code is being unloaded, without writing to it.
+    void Forget(void* function) { patches.erase((uintptr_t)function); }
+
+    static const size_t JumpSize = 5;
+
+private:
+    struct Patch {
+        uint8_t originalBytes[JumpSize];
+        uintptr_t target = 0;
+        // Slot holding the absolute address of the target, when the jump goes through a stub.
+        uint64_t* stubSlot = nullptr;
+    };
+
+    struct StubPage {
+        uintptr_t address;
+        size_t used;
+    };
+
+    uint64_t* AllocateStub(uintptr_t nearAddress, uintptr_t target);
+    void WriteCode(uintptr_t address, const uint8_t* bytes, size_t size, uintptr_t target);
+
+    static bool FitsInRel32(uintptr_t from, uintptr_t to);
+    static bool SetWritable(uintptr_t address, size_t size, bool writable);
+    static void SerializeAllThreads();
+    // Stops every other thread, once none is between start and end (exclusive). Returns the
+    // number of threads that didn't stop.
+    static size_t StopOtherThreads(uintptr_t start, uintptr_t end);
+    static void ResumeOtherThreads();
+
+    std::map<uintptr_t, Patch> patches;
+    std::vector<StubPage> stubPages;
+};
@@ -0,0 +1,283 @@
+#include "PerfCounters.h"
+#include "Interactive.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::vector<std::string> PerfCounters::selected;
+
+struct EventDescription {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+    // Software event used when the hardware one can't be opened.
+    const char* fallbackName;
+    uint64_t fallbackConfig;
+};
+
+static uint64_t CacheMisses(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+static const EventDescription events[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "task-clock", PERF_COUNT_SW_TASK_CLOCK },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, nullptr, 0 },
+    { "l1d-misses", PERF_TYPE_HW_CACHE, CacheMisses(PERF_COUNT_HW_CACHE_L1D), nullptr, 0 },
+    { "llc-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, nullptr, 0 },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, nullptr, 0 },
+    { "dtlb-misses", PERF_TYPE_HW_CACHE, CacheMisses(PERF_COUNT_HW_CACHE_DTLB), nullptr, 0 },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, nullptr, 0 },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, nullptr, 0 },
+};
+
+// Not perf events: IPC is derived from cycles and instructions, peak RSS comes from getrusage.
+static const char* IPCCounter = "ipc";
+static const char* PeakRSSCounter = "peak-rss";
+
+static const EventDescription* FindEvent(const std::string& name) {
+    for (auto& event : events)
+    {
+        if (name == event.name)
+            return &event;
+    }
+    return nullptr;
+}
+
+static long GetPeakRSS() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int OpenEvent(uint32_t type, uint64_t config, int groupLeader) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    // Members follow their leader, which is enabled and disabled around each iteration.
+    attr.disabled = groupLeader == -1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, groupLeader, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (errno == EACCES || errno == EPERM))
+    {
+        // Unprivileged users may only count user space.
+        attr.exclude_kernel = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, groupLeader, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+bool PerfCounters::Select(const std::string& list) {
+    std::vector<std::string> names = split(list, ',', true);
+    for (auto& name : names)
+    {
+        lowerString(name);
+        if (!FindEvent(name) && name != IPCCounter && name != PeakRSSCounter)
+        {
+            std::cout << "Unknown counter " << name << ". Available counters: " << GetAvailableCounters() << "\n";
+            return false;
+        }
+    }
+
+    selected = names;
+    return true;
+}
+
+void PerfCounters::Deselect() {
+    selected.clear();
+}
+
+std::string PerfCounters::GetAvailableCounters() {
+    std::string available;
+    for (auto& event : events)
+        available += std::string(event.name) + ",";
+    return available + IPCCounter + "," + PeakRSSCounter;
+}
+
+PerfCounters::PerfCounters(bool verbose) {
+    std::vector<std::string> names;
+    for (auto& name : selected)
+    {
+        if (name == IPCCounter)
+        {
+            measureIPC = true;
+            for (const char* needed : { "cycles", "instructions" })
+            {
+                if (std::find(selected.begin(), selected.end(), needed) == selected.end() &&
+                    std::find(names.begin(), names.end(), needed) == names.end())
+                    names.push_back(needed);
+            }
+        }
+        else if (name == PeakRSSCounter)
+        {
+            measurePeakRSS = true;
+        }
+        else if (std::find(names.begin(), names.end(), name) == names.end())
+        {
+            names.push_back(name);
+        }
+    }
+
+    // Joins the last group if possible, otherwise starts a new one.
+    auto open = [this](uint32_t type, uint64_t config, Counter& counter) -> bool
+    {
+        if (!groups.empty())
+        {
+            counter.fd = OpenEvent(type, config, groups.back().leader);
+            if (counter.fd >= 0)
+            {
+                counter.leader = groups.back().leader;
+                counter.groupIndex = groups.back().size++;
+                return true;
+            }
+        }
+
+        counter.fd = OpenEvent(type, config, -1);
+        if (counter.fd < 0)
+            return false;
+
+        groups.push_back(Group{ counter.fd, 1 });
+        counter.leader = counter.fd;
+        counter.groupIndex = 0;
+        return true;
+    };
+
+    for (auto& name : names)
+    {
+        const EventDescription* event = FindEvent(name);
+        Counter counter;
+        counter.name = name;
+
+        if (!open(event->type, event->config, counter))
+        {
+            if (event->fallbackName && open(PERF_TYPE_SOFTWARE, event->fallbackConfig, counter))
+            {
+                if (verbose)
+                    std::cout << "Counter " << name << " is not available, using " << event->fallbackName << " (ns) instead\n";
+                counter.name = event->fallbackName;
+            }
+            else
+            {
+                if (verbose)
+                    std::cout << "Counter " << name << " is not available: " << strerror(errno) << "\n";
+                continue;
+            }
+        }
+
+        counters.push_back(counter);
+    }
+
+    auto isOpen = [this](const char* name)
+    {
+        for (auto& counter : counters)
+        {
+            if (counter.name == name)
+                return true;
+        }
+        return false;
+    };
+
+    if (measureIPC && !(isOpen("cycles") && isOpen("instructions")))
+    {
+        if (verbose)
+            std::cout << "IPC is not available without the cycles and instructions counters\n";
+        measureIPC = false;
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (auto& counter : counters)
+        close(counter.fd);
+}
+
+void PerfCounters::Start() {
+    if (measurePeakRSS)
+        peakRSSAtStart = GetPeakRSS();
+
+    for (auto& group : groups)
+    {
+        ioctl(group.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(group.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void PerfCounters::Stop() {
+    for (auto& group : groups)
+        ioctl(group.leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    if (measurePeakRSS)
+        peakRSSSamples.push_back(GetPeakRSS() - peakRSSAtStart);
+
+    for (auto& group : groups)
+    {
+        // nr, time enabled, time running, then one value per counter.
+        std::vector<uint64_t> values(3 + group.size);
+        if (read(group.leader, values.data(), values.size() * sizeof(uint64_t)) < 0)
+            std::fill(values.begin(), values.end(), 0);
+
+        // Counters multiplexed with other events only ran for part of the time.
+        double scale = 1;
+        if (values[2] > 0 && values[2] < values[1])
+            scale = (double)values[1] / values[2];
+
+        for (auto& counter : counters)
+        {
+            if (counter.leader == group.leader)
+                counter.samples.push_back(values[3 + counter.groupIndex] * scale);
+        }
+    }
+}
+
+std::vector<double> PerfCounters::GetLastSample() const {
+    std::vector<double> sample;
+    for (auto& counter : counters)
+        sample.push_back(counter.samples.empty() ? 0 : counter.samples.back());
+    if (measurePeakRSS)
+        sample.push_back(peakRSSSamples.empty() ? 0 : peakRSSSamples.back());
+    return sample;
+}
+
+void PerfCounters::AddSample(const std::vector<double>& sample) {
+    if (sample.size() != counters.size() + (measurePeakRSS ? 1 : 0))
+        return;
+
+    for (size_t i = 0; i < counters.size(); ++i)
+        counters[i].samples.push_back(sample[i]);
+    if (measurePeakRSS)
+        peakRSSSamples.push_back(sample.back());
+}
+
+std::vector<std::pair<std::string, std::vector<double>>> PerfCounters::GetSamples() const {
+    std::vector<std::pair<std::string, std::vector<double>>> samples;
+    const std::vector<double>* cycles = nullptr;
+    const std::vector<double>* instructions = nullptr;
+    for (auto& counter : counters)
+    {
+        samples.push_back(std::make_pair(counter.name, counter.samples));
+        if (counter.name == "cycles")
+            cycles = &counter.samples;
+        else if (counter.name == "instructions")
+            instructions = &counter.samples;
+    }
+
+    if (measureIPC)
+    {
+        std::vector<double> ipc;
+        for (size_t i = 0; i < cycles->size(); ++i)
+            ipc.push_back((*cycles)[i] > 0 ? (*instructions)[i] / (*cycles)[i] : 0);
+        samples.push_back(std::make_pair(std::string(IPCCounter), ipc));
+    }
+
+    if (measurePeakRSS)
+        samples.push_back(std::make_pair(std::string(PeakRSSCounter) + " (KB)", peakRSSSamples));
+
+    return samples;
+}
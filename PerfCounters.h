@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Performance counters read around every timed iteration of the "run" command.
+//
+// Counters are selected at the prompt ("enable counters cycles,llc-misses") and opened with
+// perf_event_open, in as few groups as the PMU allows, so that they are measured over the
+// same instructions. Hardware counters that can't be opened fall back to a software event
+// when there is one (cycles -> task-clock), and are dropped otherwise. Counters only count
+// the thread that runs the interactive cycle.
+class PerfCounters {
+public:
+    // Selects a comma-separated list of counters. Prints an error and keeps the current
+    // selection if a name is unknown.
+    static bool Select(const std::string& list);
+    static void Deselect();
+    static bool AnySelected() { return !selected.empty(); }
+    static std::string GetAvailableCounters();
+
+    // Opens the selected counters. Unavailable counters are reported if verbose.
+    PerfCounters(bool verbose = true);
+    ~PerfCounters();
+
+    void Start();
+    // Adds one sample to every counter.
+    void Stop();
+
+    // Raw values of the last sample, to move samples taken in a checkpoint child to the parent.
+    std::vector<double> GetLastSample() const;
+    void AddSample(const std::vector<double>& sample);
+
+    // Name and samples of every counter that could be opened, in selection order.
+    std::vector<std::pair<std::string, std::vector<double>>> GetSamples() const;
+
+private:
+    struct Counter {
+        std::string name;
+        int fd = -1;
+        // Group leader and position in the group.
+        int leader = -1;
+        size_t groupIndex = 0;
+        std::vector<double> samples;
+    };
+
+    struct Group {
+        int leader;
+        size_t size;
+    };
+
+    static std::vector<std::string> selected;
+
+    std::vector<Counter> counters;
+    std::vector<Group> groups;
+    bool measureIPC = false;
+    bool measurePeakRSS = false;
+    long peakRSSAtStart = 0;
+    std::vector<double> peakRSSSamples;
+};
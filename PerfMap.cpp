@@ -0,0 +1,253 @@
+#include "PerfMap.h"
+#include "Options.h"
+#include "llvm/DebugInfo/DIContext.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cerrno>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+// Format of the jitdump file, from tools/perf/Documentation/jitdump-specification.txt in Linux.
+static const uint32_t JITDumpMagic = 0x4A695444;
+static const uint32_t JITDumpVersion = 1;
+
+enum JITDumpRecordType {
+    JITCodeLoad = 0,
+    JITCodeDebugInfo = 2,
+    JITCodeClose = 3,
+};
+
+struct JITDumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t totalSize;
+    uint32_t elfMachine;
+    uint32_t padding;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JITDumpRecordHeader {
+    uint32_t id;
+    uint32_t totalSize;
+    uint64_t timestamp;
+};
+
+struct JITDumpCodeLoad {
+    JITDumpRecordHeader header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t codeAddress;
+    uint64_t codeSize;
+    uint64_t codeIndex;
+    // Followed by the null-terminated name and the code.
+};
+
+struct JITDumpDebugInfo {
+    JITDumpRecordHeader header;
+    uint64_t codeAddress;
+    uint64_t entries;
+    // Followed by the entries: address, line, discriminator and null-terminated file name.
+};
+
+// perf record -k 1 timestamps its samples with the same clock.
+static uint64_t GetTimestamp() {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+PerfMap::PerfMap() {
+    if (OptionsStore::GetOption("perf_map") == "1")
+    {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        mapFile = fopen(path.c_str(), "w");
+        if (!mapFile)
+            llvm::errs() << "Cannot open perf map " << path << ": " << strerror(errno) << "\n";
+    }
+
+    if (OptionsStore::GetOption("jitdump") == "1")
+    {
+        std::string directory = OptionsStore::GetOption("jitdump_dir");
+        if (!OpenJITDump(directory.empty() ? "/tmp" : directory) && dumpFile)
+        {
+            fclose(dumpFile);
+            dumpFile = nullptr;
+        }
+    }
+}
+
+PerfMap::~PerfMap() {
+    if (mapFile)
+        fclose(mapFile);
+
+    if (dumpFile)
+    {
+        JITDumpRecordHeader close = { JITCodeClose, sizeof(JITDumpRecordHeader), GetTimestamp() };
+        fwrite(&close, sizeof(close), 1, dumpFile);
+        fclose(dumpFile);
+    }
+    if (dumpMarker)
+        munmap(dumpMarker, sysconf(_SC_PAGESIZE));
+}
+
+bool PerfMap::OpenJITDump(const std::string& directory) {
+    std::string path = directory + "/jit-" + std::to_string(getpid()) + ".dump";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0 || !(dumpFile = fdopen(fd, "w+")))
+    {
+        llvm::errs() << "Cannot open jitdump " << path << ": " << strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // perf inject finds the dump through this executable mapping of the file.
+    dumpMarker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (dumpMarker == MAP_FAILED)
+    {
+        dumpMarker = nullptr;
+        llvm::errs() << "Cannot map jitdump " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    JITDumpHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JITDumpMagic;
+    header.version = JITDumpVersion;
+    header.totalSize = sizeof(header);
+    header.elfMachine = EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = GetTimestamp();
+    return fwrite(&header, sizeof(header), 1, dumpFile) == 1 && fflush(dumpFile) == 0;
+}
+
+void PerfMap::NotifyLoaded(orc::VModuleKey K, const object::ObjectFile& Object, const RuntimeDyld::LoadedObjectInfo& info) {
+    if (!IsEnabled())
+        return;
+
+    // The sections of the debug object have their load addresses.
+    object::OwningBinary<object::ObjectFile> debugObjectOwner = info.getObjectForDebug(Object);
+    const object::ObjectFile* debugObject = debugObjectOwner.getBinary();
+    if (!debugObject)
+        return;
+
+    std::unique_ptr<DIContext> context;
+    if (dumpFile)
+        context = DWARFContext::create(*debugObject);
+
+    std::vector<Function> functions;
+    for (auto& symbol : object::computeSymbolSizes(*debugObject))
+    {
+        auto type = symbol.first.getType();
+        auto name = symbol.first.getName();
+        auto address = symbol.first.getAddress();
+        if (!type || !name || !address || type.get() != object::SymbolRef::ST_Function || symbol.second == 0)
+        {
+            consumeError(type.takeError());
+            consumeError(name.takeError());
+            consumeError(address.takeError());
+            continue;
+        }
+
+        Function function;
+        function.name = name.get();
+        function.address = address.get();
+        function.size = symbol.second;
+
+        if (context)
+        {
+            DILineInfoSpecifier specifier(DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath, DILineInfoSpecifier::FunctionNameKind::None);
+            for (auto& line : context->getLineInfoForAddressRange(function.address, function.size, specifier))
+                function.lines.push_back(LineEntry{ line.first, line.second.Line, line.second.FileName });
+        }
+
+        functions.push_back(std::move(function));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (mapFile)
+    {
+        for (auto& function : functions)
+            fprintf(mapFile, "%llx %llx %s\n", (unsigned long long)function.address, (unsigned long long)function.size, function.name.c_str());
+        fflush(mapFile);
+    }
+
+    if (dumpFile)
+    {
+        auto& pending = pendingFunctions[K];
+        pending.insert(pending.end(), std::make_move_iterator(functions.begin()), std::make_move_iterator(functions.end()));
+    }
+}
+
+void PerfMap::NotifyFinalized(orc::VModuleKey K) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pendingFunctions.find(K);
+    if (it == pendingFunctions.end())
+        return;
+
+    // Debug info must precede the code it describes.
+    for (auto& function : it->second)
+    {
+        WriteDebugInfo(function);
+        WriteCodeLoad(function);
+    }
+    fflush(dumpFile);
+    pendingFunctions.erase(it);
+}
+
+void PerfMap::ForgetModule(orc::VModuleKey K) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pendingFunctions.erase(K);
+}
+
+void PerfMap::WriteCodeLoad(const Function& function) {
+    JITDumpCodeLoad record;
+    record.header.id = JITCodeLoad;
+    record.header.totalSize = sizeof(record) + function.name.size() + 1 + function.size;
+    record.header.timestamp = GetTimestamp();
+    record.pid = getpid();
+    record.tid = syscall(SYS_gettid);
+    record.vma = function.address;
+    record.codeAddress = function.address;
+    record.codeSize = function.size;
+    record.codeIndex = codeIndex++;
+
+    fwrite(&record, sizeof(record), 1, dumpFile);
+    fwrite(function.name.c_str(), function.name.size() + 1, 1, dumpFile);
+    fwrite((const void*)function.address, function.size, 1, dumpFile);
+}
+
+void PerfMap::WriteDebugInfo(const Function& function) {
+    if (function.lines.empty())
+        return;
+
+    JITDumpDebugInfo record;
+    record.header.id = JITCodeDebugInfo;
+    record.header.totalSize = sizeof(record);
+    record.header.timestamp = GetTimestamp();
+    record.codeAddress = function.address;
+    record.entries = function.lines.size();
+    for (auto& line : function.lines)
+        record.header.totalSize += sizeof(uint64_t) + 2 * sizeof(uint32_t) + line.file.size() + 1;
+
+    fwrite(&record, sizeof(record), 1, dumpFile);
+    for (auto& line : function.lines)
+    {
+        uint32_t discriminator = 0;
+        fwrite(&line.address, sizeof(line.address), 1, dumpFile);
+        fwrite(&line.line, sizeof(line.line), 1, dumpFile);
+        fwrite(&discriminator, sizeof(discriminator), 1, dumpFile);
+        fwrite(line.file.c_str(), line.file.size() + 1, 1, dumpFile);
+    }
+}
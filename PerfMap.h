@@ -0,0 +1,59 @@
+#pragma once
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Describes the code emitted by the JIT to Linux perf, which otherwise only sees anonymous memory.
+//
+// With the "perf_map" option, every function is listed in /tmp/perf-<pid>.map, which perf report
+// uses to name addresses. With the "jitdump" option, functions are also written to
+// <jitdump_dir>/jit-<pid>.dump (default: /tmp) together with their code and, if the program is
+// compiled with debug info, their line table: `perf record -k 1` followed by `perf inject --jit`
+// makes them available to perf report and perf annotate.
+//
+// Every object loaded by the JIT is covered: program modules at every tier, instrumented copies
+// and the trampolines of the interactive cycle.
+class PerfMap {
+public:
+    PerfMap();
+    ~PerfMap();
+
+    bool IsEnabled() const { return mapFile || dumpFile; }
+
+    // Before the object is relocated: its code is only written to the jitdump once it's final.
+    void NotifyLoaded(llvm::orc::VModuleKey K, const llvm::object::ObjectFile& Object, const llvm::RuntimeDyld::LoadedObjectInfo& info);
+    void NotifyFinalized(llvm::orc::VModuleKey K);
+    void ForgetModule(llvm::orc::VModuleKey K);
+
+private:
+    struct LineEntry {
+        uint64_t address;
+        uint32_t line;
+        std::string file;
+    };
+
+    struct Function {
+        std::string name;
+        uint64_t address;
+        uint64_t size;
+        std::vector<LineEntry> lines;
+    };
+
+    bool OpenJITDump(const std::string& directory);
+    void WriteCodeLoad(const Function& function);
+    void WriteDebugInfo(const Function& function);
+
+    std::mutex mutex;
+    FILE* mapFile = nullptr;
+    FILE* dumpFile = nullptr;
+    // The jitdump is mapped, so that perf record sees where it is.
+    void* dumpMarker = nullptr;
+    uint64_t codeIndex = 0;
+    // Functions of the objects that have been loaded but not finalized.
+    std::map<llvm::orc::VModuleKey, std::vector<Function>> pendingFunctions;
+};
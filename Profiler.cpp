@@ -0,0 +1,482 @@
+#include "Profiler.h"
+#include "Interactive.h"
+#include "Options.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fstream>
+#include <iomanip>
+#include <set>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+Profiler::Symbolizer Profiler::symbolizer;
+Profiler::Disassembler Profiler::disassembler;
+bool Profiler::running = false;
+uint64_t Profiler::totalSamples = 0;
+uint64_t Profiler::droppedSamples = 0;
+std::map<std::string, uint64_t> Profiler::foldedStacks;
+std::map<std::string, uint64_t> Profiler::selfSamples;
+std::map<std::string, uint64_t> Profiler::totalSamplesPerFunction;
+std::map<uint64_t, uint64_t> Profiler::instructionSamples;
+std::map<std::pair<uint64_t, uint64_t>, uint64_t> Profiler::callSamples;
+
+static const size_t MaxDepth = 128;
+// Pages known to be readable during a stack walk.
+static const size_t ReadablePageCacheSize = 8;
+
+// Samples are stored as the number of addresses followed by the addresses, leaf first.
+struct SampleBuffer {
+    // In words, may exceed the capacity when samples are dropped.
+    uint64_t used;
+    uint64_t dropped;
+    // Handlers that may still be writing to the buffer.
+    uint64_t activeHandlers;
+    // Set when the profiler stops: handlers that see it don't write.
+    uint64_t stopped;
+    uint64_t capacity;
+    uint64_t words[1];
+};
+
+static SampleBuffer* buffer = nullptr;
+static size_t bufferSize = 0;
+static struct itimerval samplingInterval;
+static struct sigaction previousProfAction;
+static size_t pageSize = 0;
+
+// Checks that a page can be read, without faulting if it can't (e.g. a frame pointer that is
+// used as a general purpose register by code compiled without frame pointers).
+static bool IsPageReadable(uintptr_t page, uintptr_t* cache, size_t& cached) {
+    for (size_t i = 0; i < cached; ++i)
+    {
+        if (cache[i] == page)
+            return true;
+    }
+
+    char byte;
+    struct iovec local = { &byte, 1 };
+    struct iovec remote = { (void*)page, 1 };
+    if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) != 1)
+        return false;
+
+    cache[cached++ % ReadablePageCacheSize] = page;
+    cached = std::min(cached, ReadablePageCacheSize);
+    return true;
+}
+
+static void ProfHandler(int signo, siginfo_t* info, void* context) {
+    if (!buffer)
+        return;
+
+    int savedErrno = errno;
+    // Pairs with Stop(), which sets stopped before it waits for the active handlers.
+    __atomic_add_fetch(&buffer->activeHandlers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&buffer->stopped, __ATOMIC_SEQ_CST))
+    {
+        __atomic_sub_fetch(&buffer->activeHandlers, 1, __ATOMIC_RELEASE);
+        errno = savedErrno;
+        return;
+    }
+
+    ucontext_t* ucontext = (ucontext_t*)context;
+    uint64_t addresses[MaxDepth];
+    size_t depth = 0;
+    addresses[depth++] = ucontext->uc_mcontext.gregs[REG_RIP];
+
+    uintptr_t readablePages[ReadablePageCacheSize];
+    size_t cachedPages = 0;
+    uintptr_t stackPointer = ucontext->uc_mcontext.gregs[REG_RSP];
+    uintptr_t frame = ucontext->uc_mcontext.gregs[REG_RBP];
+    // Each frame holds the frame pointer of its caller, followed by the return address.
+    // Frames are aligned and are found at increasing addresses.
+    while (depth < MaxDepth && frame >= stackPointer && (frame & 7) == 0)
+    {
+        uintptr_t last = frame + 2 * sizeof(uintptr_t) - 1;
+        if (!IsPageReadable(frame & ~(pageSize - 1), readablePages, cachedPages) ||
+            !IsPageReadable(last & ~(pageSize - 1), readablePages, cachedPages))
+            break;
+
+        uintptr_t returnAddress = ((uintptr_t*)frame)[1];
+        if (returnAddress == 0)
+            break;
+        addresses[depth++] = returnAddress;
+        stackPointer = frame + 2 * sizeof(uintptr_t);
+        frame = ((uintptr_t*)frame)[0];
+    }
+
+    uint64_t offset = __atomic_fetch_add(&buffer->used, depth + 1, __ATOMIC_RELAXED);
+    if (offset + depth + 1 <= buffer->capacity)
+    {
+        buffer->words[offset] = depth;
+        memcpy(&buffer->words[offset + 1], addresses, depth * sizeof(uint64_t));
+    }
+    else
+    {
+        // Marks the end of the samples, which is otherwise left from an earlier profile.
+        if (offset < buffer->capacity)
+            buffer->words[offset] = 0;
+        __atomic_add_fetch(&buffer->dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_sub_fetch(&buffer->activeHandlers, 1, __ATOMIC_RELEASE);
+    errno = savedErrno;
+}
+
+void Profiler::SetSymbolizer(Symbolizer newSymbolizer) {
+    symbolizer = newSymbolizer;
+}
+
+void Profiler::SetDisassembler(Disassembler newDisassembler) {
+    disassembler = newDisassembler;
+}
+
+bool Profiler::Start() {
+    if (running)
+    {
+        std::cout << "The profiler is already running\n";
+        return false;
+    }
+
+    if (!buffer)
+    {
+        pageSize = sysconf(_SC_PAGESIZE);
+
+        size_t bufferMB = 64;
+        std::string bufferOption = OptionsStore::GetOption("profile_buffer_mb");
+        if (bufferOption != "")
+            bufferMB = std::max(1, std::atoi(bufferOption.c_str()));
+
+        // Shared, so that samples taken in forked checkpoint children reach the parent,
+        // and snapshots don't roll them back. Only the pages that are used take memory.
+        bufferSize = bufferMB << 20;
+        void* memory = mmap(nullptr, bufferSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            std::cerr << "Cannot allocate the profile buffer: " << strerror(errno) << "\n";
+            return false;
+        }
+        buffer = (SampleBuffer*)memory;
+    }
+
+    buffer->used = 0;
+    buffer->dropped = 0;
+    buffer->activeHandlers = 0;
+    buffer->stopped = 0;
+    buffer->capacity = (bufferSize - offsetof(SampleBuffer, words)) / sizeof(uint64_t);
+
+    long frequency = 1000;
+    std::string frequencyOption = OptionsStore::GetOption("profile_frequency");
+    if (frequencyOption != "")
+        frequency = std::max(1L, std::atol(frequencyOption.c_str()));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = ProfHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previousProfAction) != 0)
+    {
+        std::cerr << "Cannot install the SIGPROF handler: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    long interval = std::max(1L, 1000000 / frequency);
+    samplingInterval.it_interval.tv_sec = interval / 1000000;
+    samplingInterval.it_interval.tv_usec = interval % 1000000;
+    samplingInterval.it_value = samplingInterval.it_interval;
+    if (setitimer(ITIMER_PROF, &samplingInterval, nullptr) != 0)
+    {
+        std::cerr << "Cannot start the profiling timer: " << strerror(errno) << "\n";
+        sigaction(SIGPROF, &previousProfAction, nullptr);
+        return false;
+    }
+
+    running = true;
+    return true;
+}
+
+void Profiler::EnterCheckpointChild() {
+    if (running)
+        setitimer(ITIMER_PROF, &samplingInterval, nullptr);
+}
+
+void Profiler::Stop() {
+    if (!running)
+        return;
+
+    struct itimerval disabled;
+    memset(&disabled, 0, sizeof(disabled));
+    setitimer(ITIMER_PROF, &disabled, nullptr);
+    // A SIGPROF still pending from the timer would kill the process with the default action.
+    signal(SIGPROF, SIG_IGN);
+    // Handlers that were already running either see the flag or are waited for, so nothing
+    // writes to the buffer while it is read below.
+    __atomic_store_n(&buffer->stopped, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&buffer->activeHandlers, __ATOMIC_SEQ_CST) > 0)
+        sched_yield();
+    running = false;
+
+    totalSamples = 0;
+    droppedSamples = buffer->dropped;
+    foldedStacks.clear();
+    selfSamples.clear();
+    totalSamplesPerFunction.clear();
+    instructionSamples.clear();
+    callSamples.clear();
+
+    std::map<uint64_t, std::string> names;
+    auto getName = [&names](uint64_t address)
+    {
+        auto it = names.find(address);
+        if (it == names.end())
+            it = names.insert(std::make_pair(address, Symbolize(address))).first;
+        return it->second;
+    };
+
+    uint64_t used = std::min(buffer->used, buffer->capacity);
+    for (uint64_t offset = 0; offset < used; )
+    {
+        uint64_t depth = buffer->words[offset];
+        const uint64_t* addresses = &buffer->words[offset + 1];
+        offset += depth + 1;
+        if (depth == 0 || offset > used)
+            break;
+
+        std::vector<std::string> stack;
+        for (uint64_t i = 0; i < depth; ++i)
+        {
+            // Return addresses may point past the end of the call's function.
+            stack.push_back(getName(i == 0 ? addresses[i] : addresses[i] - 1));
+        }
+
+        std::string folded;
+        for (size_t i = stack.size(); i-- > 0; )
+        {
+            folded += stack[i];
+            if (i > 0)
+                folded += ";";
+        }
+
+        totalSamples++;
+        instructionSamples[addresses[0]]++;
+        for (uint64_t i = 0; i + 1 < depth; ++i)
+            callSamples[std::make_pair(addresses[i + 1] - 1, i == 0 ? addresses[i] : addresses[i] - 1)]++;
+        foldedStacks[folded]++;
+        selfSamples[stack[0]]++;
+        // Recursive functions count once per sample.
+        for (auto& name : std::set<std::string>(stack.begin(), stack.end()))
+            totalSamplesPerFunction[name]++;
+    }
+}
+
+std::string Profiler::Demangle(const std::string& name) {
+    int status;
+    char* demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (!demangled)
+        return name;
+    std::string result = demangled;
+    free(demangled);
+    return result;
+}
+
+std::string Profiler::Symbolize(uint64_t address) {
+    std::string name;
+    if (symbolizer && symbolizer(address, name))
+        return name;
+
+    Dl_info info;
+    if (dladdr((void*)address, &info) != 0)
+    {
+        if (info.dli_sname)
+            return Demangle(info.dli_sname);
+        if (info.dli_fname)
+        {
+            std::string file = info.dli_fname;
+            return "[" + file.substr(file.find_last_of('/') + 1) + "]";
+        }
+    }
+
+    return "[unknown]";
+}
+
+void Profiler::Report(std::ostream& out, size_t maxFunctions) {
+    if (totalSamples == 0)
+    {
+        out << "No samples";
+        if (droppedSamples > 0)
+            out << " (" << droppedSamples << " dropped, the buffer is full)";
+        out << "\n";
+        return;
+    }
+
+    out << totalSamples << " samples";
+    if (droppedSamples > 0)
+        out << " (" << droppedSamples << " dropped, the buffer is full)";
+    out << ", " << foldedStacks.size() << " distinct stacks\n";
+
+    std::vector<std::pair<uint64_t, std::string>> functions;
+    for (auto& function : selfSamples)
+        functions.push_back(std::make_pair(function.second, function.first));
+    std::sort(functions.begin(), functions.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b)
+        {
+            return a.first > b.first;
+        });
+
+    out << "    Self    Total  Function\n";
+    for (size_t i = 0; i < functions.size() && i < maxFunctions; ++i)
+    {
+        out << std::fixed << std::setprecision(1)
+            << std::setw(7) << 100.0 * functions[i].first / totalSamples << "% "
+            << std::setw(7) << 100.0 * totalSamplesPerFunction[functions[i].second] / totalSamples << "%  "
+            << functions[i].second << "\n";
+    }
+    if (functions.size() > maxFunctions)
+        out << "(" << functions.size() - maxFunctions << " more functions)\n";
+}
+
+bool Profiler::WriteFoldedStacks(const std::string& path) {
+    std::ofstream file(path);
+    if (!file)
+    {
+        std::cout << "Cannot open " << path << "\n";
+        return false;
+    }
+
+    for (auto& stack : foldedStacks)
+        file << stack.first << " " << stack.second << "\n";
+    return true;
+}
+
+uint64_t Profiler::GetSamplesInRange(uint64_t address, uint64_t size) {
+    uint64_t samples = 0;
+    auto last = instructionSamples.lower_bound(address + size);
+    for (auto it = instructionSamples.lower_bound(address); it != last; ++it)
+        samples += it->second;
+    return samples;
+}
+
+void Profiler::PrintDisassembly(const std::string& function, std::ostream& out) {
+    std::vector<DisassembledFunction> copies;
+    if (disassembler)
+        copies = disassembler(function);
+    if (copies.empty())
+    {
+        out << "No code for function " << function << "\n";
+        return;
+    }
+
+    // Source files, split in lines.
+    std::map<std::string, std::vector<std::string>> sources;
+    auto getSourceLine = [&sources](const std::string& file, uint32_t line) -> std::string
+    {
+        auto it = sources.find(file);
+        if (it == sources.end())
+        {
+            it = sources.insert(std::make_pair(file, std::vector<std::string>())).first;
+            std::ifstream source(file);
+            std::string text;
+            while (std::getline(source, text))
+                it->second.push_back(text);
+        }
+        return line > 0 && line <= it->second.size() ? it->second[line - 1] : "";
+    };
+
+    for (auto& copy : copies)
+    {
+        uint64_t copySamples = 0;
+        for (auto& instruction : copy.instructions)
+            copySamples += GetSamplesInRange(instruction.address, instruction.size);
+
+        out << copy.symbol << " (" << copy.kind << ") at 0x" << std::hex << copy.address << std::dec << ", "
+            << copy.instructions.size() << " instructions, " << copySamples << " samples\n";
+
+        std::string file;
+        uint32_t line = 0;
+        for (auto& instruction : copy.instructions)
+        {
+            if (instruction.line != 0 && (instruction.line != line || instruction.file != file))
+            {
+                file = instruction.file;
+                line = instruction.line;
+                std::string text = getSourceLine(file, line);
+                trim(text);
+                out << "                  " << file.substr(file.find_last_of('/') + 1) << ":" << line << "\t" << text << "\n";
+            }
+
+            uint64_t samples = GetSamplesInRange(instruction.address, instruction.size);
+            if (samples > 0)
+                out << std::fixed << std::setprecision(1) << std::setw(6) << 100.0 * samples / copySamples << "% "
+                    << std::setw(6) << samples << "  ";
+            else
+                out << std::string(16, ' ');
+            out << std::hex << std::setw(12) << instruction.address << std::dec << ":" << instruction.text << "\n";
+        }
+        out << "\n";
+    }
+}
+
+bool Profiler::HandleCommand(const std::vector<std::string>& tokens) {
+    if (!tokens.empty() && tokens[0] == "disasm")
+    {
+        if (tokens.size() != 2)
+            std::cout << "Command 'disasm' requires one argument (function to disassemble)\n";
+        else
+            PrintDisassembly(tokens[1], std::cout);
+        return true;
+    }
+
+    if (tokens.empty() || tokens[0] != "profile")
+        return false;
+
+    const std::string& command = tokens.size() > 1 ? tokens[1] : "";
+    if (command == "start" && tokens.size() == 2)
+    {
+        if (Start())
+            std::cout << "Profiling started\n";
+    }
+    else if (command == "stop" && tokens.size() == 2)
+    {
+        if (!running)
+        {
+            std::cout << "The profiler is not running\n";
+        }
+        else
+        {
+            Stop();
+            std::cout << "Profiling stopped, " << totalSamples << " samples\n";
+        }
+    }
+    else if (command == "report" && tokens.size() <= 3)
+    {
+        if (running)
+        {
+            Stop();
+            std::cout << "Profiling stopped\n";
+        }
+
+        if (tokens.size() == 3)
+        {
+            if (WriteFoldedStacks(tokens[2]))
+                std::cout << "Folded stacks written to " << tokens[2] << " (render them with flamegraph.pl)\n";
+        }
+        else
+        {
+            Report(std::cout);
+        }
+    }
+    else
+    {
+        std::cout << "Usage: profile start|stop|report [folded stacks file]\n";
+    }
+
+    return true;
+}
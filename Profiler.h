@@ -0,0 +1,83 @@
+#pragma once
+#include "Disassembler.h"
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Sampling profiler for the program running in the JIT.
+//
+// While the profiler runs, an ITIMER_PROF timer sends SIGPROF to the process at the frequency
+// set by the "profile_frequency" option (in Hz, default: 1000; the kernel may deliver them at
+// a coarser granularity). The handler walks the stack of the interrupted thread through its
+// frame pointers and appends the return addresses to a buffer of "profile_buffer_mb" MB
+// (default: 64). Samples that don't fit are dropped.
+//
+// The JIT keeps frame pointers in the functions it compiles only if the "profile_frame_pointers"
+// option is set to 1. The option takes effect when code is compiled, not when the profiler
+// starts: without it, stacks end at the first JIT'd frame that doesn't keep its frame pointer,
+// and often hold only the function that was interrupted. Addresses are only resolved when the profiler stops, so the handler never
+// takes locks.
+//
+// The buffer is shared memory, so iterations that run from a built-in checkpoint (see
+// Checkpoint.h) are sampled too, whether they run in a forked child or on a snapshot.
+//
+// Addresses are resolved by the symbolizer set by the host, which knows the functions emitted
+// by the JIT (including their optimized and instrumented copies), then with dladdr.
+//
+// "disasm <function>" shows the code of every copy of a function, provided by the host, with
+// its source lines and the share of the samples of the last profile taken at each instruction.
+class Profiler {
+public:
+    // Sets name to the function containing the address. Returns false if it is not JIT'd code.
+    using Symbolizer = std::function<bool(uint64_t address, std::string& name)>;
+    static void SetSymbolizer(Symbolizer symbolizer);
+    using Disassembler = std::function<std::vector<DisassembledFunction>(const std::string& function)>;
+    static void SetDisassembler(Disassembler disassembler);
+
+    static bool Start();
+    // Resolves the samples taken since Start().
+    static void Stop();
+    static bool IsRunning() { return running; }
+
+    // Timers are not inherited by forked children: restarts sampling in a checkpoint child.
+    static void EnterCheckpointChild();
+
+    // Functions with the most samples in the last profile.
+    static void Report(std::ostream& out, size_t maxFunctions = 20);
+    // One line per distinct stack, "root;...;leaf count", as expected by flamegraph.pl.
+    static bool WriteFoldedStacks(const std::string& path);
+    static void PrintDisassembly(const std::string& function, std::ostream& out);
+
+    // Raw samples of the last profile: at each instruction, and at each call as
+    // (call site, address in the callee) for every pair of adjacent frames.
+    static const std::map<uint64_t, uint64_t>& GetInstructionSamples() { return instructionSamples; }
+    static const std::map<std::pair<uint64_t, uint64_t>, uint64_t>& GetCallSamples() { return callSamples; }
+
+    // profile start|stop|report [file], disasm <function>.
+    // Returns false if the command is not a profiler command.
+    static bool HandleCommand(const std::vector<std::string>& tokens);
+
+    static std::string Demangle(const std::string& name);
+
+private:
+    static std::string Symbolize(uint64_t address);
+    static uint64_t GetSamplesInRange(uint64_t address, uint64_t size);
+
+    static Symbolizer symbolizer;
+    static Disassembler disassembler;
+    static bool running;
+
+    // Results of the last profile.
+    static uint64_t totalSamples;
+    static uint64_t droppedSamples;
+    static std::map<std::string, uint64_t> foldedStacks;
+    // Samples in which each function is the leaf (self) or anywhere in the stack (total).
+    static std::map<std::string, uint64_t> selfSamples;
+    static std::map<std::string, uint64_t> totalSamplesPerFunction;
+    // Samples taken at each instruction.
+    static std::map<uint64_t, uint64_t> instructionSamples;
+    static std::map<std::pair<uint64_t, uint64_t>, uint64_t> callSamples;
+};
@@ -0,0 +1,690 @@
+#include "Snapshot.h"
+#include "Checkpoint.h"
+#include "Options.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <vector>
+
+struct TrackedRegion {
+    uintptr_t start;
+    uintptr_t end;
+    int protection;
+};
+
+static const size_t MaxRegions = 16384;
+static const size_t MaxStackSize = 8 << 20;
+static const size_t CopierStackSize = 256 << 10;
+static const size_t MaxResultSize = 1 << 20;
+static const size_t TaskBufferSize = 64 << 10;
+
+// Lives in the engine's own mapping, like everything it points to.
+struct SnapshotState {
+    ucontext_t saveContext;
+    ucontext_t copierContext;
+    volatile bool active;
+    volatile bool restoring;
+    volatile int lock;
+
+    size_t numRegions;
+    TrackedRegion regions[MaxRegions];
+
+    uintptr_t stackLow;
+    uintptr_t stackHigh;
+
+    // Pages saved since the snapshot, in pool order, and an open-addressing set of them.
+    size_t numSaved;
+    uintptr_t* savedPages;
+    uintptr_t* savedSet;
+    size_t savedSetSize;
+
+    // Pages saved before the last restore, which are saved again right after the next snapshot.
+    size_t numPrefault;
+    uintptr_t* prefaultPages;
+
+    char* pool;
+    size_t poolPages;
+    char* stackCopy;
+    char* copierStack;
+
+    size_t resultSize;
+    char* result;
+
+    // Other threads are stopped in StopHandler while the snapshot is saved and restored, until
+    // the last stop request is released. These are not rolled back by the restore.
+    volatile uint64_t stopsRequested;
+    volatile uint64_t stopsReleased;
+    volatile size_t threadsStopped;
+    char* taskBuffer;
+};
+
+static SnapshotState* state = nullptr;
+static uintptr_t engineStart = 0;
+static uintptr_t engineEnd = 0;
+static size_t pageSize = 0;
+static struct sigaction previousSegvAction;
+
+static void WriteError(const char* message) {
+    // Async-signal-safe.
+    ssize_t ignored = write(STDERR_FILENO, message, strlen(message));
+    (void)ignored;
+}
+
+static int StopSignal() {
+    return SIGRTMIN + 2;
+}
+
+static const TrackedRegion* FindRegion(uintptr_t address) {
+    size_t low = 0;
+    size_t high = state->numRegions;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        const TrackedRegion& region = state->regions[middle];
+        if (address < region.start)
+            high = middle;
+        else if (address >= region.end)
+            low = middle + 1;
+        else
+            return &region;
+    }
+    return nullptr;
+}
+
+static size_t HashPage(uintptr_t page) {
+    return (size_t)((page / pageSize) * 0x9E3779B97F4A7C15ull) & (state->savedSetSize - 1);
+}
+
+// Returns false if the page was already in the set.
+static bool InsertSavedPage(uintptr_t page) {
+    size_t slot = HashPage(page);
+    while (state->savedSet[slot] != 0)
+    {
+        if (state->savedSet[slot] == page)
+            return false;
+        slot = (slot + 1) & (state->savedSetSize - 1);
+    }
+    state->savedSet[slot] = page;
+    return true;
+}
+
+// Writes to the page without changing it, so that a protected page is saved by the fault handler.
+static void TouchPage(uintptr_t page) {
+    __atomic_fetch_or((volatile char*)page, 0, __ATOMIC_RELAXED);
+}
+
+static void StopHandler(int signo, siginfo_t* info, void* context) {
+    int savedErrno = errno;
+    uint64_t request = __atomic_load_n(&state->stopsRequested, __ATOMIC_ACQUIRE);
+
+    // Nothing to do for a signal delivered after its stop has been released.
+    if (__atomic_load_n(&state->stopsReleased, __ATOMIC_ACQUIRE) < request)
+    {
+        __atomic_add_fetch(&state->threadsStopped, 1, __ATOMIC_ACQ_REL);
+        while (__atomic_load_n(&state->stopsReleased, __ATOMIC_ACQUIRE) < request)
+            sched_yield();
+    }
+    errno = savedErrno;
+}
+
+// Stops every other thread in StopHandler, like FunctionPatcher does. It runs on the engine's
+// stack during the restore, so it doesn't allocate. Returns the number of threads that didn't stop.
+static size_t StopOtherThreads() {
+    pid_t process = getpid();
+    pid_t self = (pid_t)syscall(SYS_gettid);
+    __atomic_store_n(&state->threadsStopped, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&state->stopsRequested, 1, __ATOMIC_ACQ_REL);
+
+    size_t signaled = 0;
+    int tasks = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (tasks >= 0)
+    {
+        long bytes;
+        while ((bytes = syscall(SYS_getdents64, tasks, state->taskBuffer, TaskBufferSize)) > 0)
+        {
+            for (long offset = 0; offset < bytes;)
+            {
+                struct dirent64* task = (struct dirent64*)(state->taskBuffer + offset);
+                pid_t thread = (pid_t)atoi(task->d_name);
+                if (thread > 0 && thread != self && syscall(SYS_tgkill, process, thread, StopSignal()) == 0)
+                    signaled++;
+                offset += task->d_reclen;
+            }
+        }
+        close(tasks);
+    }
+
+    timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t stopped;
+    while ((stopped = __atomic_load_n(&state->threadsStopped, __ATOMIC_ACQUIRE)) < signaled)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - start.tv_sec > 1)
+            break;
+        sched_yield();
+    }
+    return signaled - std::min(stopped, signaled);
+}
+
+static void ResumeOtherThreads() {
+    __atomic_store_n(&state->stopsReleased, __atomic_load_n(&state->stopsRequested, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+static void SegvHandler(int signo, siginfo_t* info, void* context) {
+    uintptr_t address = (uintptr_t)info->si_addr;
+    const TrackedRegion* region = (state && state->active && info->si_code == SEGV_ACCERR) ? FindRegion(address) : nullptr;
+
+    if (region)
+    {
+        uintptr_t page = address & ~(uintptr_t)(pageSize - 1);
+        while (__atomic_exchange_n(&state->lock, 1, __ATOMIC_ACQUIRE))
+            ;
+
+        // Another thread may have saved the page in the meantime.
+        if (InsertSavedPage(page))
+        {
+            if (state->numSaved == state->poolPages)
+            {
+                WriteError("Snapshot page pool exhausted, increase snapshot_pool_mb\n");
+                _exit(-1);
+            }
+
+            memcpy(state->pool + state->numSaved * pageSize, (void*)page, pageSize);
+            state->savedPages[state->numSaved++] = page;
+            mprotect((void*)page, pageSize, region->protection);
+        }
+
+        __atomic_store_n(&state->lock, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Not ours.
+    if (previousSegvAction.sa_flags & SA_SIGINFO)
+    {
+        previousSegvAction.sa_sigaction(signo, info, context);
+    }
+    else if (previousSegvAction.sa_handler != SIG_DFL && previousSegvAction.sa_handler != SIG_IGN)
+    {
+        previousSegvAction.sa_handler(signo);
+    }
+    else
+    {
+        // The faulting instruction runs again and gets the default action.
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+static bool Initialize() {
+    if (state)
+        return true;
+
+    pageSize = sysconf(_SC_PAGESIZE);
+
+    size_t poolMB = 512;
+    std::string poolOption = OptionsStore::GetOption("snapshot_pool_mb");
+    if (poolOption != "")
+        poolMB = std::atoi(poolOption.c_str());
+
+    size_t poolPages = (poolMB << 20) / pageSize;
+    size_t savedSetSize = 1;
+    while (savedSetSize < 2 * poolPages)
+        savedSetSize <<= 1;
+
+    auto pageAlign = [](size_t size) { return (size + pageSize - 1) & ~(pageSize - 1); };
+    size_t stateSize = pageAlign(sizeof(SnapshotState));
+    size_t savedPagesSize = pageAlign(poolPages * sizeof(uintptr_t));
+    size_t savedSetBytes = pageAlign(savedSetSize * sizeof(uintptr_t));
+    size_t totalSize = stateSize + 2 * savedPagesSize + savedSetBytes + MaxStackSize + CopierStackSize + MaxResultSize + TaskBufferSize +
+        poolPages * pageSize;
+
+    // Only the pages that are used take memory.
+    void* memory = mmap(nullptr, totalSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Cannot allocate memory for snapshots: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    engineStart = (uintptr_t)memory;
+    engineEnd = engineStart + totalSize;
+
+    char* next = (char*)memory;
+    SnapshotState* newState = (SnapshotState*)next;
+    next += stateSize;
+    newState->savedPages = (uintptr_t*)next;
+    next += savedPagesSize;
+    newState->prefaultPages = (uintptr_t*)next;
+    next += savedPagesSize;
+    newState->savedSet = (uintptr_t*)next;
+    newState->savedSetSize = savedSetSize;
+    next += savedSetBytes;
+    newState->stackCopy = next;
+    next += MaxStackSize;
+    newState->copierStack = next;
+    next += CopierStackSize;
+    newState->result = next;
+    next += MaxResultSize;
+    newState->taskBuffer = next;
+    next += TaskBufferSize;
+    newState->pool = next;
+    newState->poolPages = poolPages;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = SegvHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    // A thread must not be stopped while it holds the lock of the fault handler.
+    sigaddset(&action.sa_mask, StopSignal());
+    if (sigaction(SIGSEGV, &action, &previousSegvAction) != 0)
+    {
+        std::cerr << "Cannot install SIGSEGV handler for snapshots\n";
+        munmap(memory, totalSize);
+        return false;
+    }
+
+    action.sa_sigaction = StopHandler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(StopSignal(), &action, nullptr) != 0)
+    {
+        std::cerr << "Cannot install the handler that stops threads for snapshots\n";
+        sigaction(SIGSEGV, &previousSegvAction, nullptr);
+        munmap(memory, totalSize);
+        return false;
+    }
+
+    // Lazy binding writes to the GOT, which is tracked: the functions used by the fault
+    // handler and by the restore are resolved now, while a fault in the handler is still fine.
+    memcpy(newState->pool, newState->stackCopy, pageSize);
+    mprotect(newState->pool, pageSize, PROT_READ | PROT_WRITE);
+    WriteError("");
+
+    state = newState;
+    return true;
+}
+
+// glibc registers a restartable sequences area in the thread descriptor, which the kernel
+// writes on every return to user space: a signal can't be delivered if it is read-only.
+extern "C" const ptrdiff_t __rseq_offset __attribute__((weak));
+
+// Private writable mappings, except the engine's own memory, the stacks of threads, the rseq
+// area of the thread and hugetlb mappings.
+static bool CollectRegions(uintptr_t stackStart, uintptr_t stackEnd) {
+    uintptr_t rseqStart = 0;
+    uintptr_t rseqEnd = 0;
+    if (&__rseq_offset)
+    {
+        // On x86-64, pthread_self() is the thread pointer.
+        uintptr_t rseq = (uintptr_t)pthread_self() + __rseq_offset;
+        rseqStart = rseq & ~(uintptr_t)(pageSize - 1);
+        rseqEnd = (rseq + 32 + pageSize - 1) & ~(uintptr_t)(pageSize - 1);
+    }
+
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    std::vector<TrackedRegion> regions;
+    uintptr_t previousEnd = 0;
+    bool previousIsGuard = false;
+
+    while (std::getline(maps, line))
+    {
+        std::istringstream fields(line);
+        std::string range, permissions, offset, device, inode, path;
+        fields >> range >> permissions >> offset >> device >> inode;
+        std::getline(fields, path);
+
+        size_t dash = range.find('-');
+        uintptr_t start = std::strtoull(range.substr(0, dash).c_str(), nullptr, 16);
+        uintptr_t end = std::strtoull(range.substr(dash + 1).c_str(), nullptr, 16);
+        bool anonymous = inode == "0" && path.find_first_not_of(' ') == std::string::npos;
+
+        // glibc puts a small PROT_NONE guard right below thread stacks.
+        bool afterGuard = previousIsGuard && previousEnd == start;
+        previousIsGuard = anonymous && permissions == "---p" && end - start <= 16 * pageSize;
+        previousEnd = end;
+
+        if (permissions[1] != 'w' || permissions[3] != 'p')
+            continue;
+        if (end > engineStart && start < engineEnd)
+            continue;
+        if (end > stackStart && start < stackEnd)
+            continue;
+        if (anonymous && afterGuard)
+            continue;
+
+        // Pages of hugetlb mappings (e.g. JIT memory with huge_pages=hugetlb) can't be protected
+        // one by one: mprotect fails with EINVAL.
+        if (path.find("/anon_hugepage") != std::string::npos)
+        {
+            static bool warned = false;
+            if (!warned)
+                std::cerr << "Memory in hugetlb pages is not restored by snapshots\n";
+            warned = true;
+            continue;
+        }
+
+        int protection = PROT_READ | PROT_WRITE | (permissions[2] == 'x' ? PROT_EXEC : 0);
+        if (end > rseqStart && start < rseqEnd)
+        {
+            if (start < rseqStart)
+                regions.push_back(TrackedRegion{ start, rseqStart, protection });
+            if (rseqEnd < end)
+                regions.push_back(TrackedRegion{ rseqEnd, end, protection });
+            continue;
+        }
+
+        regions.push_back(TrackedRegion{ start, end, protection });
+    }
+
+    if (regions.size() > MaxRegions)
+    {
+        std::cerr << "Too many memory mappings for a snapshot\n";
+        return false;
+    }
+
+    state->numRegions = regions.size();
+    std::copy(regions.begin(), regions.end(), state->regions);
+    return true;
+}
+
+static bool GetStackBounds(uintptr_t& start, uintptr_t& end) {
+    pthread_attr_t attributes;
+    if (pthread_getattr_np(pthread_self(), &attributes) != 0)
+        return false;
+
+    void* address;
+    size_t size;
+    pthread_attr_getstack(&attributes, &address, &size);
+    pthread_attr_destroy(&attributes);
+
+    start = (uintptr_t)address;
+    end = start + size;
+    return true;
+}
+
+// Runs on the engine's stack, since the stack of the snapshot is overwritten.
+static void RestoreMemory() {
+    // Other threads are let go once execution is back in Save().
+    size_t threadsNotStopped = StopOtherThreads();
+
+    bool remapped = false;
+    for (size_t i = 0; i < state->numRegions; ++i)
+    {
+        const TrackedRegion& region = state->regions[i];
+        if (mprotect((void*)region.start, region.end - region.start, region.protection) == 0)
+            continue;
+
+        // Part of the region has been unmapped: map it again, page by page.
+        for (uintptr_t page = region.start; page < region.end; page += pageSize)
+        {
+            if (mprotect((void*)page, pageSize, region.protection) != 0)
+            {
+                mmap((void*)page, pageSize, region.protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+                remapped = true;
+            }
+        }
+    }
+    state->active = false;
+
+    memcpy(state->prefaultPages, state->savedPages, state->numSaved * sizeof(uintptr_t));
+    state->numPrefault = state->numSaved;
+    for (size_t i = 0; i < state->numSaved; ++i)
+    {
+        uintptr_t page = state->savedPages[i];
+        memcpy((void*)page, state->pool + i * pageSize, pageSize);
+
+        // Clearing only the used slots is cheaper than clearing the whole set.
+        size_t slot = HashPage(page);
+        while (state->savedSet[slot] != 0)
+        {
+            state->savedSet[slot] = 0;
+            slot = (slot + 1) & (state->savedSetSize - 1);
+        }
+    }
+    state->numSaved = 0;
+
+    memcpy((void*)state->stackLow, state->stackCopy, state->stackHigh - state->stackLow);
+
+    if (remapped)
+        WriteError("Memory unmapped after the snapshot has been mapped again, but not fully restored\n");
+    if (threadsNotStopped > 0)
+        WriteError("WARNING: some threads could not be stopped while the snapshot was restored\n");
+
+    state->restoring = true;
+    setcontext(&state->saveContext);
+}
+
+int SnapshotCheckpoint::Save() {
+    if (!Initialize())
+        return CheckpointInPlace;
+
+    if (state->active)
+    {
+        std::cerr << "Nested checkpoints are not supported\n";
+        return CheckpointInPlace;
+    }
+
+    uintptr_t stackStart, stackEnd;
+    if (!GetStackBounds(stackStart, stackEnd) || !CollectRegions(stackStart, stackEnd))
+        return CheckpointInPlace;
+
+    // Other threads must neither write memory while it is being protected nor run into it
+    // half-way through. They are also stopped by the restore, and let go once it is complete.
+    size_t threadsNotStopped = StopOtherThreads();
+
+    state->restoring = false;
+    state->stackHigh = stackEnd;
+    getcontext(&state->saveContext);
+
+    // Execution comes back here from RestoreMemory(), with the stack as it is copied below.
+    if (state->restoring)
+    {
+        state->restoring = false;
+        ResumeOtherThreads();
+        return CheckpointRestored;
+    }
+
+#if defined(__x86_64__)
+    // Including the red zone below the stack pointer.
+    state->stackLow = (uintptr_t)state->saveContext.uc_mcontext.gregs[REG_RSP] - 128;
+#else
+    state->stackLow = (uintptr_t)__builtin_frame_address(0) - 4096;
+#endif
+    if (state->stackHigh - state->stackLow > MaxStackSize)
+    {
+        ResumeOtherThreads();
+        std::cerr << "The stack is too large for a snapshot\n";
+        return CheckpointInPlace;
+    }
+    memcpy(state->stackCopy, (void*)state->stackLow, state->stackHigh - state->stackLow);
+
+    // Tracking starts before the first region is protected, since anything (e.g. lazy binding)
+    // may write to protected memory from here on.
+    state->resultSize = 0;
+    state->active = true;
+    for (size_t i = 0; i < state->numRegions; ++i)
+    {
+        const TrackedRegion& region = state->regions[i];
+        mprotect((void*)region.start, region.end - region.start, region.protection & ~PROT_WRITE);
+    }
+
+    // Code running from a snapshot usually writes the same pages every time: taking their faults
+    // now keeps them out of whatever it measures. Only the first run pays for them.
+    for (size_t i = 0; i < state->numPrefault; ++i)
+    {
+        uintptr_t page = state->prefaultPages[i];
+        if (FindRegion(page))
+            TouchPage(page);
+    }
+
+    ResumeOtherThreads();
+    if (threadsNotStopped > 0)
+        std::cerr << "WARNING: " << threadsNotStopped << " threads could not be stopped while the snapshot was saved\n";
+
+    return CheckpointInChild;
+}
+
+int SnapshotCheckpoint::Restore() {
+    if (!state || !state->active)
+        return 0;
+    // Tracking goes on until every region is writable again: pages written in the meantime
+    // are restored as well.
+    getcontext(&state->copierContext);
+    state->copierContext.uc_stack.ss_sp = state->copierStack;
+    state->copierContext.uc_stack.ss_size = CopierStackSize;
+    state->copierContext.uc_link = nullptr;
+    makecontext(&state->copierContext, RestoreMemory, 0);
+    setcontext(&state->copierContext);
+
+    // Not reached.
+    return 0;
+}
+
+void SnapshotCheckpoint::SetResult(const std::string& result) {
+    if (!state)
+        return;
+
+    state->resultSize = std::min(result.size(), MaxResultSize);
+    memcpy(state->result, result.data(), state->resultSize);
+}
+
+bool SnapshotCheckpoint::GetResult(std::string& result) {
+    if (!state)
+        return false;
+
+    result.assign(state->result, state->resultSize);
+    return state->resultSize > 0;
+}
+
+void SnapshotCheckpoint::PrepareWrite(void* address, size_t size) {
+    if (!state || !state->active || size == 0)
+        return;
+
+    uintptr_t end = (uintptr_t)address + size;
+    for (uintptr_t page = (uintptr_t)address & ~(uintptr_t)(pageSize - 1); page < end; page += pageSize)
+    {
+        if (FindRegion(page))
+            TouchPage(page);
+    }
+}
+
+// The buffer of a stream is filled by read(2) when it runs out.
+static void PrepareStream(FILE* stream) {
+    if (stream && stream->_IO_buf_base)
+        SnapshotCheckpoint::PrepareWrite(stream->_IO_buf_base, stream->_IO_buf_end - stream->_IO_buf_base);
+}
+
+static ssize_t SnapshotRead(int fd, void* buffer, size_t count) {
+    SnapshotCheckpoint::PrepareWrite(buffer, count);
+    return read(fd, buffer, count);
+}
+
+static ssize_t SnapshotPread(int fd, void* buffer, size_t count, off_t offset) {
+    SnapshotCheckpoint::PrepareWrite(buffer, count);
+    return pread(fd, buffer, count, offset);
+}
+
+static ssize_t SnapshotRecv(int socket, void* buffer, size_t length, int flags) {
+    SnapshotCheckpoint::PrepareWrite(buffer, length);
+    return recv(socket, buffer, length, flags);
+}
+
+static ssize_t SnapshotRecvfrom(int socket, void* buffer, size_t length, int flags, sockaddr* address, socklen_t* addressLength) {
+    SnapshotCheckpoint::PrepareWrite(buffer, length);
+    if (address && addressLength)
+    {
+        SnapshotCheckpoint::PrepareWrite(addressLength, sizeof(socklen_t));
+        SnapshotCheckpoint::PrepareWrite(address, *addressLength);
+    }
+    return recvfrom(socket, buffer, length, flags, address, addressLength);
+}
+
+static size_t SnapshotFread(void* buffer, size_t size, size_t count, FILE* stream) {
+    // Large reads go straight to the buffer of the caller.
+    SnapshotCheckpoint::PrepareWrite(buffer, size * count);
+    PrepareStream(stream);
+    return fread(buffer, size, count, stream);
+}
+
+static char* SnapshotFgets(char* buffer, int size, FILE* stream) {
+    PrepareStream(stream);
+    return fgets(buffer, size, stream);
+}
+
+static int SnapshotFgetc(FILE* stream) {
+    PrepareStream(stream);
+    return fgetc(stream);
+}
+
+static int SnapshotGetchar() {
+    PrepareStream(stdin);
+    return getchar();
+}
+
+static ssize_t SnapshotGetline(char** line, size_t* size, FILE* stream) {
+    PrepareStream(stream);
+    return getline(line, size, stream);
+}
+
+static int SnapshotFscanf(FILE* stream, const char* format, ...) {
+    PrepareStream(stream);
+    va_list arguments;
+    va_start(arguments, format);
+    int result = vfscanf(stream, format, arguments);
+    va_end(arguments);
+    return result;
+}
+
+static int SnapshotScanf(const char* format, ...) {
+    PrepareStream(stdin);
+    va_list arguments;
+    va_start(arguments, format);
+    int result = vscanf(format, arguments);
+    va_end(arguments);
+    return result;
+}
+
+void* SnapshotCheckpoint::GetSystemCallWrapper(const std::string& name) {
+    static const std::pair<const char*, void*> wrappers[] = {
+        { "read", (void*)&SnapshotRead },
+        { "pread", (void*)&SnapshotPread },
+        { "pread64", (void*)&SnapshotPread },
+        { "recv", (void*)&SnapshotRecv },
+        { "recvfrom", (void*)&SnapshotRecvfrom },
+        { "fread", (void*)&SnapshotFread },
+        { "fgets", (void*)&SnapshotFgets },
+        { "fgetc", (void*)&SnapshotFgetc },
+        { "getc", (void*)&SnapshotFgetc },
+        { "_IO_getc", (void*)&SnapshotFgetc },
+        { "getchar", (void*)&SnapshotGetchar },
+        { "getline", (void*)&SnapshotGetline },
+        { "fscanf", (void*)&SnapshotFscanf },
+        { "__isoc99_fscanf", (void*)&SnapshotFscanf },
+        { "scanf", (void*)&SnapshotScanf },
+        { "__isoc99_scanf", (void*)&SnapshotScanf },
+    };
+
+    for (auto& wrapper : wrappers)
+    {
+        if (name == wrapper.first)
+            return wrapper.second;
+    }
+    return nullptr;
+}
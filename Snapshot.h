@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// In-process checkpoints, restored by rolling back only the memory written since the checkpoint.
+//
+// Saving a snapshot makes every private writable mapping read-only. The first write to a page
+// faults, and the SIGSEGV handler copies the page to a preallocated pool before making it
+// writable again. Restoring copies the saved pages back, together with the stack of the thread
+// that took the snapshot, and resumes execution where the snapshot was saved (like longjmp), so
+// the cost is proportional to the memory the code touched. Everything the engine needs while
+// memory is tracked lives in its own mapping, which is never tracked.
+//
+// The pages written from the previous snapshot are saved right after the next one is taken, so
+// that code running from the snapshot repeatedly (e.g. timed iterations) doesn't pay for their
+// faults after the first time.
+//
+// Other threads are stopped (in a SIGRTMIN + 2 handler) while the snapshot is saved and while it
+// is restored, so that none of them runs into memory that is only partly protected or restored.
+// They run in between: their stacks are not tracked (they are recognized by their guard page),
+// but the rest of the memory they write is rolled back with everything else.
+//
+// System calls that write into a protected page fail with EFAULT, since the kernel doesn't go
+// through the fault handler. JIT'd code calls the library functions that usually do (read, recv,
+// fread, fgets, scanf...) through wrappers that write to the pages of their buffers, and to the
+// buffer of their stream, first (see GetSystemCallWrapper).
+//
+// Limitations:
+// - Other system calls that write into memory untouched since the snapshot still fail with
+//   EFAULT, e.g. when called from libraries, or when a thread was blocked in one while the
+//   snapshot was saved.
+// - Threads that block SIGRTMIN + 2 can't be stopped: after a second, the engine goes on
+//   without them, with a warning.
+// - Mappings of hugetlb pages are not tracked, since their pages can't be protected one by one:
+//   their memory is not restored.
+// - Memory mapped after the snapshot is left as is; memory unmapped after it is mapped again,
+//   but only the pages written after the snapshot are restored.
+// - Kernel state (file descriptors, file offsets...) is not restored, nor is the page of the
+//   thread descriptor that holds the rseq area, which the kernel writes to.
+//
+// The "snapshot_pool_mb" option sets the maximum amount of memory written between a snapshot
+// and its restore (default: 512).
+class SnapshotCheckpoint {
+public:
+    // Returns CheckpointInChild after saving the snapshot, CheckpointRestored when execution
+    // resumes here after Restore(), CheckpointInPlace if the snapshot could not be taken.
+    static int Save();
+    // Doesn't return if a snapshot is active.
+    static int Restore();
+
+    // Data kept across the restore.
+    static void SetResult(const std::string& result);
+    static bool GetResult(std::string& result);
+
+    // Makes [address, address + size) writable by the kernel while a snapshot is active, by
+    // writing to every protected page in it first.
+    static void PrepareWrite(void* address, size_t size);
+    // Wrapper of a library function that has the kernel write into memory, which calls
+    // PrepareWrite on that memory before the function, or nullptr.
+    static void* GetSystemCallWrapper(const std::string& name);
+};
@@ -1,5 +1,9 @@
 
+#include "Benchmark.h"
+#include "Checkpoint.h"
 #include "Interactive.h"
+#include "PerfCounters.h"
+#include "Profiler.h"
 
 
 
@@ -51,26 +55,77 @@ extern "C" {
             }
             else if (singleCmd == "run" || singleCmd == "r")
             {
-                if (command.size() > 1) {
-                    runN = std::atoi(command[1].c_str());
-                    if (runN == 0) {
+                // run [N] times N iterations; run ci X [N] runs until the confidence
+                // interval of the mean is within X% of it (at most N iterations).
+                double targetCI = 0;
+                size_t countIndex = 1;
+                if (command.size() > 1 && command[1] == "ci") {
+                    targetCI = command.size() > 2 ? std::atof(command[2].c_str()) : 0;
+                    if (targetCI <= 0) {
                         notRecognized = true;
                     }
+                    runN = 100000;
+                    countIndex = 3;
                 }
-                
-                for (size_t i = 0; i < runN; ++i) {
-                    if (checkpointEnabled)
-                    {                      
-                        saveCheckpoint();
-                        interactive_fake_call();
-                        restoreCheckpoint();
+
+                // Negative counts would become huge iteration counts.
+                bool invalidCount = false;
+                if (command.size() > countIndex) {
+                    long count = std::atol(command[countIndex].c_str());
+                    if (count < 1) {
+                        std::cout << "The number of iterations must be at least 1\n";
+                        invalidCount = true;
                     }
-                    else
-                    {
+                    else {
+                        runN = count;
+                    }
+                }
+
+                if (!notRecognized && !invalidCount) {
+                    BenchmarkSession benchmark(runN, targetCI);
+                    // Warmup runs in place, before the first checkpoint: in a forked child, it would only warm
+                    // the child. Its effects on the program's state are kept, so timed iterations start from there.
+                    for (size_t i = 0; i < benchmark.GetWarmupIterations(); ++i)
+                        interactive_fake_call();
+
+                    // Checkpoints are taken and restored outside of the timed region.
+                    while (benchmark.NeedsMoreSamples()) {
+                        int checkpoint = checkpointEnabled ? saveCheckpoint() : CheckpointInPlace;
+                        if (checkpoint == CheckpointRestored)
+                        {
+                            // The iteration ran from the checkpoint, which passed its sample back.
+                            if (!benchmark.ReceiveSampleFromChild())
+                                break;
+                            continue;
+                        }
+
+                        if (checkpoint == CheckpointInChild)
+                            benchmark.EnterCheckpointChild();
+
+                        benchmark.StartCounters();
+                        uint64_t start = benchmark.Now();
                         interactive_fake_call();
+                        uint64_t end = benchmark.Now();
+                        benchmark.StopCounters();
+                        benchmark.AddSample(end - start);
+
+                        if (checkpoint == CheckpointInChild)
+                            benchmark.SendSampleToParent();
+                        if (checkpointEnabled)
+                            restoreCheckpoint();
                     }
+
+                    benchmark.Report(std::cout);
                 }
             }
+            else if (Profiler::HandleCommand(command))
+            {
+                // profile start|stop|report [file], disasm <function>.
+            }
+            else if (HandleHostCommand(command))
+            {
+                // break, unbreak, optimize layout, pgo <function>.
+            }
             else if (singleCmd == "continue" || singleCmd == "c")
             {
                 break;
@@ -84,6 +139,13 @@ extern "C" {
                         checkpointEnabled = true;
                         std::cout << "Checkpoint enabled\n";
                     }
+                    else if (secondCmd == "counters")
+                    {
+                        // enable counters [list], by default the most common ones.
+                        std::string counters = command.size() > 2 ? command[2] : "cycles,instructions,ipc,branch-misses,llc-misses";
+                        if (PerfCounters::Select(counters))
+                            std::cout << "Counters enabled: " << counters << "\n";
+                    }
                     else notRecognized = true;
                 }
                 else {
@@ -100,6 +162,11 @@ extern "C" {
                         checkpointEnabled = false;
                         std::cout << "Checkpoint disabled\n";
                     }
+                    else if (secondCmd == "counters")
+                    {
+                        PerfCounters::Deselect();
+                        std::cout << "Counters disabled\n";
+                    }
                     else notRecognized = true;
                 }
                 else {
@@ -1,8 +1,10 @@
+#include "Checkpoint.h"
 #include <iostream>
 
 extern "C" {
-    __attribute__((weak)) int saveCheckpoint() { return 0; }
-    __attribute__((weak)) int restoreCheckpoint() { return 0; }
+    // A checkpoint tool can provide its own implementation, otherwise the built-in ones are used.
+    __attribute__((weak)) int saveCheckpoint() { return Checkpoint::Save(); }
+    __attribute__((weak)) int restoreCheckpoint() { return Checkpoint::Restore(); }
 
     int fakeFunction(int x) {
         return (x) * 2;
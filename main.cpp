@@ -21,11 +21,21 @@
 
 #include <stdlib.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <cctype>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
 
 
 #include <JIT.h>
 #include "Interactive.h"
+#include "Profiler.h"
+#include "Checkpoint.h"
 
 using namespace clang;
 using namespace llvm;
@@ -68,6 +78,216 @@ void ParseLLVMOptions() {
 #endif
 }
 
+struct CompiledTranslationUnit {
+    std::unique_ptr<llvm::Module> module;
+    std::string diagnostics;
+};
+
+// Parses and lowers a single translation unit to LLVM IR. Every call owns its
+// diagnostics engine, compiler instance and LLVMContext, so different units can
+// be compiled concurrently. Diagnostics are buffered and returned with the module
+// to avoid interleaving the output of different threads.
+CompiledTranslationUnit CompileTranslationUnit(const std::string& name, const std::vector<const char*>& commonArgs) {
+    CompiledTranslationUnit unit;
+    llvm::raw_string_ostream diagnosticsStream(unit.diagnostics);
+
+    // Prepare compilation arguments
+    std::vector<const char*> args;
+    args.push_back(name.c_str());
+    args.insert(args.end(), commonArgs.begin(), commonArgs.end());
+
+    // Prepare DiagnosticEngine
+    IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+    TextDiagnosticPrinter* textDiagPrinter = new clang::TextDiagnosticPrinter(diagnosticsStream, DiagOpts.get());
+    IntrusiveRefCntPtr<clang::DiagnosticIDs> pDiagIDs;
+    DiagnosticsEngine diagnosticsEngine(pDiagIDs, DiagOpts, textDiagPrinter);
+
+    std::shared_ptr<CompilerInvocation> CI = std::make_shared<CompilerInvocation>();
+    CompilerInvocation::CreateFromArgs(*CI, &args[0], &args[0] + args.size(), diagnosticsEngine);
+
+    // Map code filename to a memoryBuffer
+    auto file = MemoryBuffer::getFile(name);
+    if (!file)
+    {
+        diagnosticsStream << "Error reading file " << name << "\n";
+        diagnosticsStream.flush();
+        return unit;
+    }
+
+    std::unique_ptr<MemoryBuffer> buffer = std::move(file.get());
+    CI->getPreprocessorOpts().addRemappedFile(name, buffer.get());
+
+    // Create and initialize CompilerInstance
+    CompilerInstance Clang;
+    Clang.setInvocation(CI);
+    Clang.createDiagnostics(new clang::TextDiagnosticPrinter(diagnosticsStream, &Clang.getDiagnosticOpts()), true);
+
+    const std::shared_ptr<clang::TargetOptions> targetOptions = std::make_shared<clang::TargetOptions>();
+    targetOptions->Triple = std::string("bpf");
+    TargetInfo* pTargetInfo = TargetInfo::CreateTargetInfo(diagnosticsEngine, targetOptions);
+    Clang.setTarget(pTargetInfo);
+
+    // Create and execute action. The action owns the LLVMContext of the module and
+    // is intentionally leaked, as the module has to outlive it.
+    CodeGenAction* compilerAction = new EmitLLVMOnlyAction();
+    //CodeGenAction *compilerAction = new EmitAssemblyAction();
+    if (Clang.ExecuteAction(*compilerAction))
+    {
+        unit.module = compilerAction->takeModule();
+    }
+
+    buffer.release();
+    diagnosticsStream.flush();
+
+    return unit;
+}
+
+// Set while the JIT'd main is executing.
+std::atomic<bool> programRunning{ false };
+
+// Handles the commands that change the instrumentation or the layout of the code, which are
+// accepted at the prompt, through the control channel and in the interactive cycle. Returns false
+// for any other command.
+bool HandleInstrumentationCommand(SurgeonJIT& JIT, const std::vector<std::string>& tokens) {
+    if (tokens[0] == "break" || (tokens[0].size() == 1 && tokens[0][0] == 'b'))
+    {
+        const std::string& function = tokens.size() > 1 ? tokens[1] : "";
+
+
+        if (tokens.size() < 3)
+        {
+            std::cout << "Command 'break' requires at least two arguments (function to instrument and tool name)\n";
+        }
+        else if (!JIT.findSymbol(function, false))
+        {
+            std::cout << "Function '" << function << "' doesn't exist\n";
+        }
+        else
+        {
+            bool toolsExist = true;
+            std::vector<std::string> tools{ tokens.begin() + 2, tokens.end() };
+            for (auto& tool : tools) {
+                if (!JIT.IsCSIToolRegistered(tool))
+                {
+                    std::cout << "Tool " << tool << " is not registered\n";
+                    toolsExist = false;
+                    break;
+                }
+            }
+            if (toolsExist) {
+                void* newAddr = JIT.RecompileFunction(function, true, tools);
+                //  std::cout << "Old addr: " << addr << ", new addr: " << newAddr << "\n";
+            }
+        }
+    }
+    else if (tokens[0] == "unbreak" || tokens[0] == "ub")
+    {
+        if (tokens.size() != 2)
+        {
+            std::cout << "Command 'unbreak' requires one argument (instrumented function)\n";
+        }
+        // The program may be running the instrumented code, so it is only unloaded once main returns.
+        else if (!JIT.RemoveInstrumentation(tokens[1], !programRunning))
+        {
+            std::cout << "Function " << tokens[1] << " is not instrumented\n";
+        }
+        else
+        {
+            std::cout << "Removed instrumentation from " << tokens[1] << "\n";
+        }
+    }
+    else if (tokens[0] == "optimize")
+    {
+        // optimize layout: re-emits the hot functions of the last profile together.
+        if (tokens.size() != 2 || tokens[1] != "layout")
+            std::cout << "Command 'optimize' requires one argument (layout)\n";
+        else
+            JIT.OptimizeLayout();
+    }
+    else if (tokens[0] == "pgo")
+    {
+        // pgo <function>: instruments the subtree of the function with profile counters, which the
+        // interactive cycle runs. The second time, recompiles the subtree with the profile.
+        const std::string& function = tokens.size() > 1 ? tokens[1] : "";
+
+        if (tokens.size() != 2)
+        {
+            std::cout << "Command 'pgo' requires one argument (function to optimize)\n";
+        }
+        else if (JIT.IsProfilingForPGO(function))
+        {
+            JIT.OptimizeWithProfile(function);
+        }
+        else if (!JIT.findSymbol(function, false))
+        {
+            std::cout << "Function '" << function << "' doesn't exist\n";
+        }
+        else if (JIT.InstrumentForPGO(function))
+        {
+            std::cout << "Profiling " << function << ": run it in the interactive cycle, then use 'pgo " << function << "' again\n";
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Held by the control channel while it handles input, and by the program while a checkpoint is active.
+std::mutex controlChannelMutex;
+
+// Reads commands from a FIFO, so that instrumentation can be changed while the program runs.
+// Recompilation happens on this thread; the program only pauses when the function is patched.
+void RunControlChannel(SurgeonJIT* JIT, std::string path) {
+    if (mkfifo(path.c_str(), 0600) != 0 && errno != EEXIST)
+    {
+        std::cerr << "Can't create control FIFO " << path << "\n";
+        return;
+    }
+
+    // Opening the FIFO for writing too means that reads never hit end-of-file
+    // when a writer goes away.
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        std::cerr << "Can't open control FIFO " << path << "\n";
+        return;
+    }
+
+    std::string pending;
+    char buffer[256];
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0 || (bytesRead < 0 && errno == EINTR))
+    {
+        if (bytesRead < 0)
+            continue;
+
+        // Commands wait until the checkpoint is restored, if one is active.
+        std::lock_guard<std::mutex> lock(controlChannelMutex);
+        pending.append(buffer, bytesRead);
+
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos)
+        {
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+
+            trim(line);
+            auto tokens = split(line, ' ', true);
+            if (tokens.size() == 0)
+                continue;
+
+            std::cout << "[control] " << line << "\n";
+            if (!HandleInstrumentationCommand(*JIT, tokens) && !Profiler::HandleCommand(tokens))
+                std::cout << "Command not recognized\n";
+        }
+    }
+
+    close(fd);
+}
+
 void sig_handler(int signo) {
     if (signo == SIGINT)
     {
@@ -108,6 +328,7 @@ int main(int argc, char** argv) {
     InitializeAllTargetMCs();
     InitializeAllAsmPrinters();
     InitializeAllAsmParsers();
+    InitializeAllDisassemblers();
     InitializeAllTargets();
 
     ParseLLVMOptions();
@@ -121,6 +342,21 @@ int main(int argc, char** argv) {
     OptionsStore::LoadOptions("surgeon.cfg");
 
     SurgeonJIT JIT;
+    Profiler::SetSymbolizer([&JIT](uint64_t address, std::string& name) { return JIT.SymbolizeAddress(address, name); });
+    Profiler::SetDisassembler([&JIT](const std::string& function) { return JIT.DisassembleFunction(function); });
+    SetHostCommandHandler([&JIT](const std::vector<std::string>& tokens) { return HandleInstrumentationCommand(JIT, tokens); });
+    // The forked child must not inherit the JIT's locks held by another thread, and a snapshot
+    // must not roll back memory written by another thread: the JIT stays locked while it is active.
+    Checkpoint::SetPauseHandlers([&JIT](bool forking)
+        {
+            controlChannelMutex.lock();
+            JIT.PauseBackgroundThreads(!forking);
+        },
+        [&JIT]()
+        {
+            JIT.ResumeBackgroundThreads();
+            controlChannelMutex.unlock();
+        });
 
     // Preload tools from the configuration file.
     std::fstream toolFile{ "tools.cfg" };
@@ -140,75 +376,60 @@ int main(int argc, char** argv) {
         toolFile.close();
     }
 
-    // Prepare DiagnosticEngine 
-    DiagnosticOptions DiagOpts;
-    TextDiagnosticPrinter* textDiagPrinter =
-        new clang::TextDiagnosticPrinter(errs(),
-            &DiagOpts);
-    IntrusiveRefCntPtr<clang::DiagnosticIDs> pDiagIDs;
-    DiagnosticsEngine* pDiagnosticsEngine =
-        new DiagnosticsEngine(pDiagIDs,
-            &DiagOpts,
-            textDiagPrinter);
-
     std::vector<std::unique_ptr<llvm::Module>> modules;
 
 
     std::vector<std::string> constructors;
     std::vector<VModuleKey> keys;
 
-
-    // Initialize CompilerInvocation
-    for (auto& name : filenames)
+    // Arguments shared by every translation unit (the filename is prepended per unit).
+    std::vector<const char*> commonArgs;
+    for (size_t i = 3; i < argc; ++i)
     {
-        // Prepare compilation arguments
-        std::vector<const char*> args;
-        args.push_back(name.c_str());
-        for (size_t i = 3; i < argc; ++i)
-        {
-            args.push_back(argv[i]);
-        }
-        for (size_t i = 0; i < defaultArgs.size(); ++i)
-            args.push_back(defaultArgs[i].c_str());
-
-        std::shared_ptr<CompilerInvocation> CI = std::make_shared<CompilerInvocation>();
-        CompilerInvocation::CreateFromArgs(*CI, &args[0], &args[0] + args.size(), *pDiagnosticsEngine);
-
-        // Map code filename to a memoryBuffer
-        auto file = MemoryBuffer::getFile(name);
-        if (!file)
-        {
-            std::cout << "Error reading file " << name << "\n";
-            exit(-1);
-        }
-
-        std::unique_ptr<MemoryBuffer> buffer = std::move(file.get());
-        CI->getPreprocessorOpts().addRemappedFile(name, buffer.get());
+        commonArgs.push_back(argv[i]);
+    }
+    for (size_t i = 0; i < defaultArgs.size(); ++i)
+        commonArgs.push_back(defaultArgs[i].c_str());
 
+    size_t numJobs = OptionsStore::GetNumberOfCompileJobs(filenames.size());
 
-        std::cout << "Loaded file " << name << "\n";
+    // Translation units are parsed and lowered to IR concurrently, each in its own
+    // LLVMContext. The results are handed to the JIT in the original order, as soon
+    // as each unit (and all the ones before it) is ready.
+    std::vector<CompiledTranslationUnit> units(filenames.size());
+    std::vector<std::promise<void>> unitsReady(filenames.size());
+    std::atomic<size_t> nextUnit{ 0 };
 
-        // Create and initialize CompilerInstance
-        CompilerInstance Clang;
-        Clang.setInvocation(CI);
-        Clang.createDiagnostics();
+    std::vector<std::thread> workers;
+    for (size_t job = 0; job < numJobs; ++job)
+    {
+        workers.emplace_back([&]()
+            {
+                size_t index;
+                while ((index = nextUnit++) < filenames.size())
+                {
+                    units[index] = CompileTranslationUnit(filenames[index], commonArgs);
+                    unitsReady[index].set_value();
+                }
+            });
+    }
 
+    for (size_t i = 0; i < filenames.size(); ++i)
+    {
+        unitsReady[i].get_future().wait();
+        auto& unit = units[i];
 
-        const std::shared_ptr<clang::TargetOptions> targetOptions = std::make_shared<clang::TargetOptions>();
-        targetOptions->Triple = std::string("bpf");
-        TargetInfo* pTargetInfo = TargetInfo::CreateTargetInfo(*pDiagnosticsEngine, targetOptions);
-        Clang.setTarget(pTargetInfo);
+        llvm::errs() << unit.diagnostics;
 
-        // Create and execute action
-        CodeGenAction* compilerAction = new EmitLLVMOnlyAction();
-        //CodeGenAction *compilerAction = new EmitAssemblyAction();
-        if (!Clang.ExecuteAction(*compilerAction))
+        if (!unit.module)
         {
-            std::cout << "Error compiling\n";
+            std::cout << "Error compiling " << filenames[i] << "\n";
             exit(-1);
         }
 
-        auto output = compilerAction->takeModule();
+        std::cout << "Loaded file " << filenames[i] << "\n";
+
+        auto output = std::move(unit.module);
         //llvm::errs() << *output << "\n";
 
         //modules.push_back(std::move(output));
@@ -226,11 +447,13 @@ int main(int argc, char** argv) {
              llvm::errs() << "Error: " << Err << "\n";
              exit(-1);
          } */
+    }
 
+    for (auto& worker : workers)
+        worker.join();
 
-        buffer.release();
-    }
 
+    JIT.StartTieredCompilation(keys);
 
     for (auto& key : keys)
     {
@@ -265,6 +488,13 @@ int main(int argc, char** argv) {
         }
     }
 
+    std::string controlFifo = OptionsStore::GetOption("control_fifo");
+    if (controlFifo.size() > 0)
+    {
+        std::thread controlThread(RunControlChannel, &JIT, controlFifo);
+        controlThread.detach();
+    }
+
     auto entrySymbol = JIT.findSymbol("main");
 
     if (entrySymbol)
@@ -278,10 +508,10 @@ int main(int argc, char** argv) {
             int numArgs = 0;
             char** args = nullptr;
 
-            std::set<std::string> instrumented;
-
             if (i == 1)
             {
+                JIT.StartSpeculativeCompilation();
+
                 while (true)
                 {
                     auto tokens = ShowPromptAndGetInput("(surgeon)");
@@ -290,43 +520,18 @@ int main(int argc, char** argv) {
                     {
                         std::cout << "Command not recognized\n";
                     }
-                    else if (tokens[0] == "break" || (tokens[0].size() == 1 && tokens[0][0] == 'b'))
+                    else if (HandleInstrumentationCommand(JIT, tokens))
                     {
-                        const std::string& function = tokens.size() > 1 ? tokens[1] : "";
-
-
-                        if (tokens.size() < 3)
-                        {
-                            std::cout << "Command 'break' requires at least two arguments (function to instrument and tool name)\n";
-                        }
-                        else if (JIT.IsFunctionInAnySubtree(function, instrumented)) {
-                            std::cout << "Function " << function << " is already in an instrumented tree\n";
-                        }
-                        else if (!JIT.findSymbol(function, false))
-                        {
-                            std::cout << "Function '" << function << "' doesn't exist\n";
-                        }
-                        else
-                        {
-                            bool toolsExist = true;
-                            std::vector<std::string> tools{ tokens.begin() + 2, tokens.end() };
-                            for (auto& tool : tools) {
-                                if (!JIT.IsCSIToolRegistered(tool))
-                                {
-                                    std::cout << "Tool " << tool << " is not registered\n";
-                                    toolsExist = false;
-                                    break;
-                                }
-                            }
-                            if (toolsExist) {
-                                void* newAddr = JIT.RecompileFunction(function, true, tools);
-                                instrumented.insert(function);
-                                //  std::cout << "Old addr: " << addr << ", new addr: " << newAddr << "\n";
-                            }
-                        }
+                        // break/unbreak.
+                    }
+                    else if (Profiler::HandleCommand(tokens))
+                    {
+                        // profile/disasm. Profiling started here samples the program from its first instruction.
                     }
                     else if (tokens[0] == "run" || (tokens[0].size() == 1 && tokens[0][0] == 'r'))
                     {
+                        JIT.StopSpeculativeCompilation();
+
                         numArgs = tokens.size();
                         args = new char* [numArgs];
 
@@ -354,6 +559,10 @@ int main(int argc, char** argv) {
                         }
 
                     }
+                    else if (tokens[0] == "tiers")
+                    {
+                        JIT.PrintTiers();
+                    }
                     else if (tokens[0] == "quit" || tokens[0] == "exit" || (tokens[0].size() == 1 && tokens[0][0] == 'q'))
                     {
                         exit(0);
@@ -370,9 +579,19 @@ int main(int argc, char** argv) {
 
             int(*fn)(int, char**) = (int(*)(int, char**))(addr);
 
+            programRunning = true;
             int res = fn(numArgs, args);
+            programRunning = false;
             std::cout << "Main returned " << res << "\n";
 
+            if (Profiler::IsRunning())
+            {
+                Profiler::Stop();
+                Profiler::Report(std::cout);
+            }
+
+            JIT.UnloadRetiredInstrumentation();
+
             for (int i = 0; i < numArgs; ++i)
                 delete[] args[i];
             delete[]args;